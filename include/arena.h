@@ -0,0 +1,73 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ARENA_MAX        8
+#define ARENA_ALIGN      16
+#define ARENA_CHUNK_SIZE 16384 // default chunk, larger requests get a chunk of their own
+
+// Objects start right after the header, which is padded to ARENA_ALIGN
+typedef struct arena_chunk
+{
+    struct arena_chunk *next; // older chunk
+    uint32_t size;            // bytes after the header
+    uint32_t used;
+    uint32_t pages;
+} __attribute__((aligned(ARENA_ALIGN))) arena_chunk_t;
+
+/*
+ * Bump allocator for memory that dies together: a request or a packet takes
+ * a mark, allocates freely and resets to the mark when it is done. Nothing
+ * is freed on its own. Chunks come from the heap window a few pages at a
+ * time; one standard chunk is kept as a spare so an arena that keeps
+ * getting reset does not go back to the page allocator each time.
+ *
+ * Marks nest, so an interrupt handler can use an arena another context is
+ * using as long as it resets to its own mark before returning.
+ */
+typedef struct
+{
+    const char *name;
+    uint32_t chunk_size;
+    arena_chunk_t *chunks; // newest first, allocations come from the head
+    arena_chunk_t *spare;
+
+    // Statistics
+    uint32_t bytes;     // allocated since the arena was last empty
+    uint32_t peak;
+    uint32_t allocs;
+    uint32_t resets;
+    uint32_t chunk_allocs;
+    bool active;
+} arena_t;
+
+typedef struct
+{
+    arena_chunk_t *chunk;
+    uint32_t used;
+    uint32_t bytes;
+} arena_mark_t;
+
+/**
+ * Create an arena.
+ * @param chunk_size Bytes per chunk, 0 for ARENA_CHUNK_SIZE.
+ */
+arena_t *arena_create(const char *name, uint32_t chunk_size);
+// Free every chunk, the spare included
+void arena_destroy(arena_t *arena);
+
+// Allocation aligned to ARENA_ALIGN, NULL when out of memory
+void *arena_alloc(arena_t *arena, size_t size);
+
+arena_mark_t arena_mark(arena_t *arena);
+// Drop everything allocated since `mark`
+void arena_reset(arena_t *arena, arena_mark_t mark);
+// Drop everything
+void arena_release(arena_t *arena);
+
+const arena_t *arena_get(int index);
+
+#endif
@@ -4,14 +4,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "rtl8139.h"
+#include "ktimer.h"
 
 #pragma pack(push, 1) // Disable struct padding
 
 #define ARP_REQUEST 1
 #define ARP_REPLY   2
 #define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30000 
+#define ARP_CACHE_TIMEOUT 30000 // ms
 #define MAX_PENDING_PACKETS 5
+#define ARP_PENDING_PAYLOAD 1500 // largest queued payload, one MTU
 
 // Ethernet header
 struct eth_header {
@@ -33,21 +35,23 @@ struct arp_packet {
     uint8_t target_ip[4];
 };
 
-struct arp_cache_entry {
-    uint32_t ip;
-    uint8_t mac[6];
-    uint32_t timestamp;
-};
-
 struct pending_packet {
     uint32_t dst_ip;
     uint8_t protocol;
     uint8_t *payload;
     uint16_t payload_len;
-    uint32_t timestamp;
+    uint32_t timestamp; // ktime_get_ms()
 };
 #pragma pack(pop)
 
+// Not a wire format: left unpacked so the timer inside stays aligned
+struct arp_cache_entry {
+    uint32_t ip; // 0 for a free slot
+    uint8_t mac[6];
+    uint32_t timestamp; // ktime_get_ms()
+    ktimer_t expire;    // frees the slot ARP_CACHE_TIMEOUT after the last update
+};
+
 extern struct arp_cache_entry arp_cache[ARP_CACHE_SIZE];
 extern struct pending_packet pending_queue[MAX_PENDING_PACKETS];
 extern int pending_count;
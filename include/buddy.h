@@ -0,0 +1,55 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BUDDY_MAX_ORDER 12 // orders 0..11, largest block is 2048 pages (8MB)
+#define BUDDY_NONE 0xFFFFFFFF
+
+/*
+ * Binary buddy allocator over a range of physical blocks.
+ *
+ * Every order has its own free bitmap: bit i of free_map[k] is set when the
+ * block run starting at (i << k) is a free buddy of order k. Each free map has
+ * a summary with one bit per map word (set = word has a free bit) so lookups
+ * skip empty space 1024 heads at a time. Block numbers passed in and out are
+ * relative to the area base.
+ */
+typedef struct
+{
+    uint32_t base;    // first block covered by this area
+    uint32_t blocks;  // number of blocks covered
+    uint32_t free_blocks;
+    uint32_t *free_map[BUDDY_MAX_ORDER];
+    uint32_t *summary[BUDDY_MAX_ORDER];
+    uint32_t map_words[BUDDY_MAX_ORDER];
+    uint32_t free_count[BUDDY_MAX_ORDER]; // free heads per order
+    uint32_t hint[BUDDY_MAX_ORDER];       // lowest map word that may hold a free head
+} buddy_area_t;
+
+// Number of 32-bit words of storage buddy_init needs for `blocks` blocks
+uint32_t buddy_storage_words(uint32_t blocks);
+
+// Set up an empty area (nothing free); storage must hold buddy_storage_words(blocks) words
+void buddy_init(buddy_area_t *area, uint32_t base, uint32_t blocks, uint32_t *storage);
+
+// Smallest order whose block holds `count` blocks
+uint32_t buddy_order_for(uint32_t count);
+
+// Allocate a 2^order block, returns relative block number or BUDDY_NONE
+uint32_t buddy_alloc(buddy_area_t *area, uint32_t order);
+// Allocate a 2^order block lying entirely inside [start, end)
+uint32_t buddy_alloc_in_range(buddy_area_t *area, uint32_t order, uint32_t start, uint32_t end);
+// Allocate exactly `count` blocks, the unused tail of the buddy block is given back
+uint32_t buddy_alloc_blocks(buddy_area_t *area, uint32_t count);
+
+// Return a 2^order block, merging it with free buddies
+void buddy_free(buddy_area_t *area, uint32_t block, uint32_t order);
+// Return an arbitrary run of blocks
+void buddy_free_range(buddy_area_t *area, uint32_t block, uint32_t count);
+// Take an arbitrary run of blocks out of the free pool (blocks already taken are skipped)
+void buddy_reserve_range(buddy_area_t *area, uint32_t block, uint32_t count);
+
+#endif
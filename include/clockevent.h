@@ -0,0 +1,64 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CLOCKEVENT_MAX_DELTA_NS 1000000000 // longest one-shot programmed at once, longer waits re-arm
+
+/*
+ * Something that raises an interrupt after a programmable delay. One-shot
+ * devices are programmed for the earliest pending hrtimer and nothing else,
+ * so an idle system takes no timer interrupts at all. The periodic PIT is
+ * the fallback (and what runs before clockevent_init): hrtimers then expire
+ * on the first tick after their deadline.
+ */
+typedef struct
+{
+    const char *name;
+    bool oneshot;
+    uint32_t mult;         // device counts per ns, << 32
+    uint32_t min_delta_ns; // also the shortest wait worth halting for
+    uint32_t max_delta_ns;
+    void (*set_next)(uint32_t counts);
+} clockevent_device_t;
+
+/*
+ * A callback at an absolute ktime_get_ns() deadline. Callbacks run in
+ * interrupt context and may start the timer again (or any other).
+ */
+typedef struct hrtimer
+{
+    uint64_t expires;
+    void (*function)(struct hrtimer *);
+    void *data;
+    struct hrtimer *next; // pending timers, soonest first
+    bool queued;
+} hrtimer_t;
+
+typedef struct
+{
+    uint32_t events;   // timer interrupts
+    uint32_t empty;    // interrupts that found nothing expired (early or re-armed long waits)
+    uint32_t expired;  // hrtimer callbacks run
+    uint32_t programs; // one-shot reprogrammings
+} clockevent_stats_t;
+
+extern clockevent_stats_t clockevent_stats;
+
+// Pick the best device: LAPIC timer, else PIT one-shot, else keep the periodic PIT.
+// One-shot needs the TSC as the ktime source, so call after ktime_init and vmm_init.
+void clockevent_init();
+const clockevent_device_t *clockevent_get_device();
+bool clockevent_tickless();
+// How far off an hrtimer can expire, the periodic tick or the device's minimum delta
+uint32_t clockevent_resolution_ns();
+
+// Run expired hrtimers and program the next event; called from the timer interrupt
+void clockevent_handle();
+
+void hrtimer_start(hrtimer_t *timer, uint64_t expires);
+void hrtimer_cancel(hrtimer_t *timer);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CMA_H
+#define CMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CMA_SIZE         (16 * 1024 * 1024) // reserved at boot, less on small machines
+#define CMA_ALIGN_BLOCKS 1024               // 4MB, so the area can be mapped with large pages
+#define CMA_MAX_BLOCKS   (CMA_SIZE / 4096)
+#define CMA_LEND_DIVISOR 4                  // at most a quarter of the area is lent out
+
+/*
+ * Contiguous memory area. A physically contiguous range is taken out of the
+ * zones during pmm_init and handed out here to users that need large
+ * contiguous buffers (DMA rings, the VESA back buffer). Its blocks stay
+ * marked used in the PMM bitmap so the buddy allocator never sees them.
+ *
+ * While idle, blocks are lent to general allocations, starting from the top
+ * of the area (claims are first-fit from the bottom). A lent block that is
+ * still sitting in the zero pool is taken back when a claim needs it; one
+ * that is in use is skipped until its owner frees it, which returns it here.
+ */
+typedef struct
+{
+    uint32_t start_block; // 0 blocks when no area could be reserved
+    uint32_t blocks;
+    uint32_t claimed;   // blocks handed out by cma_alloc
+    uint32_t lent;      // blocks currently lent to general allocations
+    uint32_t reclaimed; // lent blocks taken back from the zero pool
+    uint32_t claims;
+    uint32_t failures;
+} cma_stats_t;
+
+extern cma_stats_t cma_stats;
+
+// Called by pmm_init once the area has been marked used
+void cma_init(uint32_t start_block, uint32_t blocks);
+
+/**
+ * Claim physically contiguous blocks from the area.
+ * @param count Number of 4KB blocks.
+ * @param align_blocks Alignment of the first block, a power of two (1 for none).
+ * @return Physical address, or NULL when no run is free.
+ */
+void *cma_alloc(uint32_t count, uint32_t align_blocks);
+void cma_release(void *phys, uint32_t count);
+
+bool cma_contains(uint32_t block);
+
+// An idle block for a general allocation, or NULL
+void *cma_lend_block();
+
+// Called by the PMM when blocks of the area are freed through the normal paths
+void cma_put_blocks(uint32_t block, uint32_t count);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DMA_MAX_POOLS  16
+#define DMA_MAX_CHUNKS 64 // backing allocations across all pools
+
+/*
+ * Memory a device reads or writes directly. x86 keeps bus-master DMA
+ * coherent with the CPU caches, so buffers are mapped write-back and need
+ * no flushing; they are physically contiguous and pinned.
+ */
+
+typedef struct dma_chunk
+{
+    uint8_t *virt;
+    uint32_t phys;
+    uint32_t size;
+    struct dma_chunk *next;
+} dma_chunk_t;
+
+/*
+ * Fixed-size blocks (descriptors, packet buffers) carved out of coherent
+ * chunks. Freed blocks go on a free list and are handed out again without
+ * touching the page allocator. Blocks of a page or less never straddle a
+ * page boundary.
+ */
+typedef struct
+{
+    const char *name;
+    uint32_t size;  // block size, a multiple of align
+    uint32_t align;
+    dma_chunk_t *chunks;
+    void *free_list;
+    uint32_t in_use;
+    uint32_t total;
+    bool active;
+} dma_pool_t;
+
+/**
+ * Allocate physically contiguous, zeroed memory for a device.
+ * @param size Size in bytes.
+ * @param phys Receives the bus address of the buffer (may be NULL).
+ * @return Kernel virtual address, or NULL on failure.
+ */
+void *dma_alloc_coherent(size_t size, uint32_t *phys);
+
+/**
+ * Free memory from dma_alloc_coherent.
+ */
+void dma_free_coherent(void *virt, size_t size);
+
+/**
+ * Create a pool of `size`-byte blocks aligned to `align` (a power of two).
+ */
+dma_pool_t *dma_pool_create(const char *name, size_t size, size_t align);
+void *dma_pool_alloc(dma_pool_t *pool, uint32_t *phys);
+void dma_pool_free(dma_pool_t *pool, void *virt);
+// Free every chunk of a pool, blocks still in use included
+void dma_pool_destroy(dma_pool_t *pool);
+
+const dma_pool_t *dma_get_pool(int index);
+
+#endif
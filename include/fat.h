@@ -106,6 +106,10 @@ typedef struct {
 void fat32_init_volume(FAT32_Volume* volume);
 bool fat32_find_file(FAT32_Volume* volume, const char* path, FAT32_File* out_file);
 bool fat32_read_file(FAT32_Volume *volume, FAT32_File *file, uint32_t offset, uint8_t *buffer, uint32_t size);
+// Map a file read-only; pages are read from disk on first access. The mapping is
+// one byte longer than the file and that byte is zero, so text can be used as a string
+void *fat32_map_file(FAT32_Volume *volume, FAT32_File *file);
+void fat32_unmap_file(void *addr);
 void fat32_list_dir(FAT32_Volume* volume, FAT32_File* dir, FAT32_DirList* dir_list);
 bool fat32_next_dir_entry(FAT32_Volume* volume, FAT32_DirList* dir_list, FAT32_File* out_file, char out_name[256]);
 void fat32_unmount_volume(FAT32_Volume* volume);
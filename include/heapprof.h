@@ -0,0 +1,67 @@
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HEAPPROF_LIVE_SLOTS 8192 // live allocations tracked at once, a power of two
+#define HEAPPROF_SITE_SLOTS 256  // distinct (call site, tag) pairs, a power of two
+
+typedef enum
+{
+    HEAP_TAG_KERNEL = 0, // anything not inside a tagged subsystem
+    HEAP_TAG_SHELL,
+    HEAP_TAG_NET,   // packet processing, including TCP and the HTTP server
+    HEAP_TAG_COUNT
+} heap_tag_t;
+
+/*
+ * A call site of malloc/calloc/realloc, keyed by the return address and the
+ * subsystem tag that was current at the time. Callers can be resolved with
+ * addr2line against the kernel image.
+ */
+typedef struct
+{
+    uint32_t caller; // 0 for an unused slot
+    uint16_t tag;
+    uint32_t live_bytes;
+    uint32_t live_count;
+    uint32_t allocs;
+    uint32_t alloc_bytes;
+    uint32_t frees;
+    uint32_t allocs_at_mark; // allocs when heapstat last reported, for the rate
+} heapprof_site_t;
+
+typedef struct
+{
+    uint32_t live_bytes;
+    uint32_t live_count;
+    uint32_t peak_bytes;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t untracked;  // allocations that found the live table or the site table full
+    uint32_t mark_ticks; // g_ticks when heapstat last reported
+} heapprof_stats_t;
+
+extern heapprof_stats_t heapprof_stats;
+
+/**
+ * Make `tag` the current subsystem tag.
+ * @return The previous tag, to be restored on the way out.
+ */
+heap_tag_t heapprof_set_tag(heap_tag_t tag);
+const char *heapprof_tag_name(heap_tag_t tag);
+
+// Called by liballoc for every allocation and free
+void heapprof_alloc(void *ptr, size_t size, void *caller);
+void heapprof_free(void *ptr);
+
+const heapprof_site_t *heapprof_get_site(int index);
+
+// Start a new rate interval: alloc rates are reported relative to the last mark
+void heapprof_mark();
+// Every site and tag as one line each on the serial port
+void heapprof_dump_serial();
+
+#endif
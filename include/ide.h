@@ -5,11 +5,22 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Physical region descriptor: one contiguous piece of a bus-master transfer
+typedef struct {
+    uint32_t phys; // must not cross a 64KB boundary
+    uint16_t size; // bytes, 0 means 64KB
+    uint16_t flags;
+} __attribute__((packed)) IDE_PRD;
+
 typedef struct {
     uint16_t base;  // i/o base port
     uint16_t control;  // control port
     uint16_t bm_ide; // bus-master ide port
     uint16_t no_intr; // no interrupt port
+    IDE_PRD *prdt; // descriptor table for bus-master transfers
+    uint32_t prdt_phys;
+    uint8_t *dma_buffer; // bounce buffer, ATA_DMA_MAX_SECTORS long
+    uint32_t dma_phys;
 } IDE_CHANNELS;
 
 typedef struct {
@@ -45,6 +56,24 @@ typedef struct {
 #define ATA_REG_CONTROL      0x0C
 #define ATA_REG_ALTSTATUS    0x0C
 #define ATA_REG_DEVADDRESS   0x0D
+#define ATA_REG_BMCOMMAND    0x0E
+#define ATA_REG_BMSTATUS     0x10
+#define ATA_REG_BMPRDT       0x12 // 32-bit, written with outportl
+
+// Bus-master command and status bits
+#define ATA_BM_CMD_START     0x01
+#define ATA_BM_CMD_READ      0x08 // device to memory
+#define ATA_BM_SR_ACTIVE     0x01
+#define ATA_BM_SR_ERR        0x02
+#define ATA_BM_SR_IRQ        0x04
+
+#define ATA_PRD_EOT          0x8000 // last descriptor of the table
+#define ATA_DMA_MAX_SECTORS  128    // 64KB bounce buffer per channel
+#define ATA_DMA_PRDS         (ATA_DMA_MAX_SECTORS * ATA_SECTOR_SIZE / 4096)
+
+// IDE controllers with bus-master DMA behind BAR4
+#define PIIX3_IDE_DEVICE_ID  0x7010
+#define PIIX4_IDE_DEVICE_ID  0x7111
 
 // ATA drive status
 #define ATA_SR_BSY     0x80    // Busy
@@ -122,7 +151,7 @@ prim_channel_base_addr: Primary channel base address(0x1F0-0x1F7)
 prim_channel_control_base_addr: Primary channel control base address(0x3F6)
 sec_channel_base_addr: Secondary channel base address(0x170-0x177)
 sec_channel_control_addr: Secondary channel control base address(0x376)
-bus_master_addr: Bus master address(pass 0 for now)
+bus_master_addr: Bus master address, secondary channel at +8 (0 for PIO only)
 */
 void ide_init(uint32_t prim_channel_base_addr, uint32_t prim_channel_control_base_addr,
             uint32_t sec_channel_base_addr, uint32_t sec_channel_control_addr,
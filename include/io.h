@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /**
  * read a byte from given port number
@@ -49,4 +50,38 @@ uint16_t inportd(uint16_t port);
 
 void outportd(uint16_t port, uint16_t data);
 
+/**
+ * run cpuid for the given leaf (subleaf 0)
+ */
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+
+/**
+ * read given model specific register
+ */
+uint64_t rdmsr(uint32_t msr);
+
+/**
+ * write given value to model specific register
+ */
+void wrmsr(uint32_t msr, uint64_t value);
+
+/**
+ * disable interrupts, returning the previous EFLAGS for irq_restore
+ */
+uint32_t irq_save();
+
+/**
+ * re-enable interrupts if they were enabled when irq_save was called
+ */
+void irq_restore(uint32_t flags);
+
+/**
+ * halt until done(arg) is true, for waits that an interrupt handler ends.
+ * done is called with interrupts off and the following sti; hlt can not miss
+ * an interrupt in between, as sti only takes effect after the next
+ * instruction. done may consume what it waits for. Interrupts are back to
+ * their previous state on return.
+ */
+void halt_until(bool (*done)(void *), void *arg);
+
 #endif
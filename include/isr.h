@@ -114,6 +114,8 @@ extern void irq_12();
 extern void irq_13();
 extern void irq_14();
 extern void irq_15();
+extern void irq_16(); // LAPIC timer
+extern void irq_31(); // LAPIC spurious
 
 // IRQ default constants
 #define IRQ_BASE 0x20
@@ -0,0 +1,71 @@
+#ifndef KTIME_H
+#define KTIME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
+#define NSEC_PER_SEC  1000000000
+#define USEC_PER_SEC  1000000
+#define MSEC_PER_SEC  1000
+
+#define KTIME_CAL_MS     10 // length of one PIT channel 2 calibration run
+#define KTIME_CAL_ROUNDS 3  // runs at boot, the shortest wins (SMIs only make a run longer)
+#define KTIME_TSC_SHIFT  24 // cycles * mult >> shift = ns
+
+typedef enum
+{
+    KTIME_NONE = 0, // before ktime_init: delays fall back to port 0x80 writes
+    KTIME_PIT,      // PIT channel 0 ticks plus the current count, ~838ns resolution
+    KTIME_TSC,      // TSC calibrated against PIT channel 2
+} ktime_source_t;
+
+/*
+ * Monotonic time since ktime_init. The TSC is used when the CPU has one and
+ * calibration against PIT channel 2 succeeds, otherwise the PIT itself: the
+ * tick count plus how far channel 0 has counted into the current tick.
+ * There is no HPET: finding it needs the ACPI tables, which nothing parses.
+ */
+typedef struct
+{
+    ktime_source_t source;
+    uint32_t tsc_khz;
+    uint32_t mult; // ns per cycle << KTIME_TSC_SHIFT
+    uint64_t tsc_base;
+    bool invariant; // TSC rate does not change with P-states or stop in C-states
+} ktime_clock_t;
+
+extern ktime_clock_t ktime_clock;
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Calibrate and pick a clock source; needs timer_init for the PIT fallback
+void ktime_init();
+const char *ktime_source_name(ktime_source_t source);
+
+uint64_t ktime_get_ns();
+uint32_t ktime_get_us(); // wraps after 71 minutes, compare by subtraction
+uint32_t ktime_get_ms(); // wraps after 49 days, compare by subtraction
+
+// Busy-wait delays for device timing; precise to the clock source's resolution
+void ndelay(uint32_t ns);
+void udelay(uint32_t us);
+// Wait until ktime_get_ns() reaches `deadline`, halting until an hrtimer fires for it
+void ktime_wait_until(uint64_t deadline);
+
+// 64-by-32 division without libgcc
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t *remainder);
+
+static inline uint64_t div_u64(uint64_t dividend, uint32_t divisor)
+{
+    return div_u64_rem(dividend, divisor, NULL);
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define KTIMER_LEVEL_BITS 6
+#define KTIMER_LEVEL_SIZE (1 << KTIMER_LEVEL_BITS)
+#define KTIMER_LEVEL_MASK (KTIMER_LEVEL_SIZE - 1)
+#define KTIMER_LEVELS     5                                               // 30 bits of ms, 12 days ahead
+#define KTIMER_MAX_DELTA  ((1u << (KTIMER_LEVELS * KTIMER_LEVEL_BITS)) - 1) // longer timeouts fire at this
+
+/*
+ * Millisecond kernel timers on a hierarchical timing wheel. Level 0 has a
+ * slot per millisecond for the next 64ms, each level above covers 64 times
+ * the span of the one below, and a slot of a higher level is cascaded down
+ * when the wheel reaches it. Adding, cancelling and re-arming a timer is a
+ * list insert or unlink; nothing ever walks the pending timers.
+ *
+ * The wheel is run from one hrtimer programmed for the next slot that has
+ * anything in it, so timer callbacks run in interrupt context. They may
+ * re-arm or cancel any timer, including their own.
+ */
+typedef struct ktimer
+{
+    struct ktimer *next;
+    struct ktimer **pprev; // NULL when not pending
+    uint32_t expires;      // ktime_get_ms() deadline, wraps with it
+    uint16_t slot;         // level * KTIMER_LEVEL_SIZE + index while pending
+    void (*function)(struct ktimer *);
+    void *data;
+} ktimer_t;
+
+typedef struct
+{
+    uint32_t pending;
+    uint32_t expired;  // callbacks run
+    uint32_t cascaded; // timers moved down a level
+    uint32_t wakeups;  // wheel runs from the hrtimer
+} ktimer_stats_t;
+
+extern ktimer_stats_t ktimer_stats;
+
+// Start the wheel at the current time; needs ktime and clockevents
+void ktimer_wheel_init();
+
+// Set the callback of a timer that is not pending; a zeroed ktimer_t is not pending
+void ktimer_setup(ktimer_t *timer, void (*function)(ktimer_t *), void *data);
+// Arm or re-arm at an absolute ktime_get_ms() deadline
+void ktimer_mod(ktimer_t *timer, uint32_t expires);
+// Arm or re-arm `delay_ms` from now
+void ktimer_start(ktimer_t *timer, uint32_t delay_ms);
+// True if the timer was pending
+bool ktimer_cancel(ktimer_t *timer);
+
+static inline bool ktimer_pending(const ktimer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef KVA_H
+#define KVA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rbtree.h"
+
+#define KVA_MAX_EXTENTS 512 // free extents across all spaces
+
+typedef enum
+{
+    KVA_BEST_FIT = 0, // smallest free extent that fits, lowest address on ties
+    KVA_NEXT_FIT,     // first fit at or after the previous allocation, wrapping around
+} kva_policy_t;
+
+/*
+ * A free extent of virtual address space. Every extent sits in two trees:
+ * by_addr ordered by start (augmented with the largest extent in each
+ * subtree, for next-fit) and by_size ordered by (pages, start) for best-fit.
+ */
+typedef struct kva_extent
+{
+    rb_node_t addr_node;
+    rb_node_t size_node;
+    uint32_t start;
+    uint32_t pages;
+    uint32_t max_pages; // largest extent in this by_addr subtree
+    struct kva_extent *next_free;
+} kva_extent_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t start; // window [start, end), page aligned
+    uint32_t end;
+    rb_tree_t by_addr;
+    rb_tree_t by_size;
+    uint32_t free_pages;
+    uint32_t extents;
+    uint32_t cursor; // next-fit position
+} kva_space_t;
+
+void kva_init(kva_space_t *space, const char *name, uint32_t start, uint32_t end);
+
+// Returns the start of `pages` free pages, or 0 when nothing fits
+uint32_t kva_alloc(kva_space_t *space, uint32_t pages, kva_policy_t policy);
+// Like kva_alloc (best fit), but the result is congruent to `offset` modulo `align` (a power of two)
+uint32_t kva_alloc_aligned(kva_space_t *space, uint32_t pages, uint32_t align, uint32_t offset);
+// Take [addr, addr + pages) out of the free space, fails unless all of it is free
+bool kva_reserve(kva_space_t *space, uint32_t addr, uint32_t pages);
+// Give [addr, addr + pages) back, merging with free neighbours
+void kva_release(kva_space_t *space, uint32_t addr, uint32_t pages);
+
+bool kva_contains(const kva_space_t *space, uint32_t addr);
+uint32_t kva_largest_free(const kva_space_t *space);
+
+#endif
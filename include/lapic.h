@@ -0,0 +1,45 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LAPIC_TIMER_VECTOR    48 // right after the 8259 IRQs
+#define LAPIC_SPURIOUS_VECTOR 63 // low four bits set, older CPUs force them
+
+#define MSR_APIC_BASE        0x1B
+#define APIC_BASE_ENABLE     (1 << 11)
+
+// Register offsets from the LAPIC base
+#define LAPIC_REG_ID         0x020
+#define LAPIC_REG_TPR        0x080
+#define LAPIC_REG_EOI        0x0B0
+#define LAPIC_REG_SVR        0x0F0
+#define LAPIC_REG_LVT_TIMER  0x320
+#define LAPIC_REG_LVT_LINT0  0x350
+#define LAPIC_REG_LVT_LINT1  0x360
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CUR  0x390
+#define LAPIC_REG_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE     (1 << 8)
+#define LAPIC_LVT_MASKED     (1 << 16)
+#define LAPIC_LVT_EXTINT     (7 << 8)
+#define LAPIC_LVT_NMI        (4 << 8)
+#define LAPIC_TIMER_DIV_16   0x3
+
+/*
+ * The local APIC is only used for its timer: the 8259 keeps delivering
+ * device IRQs through LINT0 in virtual-wire mode.
+ */
+
+// Map and enable the local APIC, false if the CPU has none
+bool lapic_init();
+void lapic_eoi();
+
+// Timer input frequency in kHz after the divider, measured against ktime
+uint32_t lapic_timer_calibrate();
+// Fire LAPIC_TIMER_VECTOR once after `counts`, 0 stops the timer
+void lapic_timer_oneshot(uint32_t counts);
+
+#endif
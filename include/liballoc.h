@@ -83,6 +83,18 @@ extern "C"
 	void *calloc(size_t, size_t);  //< The standard function.
 	void free(void *);			   //< The standard function.
 
+	/** The boundary tag allocator on its own, without the size class
+	 * front end. malloc() ends up here for large requests.
+	 */
+	void *liballoc_malloc_tagged(size_t);
+	void liballoc_free_tagged(void *);
+
+	/** malloc() and free() without the heap profiler hooks: size
+	 * classes first, the boundary tag allocator for the rest.
+	 */
+	void *liballoc_malloc_classes(size_t);
+	void liballoc_free_classes(void *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,6 +9,26 @@
 
 #define BLOCK_SIZE PAGE_SIZE
 
+#define HEAP_WINDOW_PAGES 16384 // 64MB of kernel VA reserved for liballoc
+
+/*
+ * liballoc grows inside its own window of kernel VA, so every growth is
+ * virtually contiguous. Frames come from one contiguous run when the PMM
+ * has one (a single ranged mapping, large pages where aligned), page by
+ * page otherwise.
+ */
+typedef struct
+{
+    uint32_t start;  // window start, 0 until the first growth
+    uint32_t pages;  // pages currently mapped
+    uint32_t grows;
+    uint32_t contiguous_grows;
+    uint32_t releases;
+    uint32_t released_pages;
+} heap_stats_t;
+
+extern heap_stats_t heap_stats;
+
 int liballoc_lock();
 int liballoc_unlock();
 void *liballoc_alloc(int);
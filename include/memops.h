@@ -0,0 +1,47 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MEMOPS_SMALL        64           // below this rep movsd/stosd, nothing to set up
+#define MEMOPS_NT_THRESHOLD (256 * 1024) // at least this much bypasses the cache when SSE2 is there
+
+typedef enum
+{
+    MEMOPS_BYTES = 0, // byte loop, the old implementation (benchmark only)
+    MEMOPS_MOVSD,     // rep movsd / stosd, any CPU
+    MEMOPS_MOVSB,     // rep movsb / stosb, fast strings (ERMS)
+    MEMOPS_SSE2,      // 16-byte loads and stores
+    MEMOPS_SSE2_NT,   // 16-byte non-temporal stores
+    MEMOPS_IMPL_COUNT
+} memops_impl_t;
+
+/*
+ * memcpy, memset and memmove pick an implementation by size: rep movsd for
+ * small sizes, `medium` up to MEMOPS_NT_THRESHOLD and `large` above it.
+ * Until memops_init runs (after fpu_enable has set CR4.OSFXSR) both are
+ * rep movsd. The SSE2 paths save and restore the XMM registers they use,
+ * so they are safe in interrupt handlers.
+ */
+typedef struct
+{
+    bool erms;
+    bool sse2;
+    memops_impl_t medium;
+    memops_impl_t large;
+} memops_config_t;
+
+extern memops_config_t memops;
+
+void memops_init();
+
+bool memops_available(memops_impl_t impl);
+const char *memops_impl_name(memops_impl_t impl);
+
+// A specific implementation, for benchmarks
+void *memcpy_impl(memops_impl_t impl, void *dst, const void *src, size_t n);
+void *memset_impl(memops_impl_t impl, void *dst, int c, size_t n);
+
+#endif
@@ -12,8 +12,34 @@
 #define PAGE_WRITABLE 0x2
 #define PAGE_USER     0x4
 #define PAGE_EXECUTABLE 0x200 
+#define PAGE_LARGE    0x80       // PDE PS flag: the entry maps a 4MB page (needs CR4.PSE)
+#define PAGE_GLOBAL   0x100      // kept across CR3 reloads (needs CR4.PGE), set on every kernel-half mapping
+#define LARGE_PAGE_SIZE 0x400000
+
+#define PAGING_FLUSH_MAX 32 // queued pages after which a batch flushes the whole TLB instead of invlpg
+#define PAGING_MAX_DIRECTORIES 16 // address spaces besides the kernel's
+
+typedef struct
+{
+    uint32_t invlpg;      // single-page TLB invalidations
+    uint32_t cr3_reloads; // full TLB flushes (a CR4.PGE toggle when global pages are on)
+    uint32_t batches;     // batches that had something to flush
+    uint32_t pages_mapped;
+    uint32_t pages_unmapped;
+} paging_stats_t;
 
 #define PAGE_UNCACHED  (1 << 4)  // PCD (Page Cache Disable) flag
+#define PAGE_WRITETHROUGH (1 << 3) // PWT flag
+
+/*
+ * Cache types. paging_init reprograms the PAT so that PWT alone selects
+ * write-combining; PAT entries 2 and 3 keep their UC-/UC defaults so
+ * PAGE_UNCACHED means the same as before. Without a PAT, PAGE_WC falls
+ * back to write-through.
+ */
+#define PAGE_WB        0                  // PAT entry 0: write-back
+#define PAGE_WC        PAGE_WRITETHROUGH  // PAT entry 1: write-combining
+#define PAGE_CACHE_MASK (PAGE_WRITETHROUGH | PAGE_UNCACHED)
 #define PAGE_RW        (1 << 1)  // R/W flag
 // Initialize paging system (allocates the page directory)
 void paging_init();
@@ -21,13 +47,45 @@ void paging_init();
 void paging_enable(uint32_t page_directory);
 // Map a physical page to a virtual address with given flags (creates page table if needed)
 bool paging_map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags);
+// Map a physically contiguous range, using 4MB pages where both addresses are 4MB aligned
+bool paging_map_range(uint32_t phys_addr, uint32_t virt_addr, uint32_t size, uint32_t flags);
 // Unmap a virtual address (clears page table entry and invalidates TLB)
 void paging_unmap_page(uint32_t virt_addr);
+// Unmap a range with one TLB flush at the end; slots that are not mapped are skipped
+void paging_unmap_range(uint32_t virt_addr, uint32_t size);
+// Change the cache type (PAGE_WB, PAGE_WC, PAGE_UNCACHED) of whatever is mapped in a range
+bool paging_set_cache(uint32_t virt_addr, uint32_t size, uint32_t cache);
+// Page table entry for a virtual address (a 4MB page reports the 4KB frame inside it), 0 if unmapped
+uint32_t paging_get_entry(uint32_t virt_addr);
+
+// Defer TLB flushes of map/unmap calls until the matching paging_batch_end (nests)
+void paging_batch_begin();
+void paging_batch_end();
 // Get the current page directory address
 uint32_t *get_page_directory(void);
 
+/*
+ * Address spaces. Each one shares the kernel's directory entries for the
+ * identity map and everything above KERNEL_VMEM_START, kept in sync as the
+ * kernel half changes, and has a user half of its own. Directories are
+ * named by their physical address, the value that goes in CR3.
+ * Map/unmap calls always edit the kernel's directory.
+ */
+// A new address space with an empty user half, 0 on failure
+uint32_t paging_create_directory();
+// Free a directory and its user-half page tables; it must not be loaded
+void paging_destroy_directory(uint32_t directory);
+void paging_switch_directory(uint32_t directory);
+uint32_t paging_kernel_directory();
+// Turn CR4.PGE on or off (off flushes global entries too), returns the previous setting
+bool paging_set_global(bool enable);
+
 bool paging_set_kernel_stack_guard();
 
 extern bool paging_active;
+extern bool paging_pse;
+extern bool paging_pat;
+extern bool paging_pge;
+extern paging_stats_t paging_stats;
 
 #endif
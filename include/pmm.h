@@ -5,15 +5,101 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "buddy.h"
+#include "multiboot.h"
+
 #define PMM_BLOCK_SIZE 4096   // 4KB blocks
 #define PMM_BLOCKS_PER_BYTE 8 // 8 blocks per byte (1 bit per block)
+#define PMM_BLOCKS_PER_WORD 32 // bitmap is scanned one 32-bit word at a time
+#define PMM_MAX_BITMAP_WORDS (0x100000 / PMM_BLOCKS_PER_WORD) // 4GB worth of blocks
+
+#define PMM_MAX_ADDRESS 0xFFFFF000 // highest tracked physical address
+#define PMM_MAX_REGIONS 32         // memory map entries kept from multiboot
+#define PMM_ZONE_DMA_LIMIT 0x1000000 // ISA DMA can only reach the first 16MB
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t len;
+    uint32_t type; // MULTIBOOT_MEMORY_*
+} pmm_region_t;
+
+typedef enum
+{
+    PMM_ZONE_DMA = 0,
+    PMM_ZONE_NORMAL,
+    PMM_ZONE_COUNT
+} pmm_zone_id_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t start_block;
+    uint32_t end_block;
+    // general allocations keep min free blocks in their preferred zone and high in fallback zones
+    uint32_t watermark_min;
+    uint32_t watermark_low;
+    uint32_t watermark_high;
+    bool low_warned;
+    buddy_area_t area;
+} pmm_zone_t;
+
+// Who a physical page belongs to, for accounting and for handing pages between subsystems
+typedef enum
+{
+    PAGE_OWNER_NONE = 0,
+    PAGE_OWNER_BOOT,       // firmware, kernel image and boot-time allocations
+    PAGE_OWNER_KERNEL,
+    PAGE_OWNER_PAGE_TABLE,
+    PAGE_OWNER_HEAP,
+    PAGE_OWNER_DMA,
+    PAGE_OWNER_FRAMEBUFFER,
+    PAGE_OWNER_FAT,
+    PAGE_OWNER_NET,
+    PAGE_OWNER_ZERO_POOL,
+    PAGE_OWNER_CMA,        // idle blocks of the contiguous memory area
+    PAGE_OWNER_SLAB,
+    PAGE_OWNER_COUNT
+} page_owner_t;
+
+#define PG_RESERVED 0x0001 // never handed out by the allocator (holes, firmware, boot data)
+#define PG_PINNED   0x0002 // must stay at this physical address (DMA targets)
+
+/*
+ * One descriptor per physical block, indexed by PFN. A free block has a
+ * refcount of 0; allocation sets it to 1 and pmm_page_get() adds holders.
+ * Freeing a block drops one reference and only returns it to the allocator
+ * when the last holder lets go, so a page can be passed from one subsystem to
+ * another without copying.
+ */
+typedef struct page
+{
+    uint16_t refcount;
+    uint16_t flags; // PG_*
+    uint8_t zone;   // pmm_zone_id_t
+    uint8_t owner;  // page_owner_t
+    uint16_t private; // free for the owner to use
+} page_t;
+
+#define PMM_ZERO_POOL_SIZE 64 // pre-zeroed pages kept around for pmm_alloc_zeroed
+
+typedef struct
+{
+    uint32_t pages;    // currently in the pool
+    uint32_t hits;     // pmm_alloc_zeroed served from the pool
+    uint32_t misses;   // ... that had to zero synchronously
+    uint32_t refilled; // pages zeroed in the background
+    bool nt_stores;    // zeroing bypasses the cache (SSE2 movnti)
+} pmm_zero_stats_t;
 
 extern uint32_t pmm_used_blocks;
+extern pmm_zero_stats_t pmm_zero_stats;
 
 uint32_t pmm_get_total_memory();
+uint32_t pmm_get_max_blocks();
 
 bool pmm_is_block_free(uint32_t block);
-void pmm_init(size_t mem_size, uint8_t *bitmap); // changed type from uint32_t* to uint8_t*
+void pmm_init(multiboot_info_t *mboot_info);
 void pmm_mark_used_region(uint32_t base, uint32_t size);
 void pmm_mark_unused_region(uint32_t base, uint32_t size);
 void *pmm_alloc_block();
@@ -23,6 +109,28 @@ void pmm_free_blocks(void *p, int num_blocks);
 void *pmm_alloc_blocks_in_range(uint32_t num_blocks, uint32_t start_addr, uint32_t end_addr);
 void *pmm_alloc_contiguous(uint32_t num_blocks);
 void pmm_free_contiguous(void *ptr, uint32_t num_blocks);
+void *pmm_alloc_zone_blocks(pmm_zone_id_t zone, uint32_t num_blocks);
+const pmm_zone_t *pmm_get_zone(pmm_zone_id_t zone);
+uint32_t pmm_get_boot_end();
+
+page_t *pmm_pfn_to_page(uint32_t pfn);
+page_t *pmm_phys_to_page(uint32_t phys_addr);
+uint32_t pmm_page_to_pfn(const page_t *page);
+uint32_t pmm_page_to_phys(const page_t *page);
+void pmm_page_get(page_t *page);
+void pmm_page_put(page_t *page);
+void pmm_set_owner(void *p, uint32_t num_blocks, page_owner_t owner);
+const char *pmm_owner_name(page_owner_t owner);
+void pmm_count_owners(uint32_t counts[PAGE_OWNER_COUNT]);
+
+// One zeroed block, from the pre-zeroed pool when it has one
+void *pmm_alloc_zeroed();
+// Zero up to `max_pages` pages into the pool; called while idle, returns how many were added
+uint32_t pmm_zero_pool_refill(uint32_t max_pages);
+// A pooled page for a caller that is out of other memory, or NULL
+void *pmm_zero_pool_take();
+// Remove a specific page from the pool, false when it is not there
+bool pmm_zero_pool_reclaim(void *page);
 extern uint32_t __kernel_physical_start; // Defined in linker script
 extern uint32_t __kernel_physical_end;
 
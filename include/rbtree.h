@@ -0,0 +1,49 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Intrusive red-black tree. Nodes are embedded in the owner's structure and
+ * the caller does the key comparison while walking down to the insertion
+ * point, so the tree itself knows nothing about keys:
+ *
+ *     rb_node_t **link = &tree->root, *parent = NULL;
+ *     while (*link) { parent = *link; link = less ? &parent->left : &parent->right; }
+ *     rb_insert(tree, node, parent, link);
+ *
+ * An optional augment callback recomputes per-node data derived from the
+ * children (e.g. the largest extent in a subtree). It is called for every
+ * node whose subtree changes, children before parents.
+ */
+typedef struct rb_node
+{
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+} rb_node_t;
+
+typedef void (*rb_augment_t)(rb_node_t *node);
+
+typedef struct
+{
+    rb_node_t *root;
+    rb_augment_t augment; // may be NULL
+} rb_tree_t;
+
+#define rb_entry(ptr, type, member) ((type *)((uint8_t *)(ptr) - offsetof(type, member)))
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link);
+void rb_erase(rb_tree_t *tree, rb_node_t *node);
+// Re-run the augment callback from `node` up to the root after changing its data in place
+void rb_propagate(rb_tree_t *tree, rb_node_t *node);
+
+rb_node_t *rb_first(const rb_tree_t *tree);
+rb_node_t *rb_last(const rb_tree_t *tree);
+rb_node_t *rb_next(const rb_node_t *node);
+rb_node_t *rb_prev(const rb_node_t *node);
+
+#endif
@@ -9,6 +9,7 @@
 #include "io.h"
 #include "timer.h"
 #include "paging.h"
+#include "dma.h"
 #include "8259_pic.h"
 
 #define RTL8139_VENDOR_ID  0x10EC
@@ -44,9 +45,10 @@ struct rtl8139_dev {
     uint32_t rx_phys;
     uint16_t rx_ptr;
     uint8_t  tx_current;
-    uint8_t* tx_buffer;
+    uint8_t* tx_buffers[NUM_TX_BUFFERS];
     uint32_t tx_start_time;
-    uint32_t tx_phys;
+    uint32_t tx_phys[NUM_TX_BUFFERS];
+    dma_pool_t *tx_pool;
     uint32_t ip_addr;
     uint32_t netmask;
     uint32_t gateway_ip;
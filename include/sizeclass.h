@@ -0,0 +1,66 @@
+#ifndef SIZECLASS_H
+#define SIZECLASS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SIZECLASS_COUNT        22   // 16..256 in 16-byte steps, then 384..2048
+#define SIZECLASS_SMALL_MAX    256
+#define SIZECLASS_MAX          2048 // larger requests go to liballoc
+#define SIZECLASS_WINDOW_PAGES 4096 // 16MB of kernel VA shared by all classes
+#define SIZECLASS_REFILL_MIN   8    // a refill carves at least this many objects
+
+/*
+ * Front end for small malloc requests. Every class keeps a singly linked list
+ * of free objects, so allocation and free are a push or a pop. When a list
+ * runs dry it is refilled with a batch of objects carved from fresh pages.
+ *
+ * Class pages come from one reserved window of kernel VA, so free() tells a
+ * class object from a liballoc block by its address, and the class of a page
+ * is looked up in a byte per page. Pages stay with their class once carved.
+ */
+typedef struct
+{
+    uint32_t size;
+    void *free_list;
+    uint32_t free;   // objects on free_list
+    uint32_t in_use;
+    uint32_t pages;
+    uint32_t refills;
+    uint32_t allocs;
+    uint32_t frees;
+} sizeclass_t;
+
+typedef struct
+{
+    uint32_t window;     // start of the VA window, 0 until the first refill
+    uint32_t pages_used; // window pages carved so far
+    uint32_t fallbacks;  // small requests passed to liballoc because a refill failed
+} sizeclass_stats_t;
+
+extern sizeclass_stats_t sizeclass_stats;
+
+// Class index for a request of `size` bytes (size <= SIZECLASS_MAX)
+static inline int sizeclass_index(size_t size)
+{
+    if (size <= SIZECLASS_SMALL_MAX)
+        return size ? (size - 1) >> 4 : 0;
+
+    // Two classes per power of two: 1.5x and 2x the previous one
+    uint32_t n = size - 1;
+    int bit = 31 - __builtin_clz(n);
+    return 16 + (bit - 8) * 2 + ((n >> (bit - 1)) & 1);
+}
+
+// NULL when the class cannot be refilled; the caller falls back to liballoc
+void *sizeclass_alloc(size_t size);
+void sizeclass_free(void *ptr);
+
+bool sizeclass_owns(const void *ptr);
+// Usable size of a class object
+uint32_t sizeclass_size(const void *ptr);
+
+const sizeclass_t *sizeclass_get(int index);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SLAB_MAX_ORDER   3  // slabs are 1..8 pages
+#define SLAB_CACHE_LINE  64 // colour step
+#define SLAB_MAX_CACHES  32
+#define SLAB_MIN_OBJECTS 8  // bigger slabs are used until this many objects fit (up to SLAB_MAX_ORDER)
+
+#define SLAB_HWCACHE_ALIGN 0x1 // align objects to a cache line
+
+typedef void (*kmem_ctor_t)(void *object);
+
+struct kmem_cache;
+
+/*
+ * A slab is 2^order pages at a virtual address aligned to its size, so the
+ * slab of an object is found by masking the object address. The header sits
+ * at the start, followed by the colour offset and the objects.
+ */
+typedef struct slab
+{
+    struct kmem_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    void *free_list;
+    uint32_t in_use;
+    uint32_t colour; // byte offset of the first object past the header
+} slab_t;
+
+/*
+ * A cache of equally sized objects. Slabs sit on one of three lists by how
+ * full they are; allocation takes from a partial slab first, so empty slabs
+ * can be given back. Successive slabs start their objects at different
+ * cache-line offsets (colouring) so the same object in different slabs does
+ * not always land in the same cache set.
+ *
+ * A constructor runs once when an object is first carved out of a slab, not
+ * on every allocation: objects must be freed in their constructed state.
+ */
+typedef struct kmem_cache
+{
+    const char *name;
+    uint32_t object_size;
+    uint32_t size;        // stride between objects
+    uint32_t align;
+    uint32_t free_offset; // where a free object keeps its next pointer
+    uint32_t order;
+    uint32_t objects_per_slab;
+    uint32_t colour_max;  // colours are 0..colour_max cache lines
+    uint32_t colour_next;
+    kmem_ctor_t ctor;
+    slab_t *slabs_full;
+    slab_t *slabs_partial;
+    slab_t *slabs_empty;
+
+    // Statistics
+    uint32_t slabs;
+    uint32_t active_objects;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t grows;
+    uint32_t shrinks;
+    uint32_t failures;
+    bool active;
+} kmem_cache_t;
+
+/**
+ * Create a cache of `size`-byte objects.
+ * @param align Object alignment, 0 for the natural word alignment.
+ * @param flags SLAB_* flags.
+ * @param ctor Optional constructor, may be NULL.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, uint32_t flags, kmem_ctor_t ctor);
+// Free every slab; objects still in use are lost
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+// Allocate and clear (for caches without a constructor)
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+
+// Give empty slabs back to the page allocator, returns how many pages were freed
+uint32_t kmem_cache_shrink(kmem_cache_t *cache);
+
+const kmem_cache_t *kmem_get_cache(int index);
+
+#endif
@@ -2,6 +2,7 @@
 #define TCP_H
 
 #include "ipv4.h"
+#include "ktimer.h"
 
 #define IP_PROTO_TCP 6
 
@@ -34,7 +35,7 @@ typedef struct retransmit_entry
     uint32_t seq;
     uint16_t length;
     uint8_t *data;
-    uint32_t start_time;
+    uint32_t start_time; // ktime_get_ms()
     uint8_t flags;
     uint8_t retries; // Track retry attempts
     struct retransmit_entry *next;
@@ -74,6 +75,10 @@ typedef struct tcp_connection
     uint16_t send_buffer_len;
     uint16_t window_size;
     uint32_t last_ack;
+    ktimer_t rto_timer; // SYN/FIN or data retransmission
+    uint32_t rto_ms;
+    uint8_t rto_retries;
+    ktimer_t delack_timer; // pure ACK held back for data to piggyback on
     struct tcp_connection *next;
 } tcp_connection_t;
 
@@ -81,7 +86,6 @@ void tcp_handle_packet(ipv4_header_t *ip, uint8_t *data, uint16_t len);
 uint16_t tcp_checksum(ipv4_header_t *ip, tcp_header_t *tcp, uint16_t tcp_len);
 void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint16_t data_len);
 void tcp_listen(uint16_t port);
-void check_tcp_timers(void);
 tcp_connection_t *tcp_connect(uint32_t remote_ip, uint16_t remote_port);
 void remove_connection(tcp_connection_t *conn);
 
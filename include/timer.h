@@ -12,32 +12,16 @@
 #define TIMER_CHANNEL_2_DATA_PORT 0x42
 #define TIMER_COMMAND_PORT 0x43
 
-typedef struct
-{
-    uint32_t timeout; // in millisecond, g_ticks in timer.c reaches there
-    void *user;
-} TIMER_FUNC_ARGS;
-
-typedef void (*TIMER_FUNCTION)(TIMER_FUNC_ARGS *);
-
-#define MAXIMUM_TIMER_FUNCTIONS 32
-
-typedef struct
-{
-    size_t current_index;
-    // timer functions to be called when that ticks reached in irq handler
-    TIMER_FUNCTION functions[MAXIMUM_TIMER_FUNCTIONS];
-    // arguments of each above timer functions
-    TIMER_FUNC_ARGS func_args[MAXIMUM_TIMER_FUNCTIONS];
-} TIMER_FUNCTION_MANAGER;
+extern volatile uint32_t g_ticks;
+extern uint16_t g_freq_hz;
 
 void timer_init();
 void sleep(int sec);
+// Sleeps on the ktime clock, halting between ticks when the wait is long enough
 void usleep(int usec);
 void uptime();
+// Ticks at g_freq_hz since boot, counted from ktime once the tick is gone
 uint32_t get_ticks(void);
 int rand(void);
 
-void timer_register_function(TIMER_FUNCTION function, TIMER_FUNC_ARGS *args);
-
 #endif
@@ -0,0 +1,89 @@
+#ifndef VM_REGION_H
+#define VM_REGION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rbtree.h"
+#include "pmm.h"
+
+#define VM_MAX_REGIONS     64
+#define VM_REGION_PRIV     32 // bytes of backing-private data kept in each region
+#define VM_FAULT_AROUND    16 // zero pages mapped per read fault on anonymous memory
+
+// #PF error code bits
+#define PF_PRESENT 0x1 // protection violation rather than a missing page
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+typedef enum
+{
+    VM_REGION_ANON = 0, // demand-zero memory, frames allocated on first write
+    VM_REGION_MMIO,     // fixed physical range, mapped when first touched
+    VM_REGION_FILE,     // frames filled by a callback when first touched
+} vm_region_type_t;
+
+struct vm_region;
+
+// Fill `page` with `size` bytes of backing data starting at `offset`; returns bytes filled, the rest is zeroed
+typedef uint32_t (*vm_region_fill_t)(struct vm_region *region, uint32_t offset, void *page, uint32_t size);
+
+/*
+ * A reserved range of kernel virtual addresses whose pages are mapped by the
+ * page fault handler on first access instead of up front. Regions sit in a
+ * tree ordered by start address so the handler finds the one covering a
+ * faulting address in O(log n).
+ */
+typedef struct vm_region
+{
+    rb_node_t node;
+    const char *name;
+    vm_region_type_t type;
+    uint32_t start; // [start, end), page aligned
+    uint32_t end;
+    uint32_t flags;    // page flags for mapped pages
+    uint8_t owner;     // page_owner_t of frames the region allocates
+    uint32_t phys;     // VM_REGION_MMIO: physical address of start
+    uint32_t size;     // VM_REGION_FILE: bytes of backing data
+    vm_region_fill_t fill;
+    uint32_t resident; // frames allocated for this region
+    uint32_t faults;
+    uint8_t priv[VM_REGION_PRIV];
+    struct vm_region *next_free;
+} vm_region_t;
+
+typedef struct
+{
+    uint32_t faults;     // page faults taken in regions
+    uint32_t zero_maps;  // pages mapped to the shared zero page
+    uint32_t zero_fills; // anonymous pages given their own frame
+    uint32_t mmio_maps;
+    uint32_t file_fills;
+    uint32_t unresolved; // faults no region could handle
+} vm_fault_stats_t;
+
+void *vm_region_create_anon(const char *name, size_t size, uint32_t flags, page_owner_t owner);
+// Pages are mapped 4MB at a time where paging_map_range can use large pages
+void *vm_region_create_mmio(const char *name, uint32_t phys, size_t size, uint32_t flags);
+// `data_size` bytes come from `fill`, the rest of `size` reads as zero. `priv` (up to
+// VM_REGION_PRIV bytes) is copied into the region for `fill` to use
+void *vm_region_create_file(const char *name, size_t size, uint32_t data_size, uint32_t flags,
+                            vm_region_fill_t fill, const void *priv, size_t priv_size);
+// Unmap a region, free the frames it allocated and give its address range back
+void vm_region_destroy(void *addr);
+
+vm_region_t *vm_region_find(uint32_t addr);
+
+/**
+ * Resolve a page fault at `addr` against the region covering it.
+ * Called from the #PF exception with interrupts disabled.
+ * @return true when the faulting access can be retried.
+ */
+bool vm_region_handle_fault(uint32_t addr, uint32_t err_code);
+
+void vm_region_print_stats();
+
+extern vm_fault_stats_t vm_fault_stats;
+
+#endif
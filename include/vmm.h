@@ -5,10 +5,59 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "kva.h"
+#include "paging.h"
+
+/*
+ * Kernel address-space layout:
+ *
+ *   0x00000000 - identity_end  identity map of boot low memory: the kernel
+ *                              image, its stack and the PMM's boot data
+ *   identity_end - 0xBFFFFFFF  user space
+ *   0xC0000000 - 0xF0000000    physmap: RAM below physmap_end at phys + PHYSMAP_BASE,
+ *                              4MB pages where available; page tables live here
+ *   0xF0000000 - 0xFC000000    vmalloc: heap, size classes, slabs, demand-zero
+ *                              regions and anything physically scattered
+ *   0xFC000000 - 0xFFC00000    MMIO: device memory from vmm_map_mmio
+ *   0xFFC00000 - 0xFFFFF000    fixmap: one page per fixmap_slot_t
+ *
+ * Translation is a subtraction for the physmap and the identity map, so only
+ * vmalloc, MMIO and fixmap addresses walk the page tables.
+ */
 #define KERNEL_VMEM_START 0xC0000000
+#define PHYSMAP_BASE      KERNEL_VMEM_START
+#define PHYSMAP_SIZE      0x30000000 // RAM above 768MB is only reachable through vmalloc or the fixmap
+#define VMALLOC_START     0xF0000000
+#define VMALLOC_END       0xFC000000
+#define MMIO_START        0xFC000000
+#define MMIO_END          0xFFC00000
+#define FIXMAP_START      0xFFC00000
 #define USER_SPACE_START  0x00000000
 #define USER_SPACE_END    0xBFFFFFFF
 
+typedef enum
+{
+    FIX_ZERO_IDLE = 0, // pmm_zero idle refill of frames above the physmap
+    FIX_ZERO_SYNC,     // pmm_zero synchronous zeroing, interrupts off
+    FIX_COUNT
+} fixmap_slot_t;
+
+#define fix_to_virt(slot) (FIXMAP_START + (uint32_t)(slot) * PAGE_SIZE)
+
+extern uint32_t physmap_end;  // set by paging_init, RAM below it is in the physmap
+extern uint32_t identity_end; // set by paging_init, low memory below it is identity mapped
+
+// Whether [phys, phys + size) is reachable through the physmap
+static inline bool physmap_covers(uint32_t phys, size_t size)
+{
+    return phys < physmap_end && size <= physmap_end - phys;
+}
+
+static inline bool is_physmap_addr(const void *virt)
+{
+    return (uint32_t)virt - PHYSMAP_BASE < physmap_end;
+}
+
 extern uint32_t vmm_max_pages; 
 
 /**
@@ -38,21 +87,40 @@ void vmm_free_page(void *addr);
 void* vmm_map_mmio(uintptr_t phys_addr, size_t size, uint32_t flags);
 
 /**
- * Convert a virtual address to a physical address.
+ * Physical address behind a mapped vmalloc, MMIO or fixmap address.
+ * @return Physical address, or UINT32_MAX if it is not mapped.
+ */
+uint32_t vmm_walk_phys(uint32_t virt_addr);
+
+/**
+ * Convert a virtual address to a physical address. Constant time for the
+ * physmap and the identity map, a page-table walk for everything else.
  * @param virt_addr Virtual address to convert.
  * @return Physical address, or UINT32_MAX on failure.
  */
-uint32_t virt_to_phys(void *virt_addr);
+static inline uint32_t virt_to_phys(void *virt_addr)
+{
+    uint32_t virt = (uint32_t)virt_addr;
+    if (virt - PHYSMAP_BASE < physmap_end)
+        return virt - PHYSMAP_BASE;
+    if (virt < identity_end)
+        return virt;
+    return vmm_walk_phys(virt);
+}
 
 /**
- * Convert a physical address to a virtual address.
- * @param phys_addr Physical address to convert.
+ * Convert a physical address to its physmap address.
+ * @param phys_addr Physical address, below physmap_end.
  * @return Virtual address.
  */
-uint32_t phys_to_virt(uint32_t phys_addr);
+static inline uint32_t phys_to_virt(uint32_t phys_addr)
+{
+    return phys_addr + PHYSMAP_BASE;
+}
 
 /**
- * Allocate contiguous virtual pages and map them to contiguous physical pages.
+ * Allocate physically contiguous pages, in the physmap when the run lies
+ * below physmap_end and mapped into vmalloc otherwise.
  * @param pages Number of pages to allocate.
  * @return Pointer to the starting virtual address, or NULL on failure.
  */
@@ -66,22 +134,50 @@ void* vmm_alloc_contiguous(size_t pages);
 void vmm_free_contiguous(void* addr, size_t pages);
 
 /**
- * Allocate memory for DMA operations.
- * @param size Size in bytes to allocate.
- * @return Pointer to the allocated virtual address, or NULL on failure.
+ * Map a page at its fixmap slot, replacing whatever was there.
+ * @return The slot's address, or NULL on failure.
+ */
+void *fixmap_set(fixmap_slot_t slot, uint32_t phys_addr, uint32_t flags);
+void fixmap_clear(fixmap_slot_t slot);
+
+/**
+ * Reserve vmalloc pages without mapping anything there.
+ * @return Start of the range, or 0 when nothing fits.
  */
-void* dma_alloc(size_t size);
+uint32_t vmm_reserve_virtual(size_t pages);
 
 /**
- * Free memory allocated for DMA operations.
- * @param addr Virtual address of the memory to free.
- * @param size Size in bytes of the memory to free.
+ * Like vmm_reserve_virtual, but the range starts on a multiple of `align`
+ * (a power of two, in bytes).
  */
-void dma_free(void* addr, size_t size);
+uint32_t vmm_reserve_virtual_aligned(size_t pages, uint32_t align);
 
+/**
+ * Give back a range from vmm_reserve_virtual (it must be unmapped).
+ */
+void vmm_release_virtual(uint32_t virt_addr, size_t pages);
 
+/**
+ * Reserve a demand-zero region: pages get a frame on first write, so only
+ * what is touched costs physical memory.
+ * @param size Size in bytes.
+ * @param flags Page flags for the pages once mapped.
+ * @return Start of the region, or NULL on failure.
+ */
 void* vmm_alloc_region(size_t size, uint32_t flags);
 
+/**
+ * Free a region from vmm_alloc_region along with every frame it faulted in.
+ */
+void vmm_free_region(void *addr);
+
 void vmm_print_stats();
 
+/**
+ * Free-extent state of the vmalloc window.
+ */
+const kva_space_t *vmm_get_kernel_space();
+// Free-extent state of the MMIO window
+const kva_space_t *vmm_get_mmio_space();
+
 #endif
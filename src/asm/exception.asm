@@ -45,6 +45,7 @@ exception_handler:
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld                   ; C code expects DF clear, memmove may have set it
 
     call isr_exception_handler
 
@@ -11,6 +11,7 @@ irq_handler:
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld                   ; C code expects DF clear, memmove may have set it
 
     push esp
     call isr_irq_handler
@@ -56,3 +57,7 @@ IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
 
+; local APIC vectors, numbered on from the 8259 lines
+IRQ 16, 48
+IRQ 31, 63
+
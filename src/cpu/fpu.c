@@ -8,8 +8,8 @@ void fpu_set_control_word(const uint16_t cw)
 
 void fpu_enable()
 {
-    uint32_t eax, edx;
-    __asm__ volatile("cpuid" : "=a"(eax), "=d"(edx) : "a"(1) : "ecx", "ebx");
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
 
     if (!(edx & (1 << 0)))
     {
@@ -73,6 +73,8 @@ void idt_init()
     idt_set_entry(45, (uint32_t)irq_13, 0x08, 0x8E);
     idt_set_entry(46, (uint32_t)irq_14, 0x08, 0x8E);
     idt_set_entry(47, (uint32_t)irq_15, 0x08, 0x8E);
+    idt_set_entry(48, (uint32_t)irq_16, 0x08, 0x8E);
+    idt_set_entry(63, (uint32_t)irq_31, 0x08, 0x8E);
     idt_set_entry(128, (uint32_t)exception_128, 0x08, 0x8E);
 
     load_idt((uint32_t)&g_idt_ptr);
@@ -3,6 +3,7 @@
 #include "8259_pic.h"
 #include "console.h"
 #include "serial.h"
+#include "vm_region.h"
 
 ISR g_interrupt_handlers[NO_INTERRUPT_HANDLERS];
 
@@ -64,7 +65,9 @@ void isr_irq_handler(REGISTERS *reg) {
         g_interrupt_handlers[reg->int_no](reg);
     }
 
-    pic8259_eoi(irq);
+    // LAPIC vectors are acknowledged by their handlers; spurious ones not at all
+    if (irq < 16)
+        pic8259_eoi(irq);
 }
 static void print_registers(REGISTERS *reg)
 {
@@ -76,8 +79,26 @@ static void print_registers(REGISTERS *reg)
     serial_printf("int_no=%u\n", reg->int_no);
 }
 
+static inline uint32_t read_cr2()
+{
+    uint32_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
 void isr_exception_handler(REGISTERS reg)
 {
+    if (reg.int_no == 14)
+    {
+        uint32_t addr = read_cr2();
+        if (vm_region_handle_fault(addr, reg.err_code))
+            return;
+        serial_printf("Page fault at 0x%x (%s, %s, %s mode)\n", addr,
+                      (reg.err_code & PF_PRESENT) ? "protection" : "not present",
+                      (reg.err_code & PF_WRITE) ? "write" : "read",
+                      (reg.err_code & PF_USER) ? "user" : "kernel");
+    }
+
     if (reg.int_no < 32)
     {
         serial_printf("EXCEPTION %d: %s\n", reg.int_no, exception_messages[reg.int_no]);
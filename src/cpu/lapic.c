@@ -0,0 +1,79 @@
+#include "lapic.h"
+#include "ktime.h"
+#include "vmm.h"
+#include "paging.h"
+#include "io.h"
+#include "serial.h"
+
+#define LAPIC_CAL_US 10000
+
+static volatile uint32_t *lapic_regs = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic_regs[reg / sizeof(uint32_t)];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic_regs[reg / sizeof(uint32_t)] = value;
+}
+
+bool lapic_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9)))
+    {
+        serial_printf("LAPIC: Not present\n");
+        return false;
+    }
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    uint32_t phys = (uint32_t)base & ~(PAGE_SIZE - 1);
+    wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    lapic_regs = vmm_map_mmio(phys, PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE | PAGE_UNCACHED);
+    if (!lapic_regs)
+    {
+        serial_printf("LAPIC: Failed to map registers at 0x%x\n", phys);
+        return false;
+    }
+
+    // Virtual wire: 8259 interrupts arrive on LINT0, NMIs on LINT1
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    serial_printf("LAPIC: ID %d at 0x%x\n", lapic_read(LAPIC_REG_ID) >> 24, phys);
+    return true;
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+uint32_t lapic_timer_calibrate()
+{
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_REG_TIMER_INIT, UINT32_MAX);
+    udelay(LAPIC_CAL_US);
+    uint32_t counted = UINT32_MAX - lapic_read(LAPIC_REG_TIMER_CUR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    irq_restore(flags);
+
+    return counted / (LAPIC_CAL_US / 1000);
+}
+
+void lapic_timer_oneshot(uint32_t counts)
+{
+    // One-shot is timer mode 0; writing the initial count (re)starts it
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, counts);
+}
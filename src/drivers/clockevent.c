@@ -0,0 +1,200 @@
+#include "clockevent.h"
+#include "ktime.h"
+#include "timer.h"
+#include "lapic.h"
+#include "8259_pic.h"
+#include "isr.h"
+#include "io.h"
+#include "serial.h"
+
+#define LAPIC_MIN_DELTA_NS 2000
+#define PIT_MIN_DELTA_NS   5000 // three port writes plus the interrupt
+#define PIT_MAX_COUNTS     0xFFFF
+
+clockevent_stats_t clockevent_stats;
+
+static clockevent_device_t pit_periodic = {
+    .name = "pit-periodic",
+    .oneshot = false,
+};
+
+static clockevent_device_t lapic_oneshot = {
+    .name = "lapic-oneshot",
+    .oneshot = true,
+    .min_delta_ns = LAPIC_MIN_DELTA_NS,
+    .set_next = lapic_timer_oneshot,
+};
+
+static void pit_set_next(uint32_t counts)
+{
+    // Mode 0: OUT rises once when the count runs out, then stays up until reprogrammed
+    outportb(TIMER_COMMAND_PORT, 0b00110000);
+    outportb(TIMER_CHANNEL_0_DATA_PORT, counts & 0xFF);
+    outportb(TIMER_CHANNEL_0_DATA_PORT, (counts >> 8) & 0xFF);
+}
+
+static clockevent_device_t pit_oneshot = {
+    .name = "pit-oneshot",
+    .oneshot = true,
+    .min_delta_ns = PIT_MIN_DELTA_NS,
+    .set_next = pit_set_next,
+};
+
+static clockevent_device_t *clockevent_device = &pit_periodic;
+static hrtimer_t *hrtimer_head = NULL;
+
+static void clockevent_program()
+{
+    if (!clockevent_device->oneshot || !hrtimer_head)
+        return;
+
+    uint64_t now = ktime_get_ns();
+    uint64_t delta = hrtimer_head->expires > now ? hrtimer_head->expires - now : 0;
+    if (delta < clockevent_device->min_delta_ns)
+        delta = clockevent_device->min_delta_ns;
+    if (delta > clockevent_device->max_delta_ns)
+        delta = clockevent_device->max_delta_ns;
+
+    // Round up so the event never lands before the deadline
+    uint32_t counts = ((delta * clockevent_device->mult) >> 32) + 1;
+    clockevent_device->set_next(counts);
+    clockevent_stats.programs++;
+}
+
+void clockevent_handle()
+{
+    uint32_t ran = 0;
+    uint64_t now = ktime_get_ns();
+
+    clockevent_stats.events++;
+    while (hrtimer_head && hrtimer_head->expires <= now)
+    {
+        hrtimer_t *timer = hrtimer_head;
+        hrtimer_head = timer->next;
+        timer->next = NULL;
+        timer->queued = false;
+        timer->function(timer);
+        ran++;
+        now = ktime_get_ns();
+    }
+
+    clockevent_stats.expired += ran;
+    if (!ran)
+        clockevent_stats.empty++;
+    clockevent_program();
+}
+
+static void lapic_timer_handler(REGISTERS *r)
+{
+    (void)r;
+    clockevent_handle();
+    lapic_eoi();
+}
+
+void hrtimer_start(hrtimer_t *timer, uint64_t expires)
+{
+    uint32_t flags = irq_save();
+    if (timer->queued)
+        hrtimer_cancel(timer);
+
+    timer->expires = expires;
+    hrtimer_t **pp = &hrtimer_head;
+    while (*pp && (*pp)->expires <= expires)
+        pp = &(*pp)->next;
+    timer->next = *pp;
+    *pp = timer;
+    timer->queued = true;
+
+    // A new earliest deadline moves the programmed event forward
+    if (hrtimer_head == timer)
+        clockevent_program();
+    irq_restore(flags);
+}
+
+void hrtimer_cancel(hrtimer_t *timer)
+{
+    uint32_t flags = irq_save();
+    hrtimer_t **pp = &hrtimer_head;
+    while (*pp && *pp != timer)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = timer->next;
+    timer->next = NULL;
+    timer->queued = false;
+    irq_restore(flags);
+}
+
+// Counts per ns << 32 for a device clocked at `hz`
+static uint32_t clockevent_mult(uint32_t hz)
+{
+    return div_u64((uint64_t)hz << 32, NSEC_PER_SEC);
+}
+
+static bool clockevent_init_lapic()
+{
+    if (!lapic_init())
+        return false;
+
+    uint32_t khz = lapic_timer_calibrate();
+    // Past 1 GHz the multiplier would not fit in 32 bits
+    if (khz == 0 || khz >= NSEC_PER_MSEC)
+    {
+        serial_printf("CLOCKEVENT: LAPIC timer calibration failed (%d kHz)\n", khz);
+        return false;
+    }
+
+    lapic_oneshot.mult = clockevent_mult(khz * MSEC_PER_SEC);
+    lapic_oneshot.max_delta_ns = CLOCKEVENT_MAX_DELTA_NS;
+    serial_printf("CLOCKEVENT: LAPIC timer at %d kHz\n", khz);
+
+    isr_register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+    pic8259_mask(IRQ0_TIMER);
+    clockevent_device = &lapic_oneshot;
+    return true;
+}
+
+static void clockevent_init_pit()
+{
+    pit_oneshot.mult = clockevent_mult(TIMER_INPUT_CLOCK_FREQUENCY);
+    pit_oneshot.max_delta_ns = div_u64((uint64_t)PIT_MAX_COUNTS * NSEC_PER_SEC, TIMER_INPUT_CLOCK_FREQUENCY);
+    // IRQ0 is already routed to timer_handler, which hands it to clockevent_handle.
+    // One long shot takes channel 0 out of rate-generator mode even with nothing queued.
+    pit_set_next(PIT_MAX_COUNTS);
+    clockevent_device = &pit_oneshot;
+}
+
+void clockevent_init()
+{
+    // Without the TSC, ktime is the periodic tick itself and has to keep ticking
+    if (ktime_clock.source != KTIME_TSC)
+    {
+        serial_printf("CLOCKEVENT: No TSC, keeping the %d Hz tick\n", g_freq_hz);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    if (!clockevent_init_lapic())
+        clockevent_init_pit();
+    clockevent_program();
+    irq_restore(flags);
+
+    serial_printf("CLOCKEVENT: Tickless on %s, %d-%d ns\n", clockevent_device->name,
+                  clockevent_device->min_delta_ns, clockevent_device->max_delta_ns);
+}
+
+const clockevent_device_t *clockevent_get_device()
+{
+    return clockevent_device;
+}
+
+bool clockevent_tickless()
+{
+    return clockevent_device->oneshot;
+}
+
+uint32_t clockevent_resolution_ns()
+{
+    if (clockevent_device->oneshot)
+        return clockevent_device->min_delta_ns;
+    return g_freq_hz ? NSEC_PER_SEC / g_freq_hz : 0;
+}
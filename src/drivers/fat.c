@@ -6,6 +6,9 @@
 #include "serial.h"
 #include "vmm.h"
 #include "ide.h"
+#include "vm_region.h"
+#include "paging.h"
+#include "slab.h"
 
 #define DIR_ENTRY_ATTRIB_LFN 0x0F
 
@@ -13,6 +16,19 @@ extern IDE_DEVICE g_ide_devices[MAXIMUM_IDE_DEVICES];
 
 static uint8_t g_fat32_drive = 0;
 
+// Sector and directory buffers come from caches rather than the kernel stack
+static kmem_cache_t *fat32_sector_cache = NULL;
+static kmem_cache_t *fat32_dirlist_cache = NULL;
+
+static bool fat32_init_caches()
+{
+    if (!fat32_sector_cache)
+        fat32_sector_cache = kmem_cache_create("fat_sector", SECTOR_SIZE, SECTOR_SIZE, 0, NULL);
+    if (!fat32_dirlist_cache)
+        fat32_dirlist_cache = kmem_cache_create("fat_dirlist", sizeof(FAT32_DirList), 0, 0, NULL);
+    return fat32_sector_cache && fat32_dirlist_cache;
+}
+
 static FAT32_Directory_Entry *read_next_entry(FAT32_Volume *volume, FAT32_DirList *dir_list);
 
 int fat32_strcasecmp(const char *s1, const char *s2)
@@ -49,35 +65,12 @@ static uint32_t cluster_to_sector(const FAT32_Volume *volume, uint32_t cluster)
     return volume->data_start_sector + (cluster - 2) * volume->header.sectors_per_cluster;
 }
 
-bool fat32_read_file(FAT32_Volume *volume, FAT32_File *file, uint32_t offset, uint8_t *buffer, uint32_t size)
+// Copy `size` bytes starting `offset` bytes into `cluster`, one sector at a time through `sector_buffer`
+static bool fat32_read_chain(FAT32_Volume *volume, uint32_t cluster, uint32_t offset, uint8_t *buffer,
+                             uint32_t size, uint8_t *sector_buffer)
 {
-    if (!volume || !file || !buffer)
-    {
-        serial_printf("[FAT32] Invalid parameters in fat32_read_file\n");
-        return false;
-    }
-
-    if (offset + size > file->size && !(file->attrib & FAT32_IS_DIR))
-    {
-        serial_printf("[FAT32] Attempted read beyond file size\n");
-        return false;
-    }
-
     FAT32_Header *header = &volume->header;
 
-    uint32_t cluster = file->cluster;
-    uint32_t clusters_to_advance = offset / volume->cluster_size;
-    for (uint32_t i = 0; i < clusters_to_advance; i++)
-    {
-        offset -= volume->cluster_size;
-        cluster = volume->fat[cluster] & 0xFFFFFF;
-        if (cluster == 0xFFFFFF)
-        {
-            serial_printf("[FAT32] Invalid cluster chain\n");
-            return false;
-        }
-    }
-
     uint32_t bytes_left = size;
     while (true)
     {
@@ -85,7 +78,6 @@ bool fat32_read_file(FAT32_Volume *volume, FAT32_File *file, uint32_t offset, ui
         {
             offset %= SECTOR_SIZE;
 
-            uint8_t sector_buffer[SECTOR_SIZE];
             if (!disk_read_sector(sector_buffer, cluster_to_sector(volume, cluster) + i))
             {
                 return false;
@@ -114,6 +106,71 @@ bool fat32_read_file(FAT32_Volume *volume, FAT32_File *file, uint32_t offset, ui
     return false;
 }
 
+bool fat32_read_file(FAT32_Volume *volume, FAT32_File *file, uint32_t offset, uint8_t *buffer, uint32_t size)
+{
+    if (!volume || !file || !buffer)
+    {
+        serial_printf("[FAT32] Invalid parameters in fat32_read_file\n");
+        return false;
+    }
+
+    if (offset + size > file->size && !(file->attrib & FAT32_IS_DIR))
+    {
+        serial_printf("[FAT32] Attempted read beyond file size\n");
+        return false;
+    }
+
+    uint32_t cluster = file->cluster;
+    uint32_t clusters_to_advance = offset / volume->cluster_size;
+    for (uint32_t i = 0; i < clusters_to_advance; i++)
+    {
+        offset -= volume->cluster_size;
+        cluster = volume->fat[cluster] & 0xFFFFFF;
+        if (cluster == 0xFFFFFF)
+        {
+            serial_printf("[FAT32] Invalid cluster chain\n");
+            return false;
+        }
+    }
+
+    if (!fat32_init_caches())
+        return false;
+    uint8_t *sector_buffer = kmem_cache_alloc(fat32_sector_cache);
+    if (!sector_buffer)
+        return false;
+
+    bool ok = fat32_read_chain(volume, cluster, offset, buffer, size, sector_buffer);
+    kmem_cache_free(fat32_sector_cache, sector_buffer);
+    return ok;
+}
+
+typedef struct
+{
+    FAT32_Volume *volume;
+    FAT32_File file;
+} FAT32_Mapping;
+
+static uint32_t fat32_fill_page(vm_region_t *region, uint32_t offset, void *page, uint32_t size)
+{
+    FAT32_Mapping *mapping = (FAT32_Mapping *)region->priv;
+    return fat32_read_file(mapping->volume, &mapping->file, offset, page, size) ? size : 0;
+}
+
+void *fat32_map_file(FAT32_Volume *volume, FAT32_File *file)
+{
+    if (!volume || !file || (file->attrib & FAT32_IS_DIR))
+        return NULL;
+
+    FAT32_Mapping mapping = {volume, *file};
+    return vm_region_create_file("fat32 file", file->size + 1, file->size, PAGE_PRESENT, fat32_fill_page,
+                                 &mapping, sizeof(mapping));
+}
+
+void fat32_unmap_file(void *addr)
+{
+    vm_region_destroy(addr);
+}
+
 static void parse_short_filename(char output[13], FAT32_Directory_Entry *entry)
 {
     strncpy(output, (const char *)entry->short_name, 8);
@@ -174,15 +231,11 @@ void fat32_init_volume(FAT32_Volume *volume)
     }
 
     memset(volume, 0, sizeof(FAT32_Volume));
-    uint8_t *sector_buffer = dma_alloc(SECTOR_SIZE);
+    // The IDE driver copies sectors with PIO, so plain kernel memory will do
+    uint8_t *sector_buffer = vmm_alloc_page();
     if (!sector_buffer) {
-        // Fallback to regular allocation if DMA fails
-        serial_printf("[FAT32] DMA allocation failed, trying regular allocation\n");
-        sector_buffer = vmm_alloc_page();
-        if (!sector_buffer) {
-            serial_printf("[FAT32] Failed to allocate sector buffer\n");
-            return;
-        }
+        serial_printf("[FAT32] Failed to allocate sector buffer\n");
+        return;
     }
 
     g_fat32_drive = 0;
@@ -246,7 +299,7 @@ void fat32_init_volume(FAT32_Volume *volume)
     if (!disk_read_sector(sector_buffer, 0))
     {
         serial_printf("[FAT32] Read failed\n");
-        dma_free(sector_buffer, SECTOR_SIZE);
+        vmm_free_page(sector_buffer);
         return;
     }
 
@@ -256,11 +309,11 @@ void fat32_init_volume(FAT32_Volume *volume)
         serial_printf("[FAT32] FAT size is zero (invalid filesystem)\n");
         return;
     }
-    volume->fat = (fat32_entry *)dma_alloc(fat_size);
+    volume->fat = (fat32_entry *)vmm_alloc_contiguous((fat_size + PAGE_SIZE - 1) / PAGE_SIZE);
     if (!volume->fat)
     {
         serial_printf("[FAT32] FAT table allocation failed\n");
-        dma_free(sector_buffer, SECTOR_SIZE);
+        vmm_free_page(sector_buffer);
         return;
     }
 
@@ -295,6 +348,12 @@ bool fat32_find_file(FAT32_Volume *volume, const char *path, FAT32_File *out_fil
         .cluster = volume->header.root_cluster,
         .attrib = FAT32_IS_DIR};
 
+    if (!fat32_init_caches())
+        return false;
+    FAT32_DirList *list = kmem_cache_alloc(fat32_dirlist_cache);
+    if (!list)
+        return false;
+
     while (start < path_len)
     {
         uint32_t end = start;
@@ -316,13 +375,12 @@ bool fat32_find_file(FAT32_Volume *volume, const char *path, FAT32_File *out_fil
         }
         component_upper[strlen(component)] = '\0';
 
-        FAT32_DirList list;
         FAT32_File entry;
         char name[256];
         bool found = false;
 
-        fat32_list_dir(volume, &current, &list);
-        while (fat32_next_dir_entry(volume, &list, &entry, name))
+        fat32_list_dir(volume, &current, list);
+        while (fat32_next_dir_entry(volume, list, &entry, name))
         {
             if (fat32_strcasecmp(name, component_upper) == 0)
             {
@@ -332,14 +390,16 @@ bool fat32_find_file(FAT32_Volume *volume, const char *path, FAT32_File *out_fil
             }
         }
 
-        if (!found)
-            return false;
-        if (!(current.attrib & FAT32_IS_DIR) && path[end] == '/')
+        if (!found || (!(current.attrib & FAT32_IS_DIR) && path[end] == '/'))
+        {
+            kmem_cache_free(fat32_dirlist_cache, list);
             return false;
+        }
 
         start = end + 1;
     }
 
+    kmem_cache_free(fat32_dirlist_cache, list);
     *out_file = current;
     return true;
 }
@@ -471,7 +531,7 @@ void fat32_unmount_volume(FAT32_Volume *volume)
             serial_printf("[FAT32] Invalid FAT size in unmount\n");
             return;
         }
-        dma_free(volume->fat, volume->fat_size_in_sectors * SECTOR_SIZE);
+        vmm_free_contiguous(volume->fat, (volume->fat_size_in_sectors * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE);
         volume->fat = NULL;
     }
 
@@ -6,6 +6,8 @@
 #include "io.h"
 #include "string.h"
 #include "serial.h"
+#include "pci.h"
+#include "dma.h"
 
 IDE_CHANNELS g_ide_channels[MAXIMUM_CHANNELS];
 IDE_DEVICE g_ide_devices[MAXIMUM_IDE_DEVICES];
@@ -208,7 +210,7 @@ void ide_init(uint32_t prim_channel_base_addr, uint32_t prim_channel_control_bas
     g_ide_channels[ATA_SECONDARY].base = sec_channel_base_addr;
     g_ide_channels[ATA_SECONDARY].control = sec_channel_control_addr;
     g_ide_channels[ATA_PRIMARY].bm_ide = bus_master_addr;
-    g_ide_channels[ATA_SECONDARY].bm_ide = bus_master_addr;
+    g_ide_channels[ATA_SECONDARY].bm_ide = bus_master_addr ? bus_master_addr + 8 : 0;
     ide_write_register(ATA_PRIMARY, ATA_REG_CONTROL, 2);
     ide_write_register(ATA_SECONDARY, ATA_REG_CONTROL, 2);
     for (i = 0; i < 2; i++)
@@ -274,6 +276,79 @@ void ide_init(uint32_t prim_channel_base_addr, uint32_t prim_channel_control_bas
         }
     }
 }
+// Describe the first `bytes` of the channel's bounce buffer and arm the controller
+static void ide_dma_prepare(uint8_t channel, uint8_t direction, uint32_t bytes)
+{
+    IDE_CHANNELS *ch = &g_ide_channels[channel];
+    int i = 0;
+
+    // One descriptor per page keeps every entry inside a 64KB boundary
+    for (uint32_t offset = 0; offset < bytes; offset += 4096, i++)
+    {
+        uint32_t size = bytes - offset < 4096 ? bytes - offset : 4096;
+        ch->prdt[i].phys = ch->dma_phys + offset;
+        ch->prdt[i].size = size;
+        ch->prdt[i].flags = 0;
+    }
+    ch->prdt[i - 1].flags = ATA_PRD_EOT;
+
+    outportl(ch->bm_ide + ATA_REG_BMPRDT - ATA_REG_BMCOMMAND, ch->prdt_phys);
+    ide_write_register(channel, ATA_REG_BMCOMMAND, direction == ATA_READ ? ATA_BM_CMD_READ : 0);
+    // Writing ones clears the interrupt and error bits
+    ide_write_register(channel, ATA_REG_BMSTATUS,
+                       ide_read_register(channel, ATA_REG_BMSTATUS) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+}
+
+// Start a prepared transfer after the command was issued and wait for it to finish
+static uint8_t ide_dma_run(uint8_t channel)
+{
+    uint8_t command = ide_read_register(channel, ATA_REG_BMCOMMAND);
+    uint8_t bm_status, status;
+
+    ide_write_register(channel, ATA_REG_BMCOMMAND, command | ATA_BM_CMD_START);
+    do
+    {
+        bm_status = ide_read_register(channel, ATA_REG_BMSTATUS);
+    } while ((bm_status & ATA_BM_SR_ACTIVE) && !(bm_status & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR)));
+    ide_write_register(channel, ATA_REG_BMCOMMAND, command & ~ATA_BM_CMD_START);
+
+    ide_polling(channel, 0);
+    status = ide_read_register(channel, ATA_REG_STATUS);
+    ide_write_register(channel, ATA_REG_BMSTATUS, bm_status | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+
+    if (status & ATA_SR_ERR)
+        return 2;
+    if ((status & ATA_SR_DF) || (bm_status & ATA_BM_SR_ERR))
+        return 1;
+    return 0;
+}
+
+static void ide_dma_init()
+{
+    dma_pool_t *prd_pool = dma_pool_create("ide prdt", sizeof(IDE_PRD) * ATA_DMA_PRDS, sizeof(IDE_PRD));
+    if (!prd_pool)
+        return;
+
+    for (int i = 0; i < MAXIMUM_CHANNELS; i++)
+    {
+        IDE_CHANNELS *ch = &g_ide_channels[i];
+        ch->prdt = dma_pool_alloc(prd_pool, &ch->prdt_phys);
+        ch->dma_buffer = dma_alloc_coherent(ATA_DMA_MAX_SECTORS * ATA_SECTOR_SIZE, &ch->dma_phys);
+        if (!ch->prdt || !ch->dma_buffer)
+        {
+            // Leave the channel on PIO
+            if (ch->prdt)
+                dma_pool_free(prd_pool, ch->prdt);
+            if (ch->dma_buffer)
+                dma_free_coherent(ch->dma_buffer, ATA_DMA_MAX_SECTORS * ATA_SECTOR_SIZE);
+            ch->prdt = NULL;
+            ch->dma_buffer = NULL;
+            continue;
+        }
+        serial_printf("[IDE] Channel %d bus-master DMA at 0x%x\n", i, ch->bm_ide);
+    }
+}
+
 uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t num_sectors, uint32_t buffer)
 {
     uint8_t lba_mode, dma, cmd;
@@ -320,7 +395,15 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
         lba_io[5] = 0;
         head = (lba + 1 - sect) % (16 * 63) / (63);
     }
-    dma = 0;
+    // Bus-master DMA through the channel's bounce buffer when the drive can do it
+    dma = g_ide_channels[channel].dma_buffer && (g_ide_devices[drive].features & 0x100) &&
+          num_sectors && num_sectors <= ATA_DMA_MAX_SECTORS;
+    if (dma)
+    {
+        if (direction == ATA_WRITE)
+            memcpy(g_ide_channels[channel].dma_buffer, (void *)buffer, num_sectors * ATA_SECTOR_SIZE);
+        ide_dma_prepare(channel, direction, num_sectors * ATA_SECTOR_SIZE);
+    }
     while (ide_read_register(channel, ATA_REG_STATUS) & ATA_SR_BSY)
     {
     }
@@ -366,11 +449,16 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
     ide_write_register(channel, ATA_REG_COMMAND, cmd);
     if (dma)
     {
+        if ((err = ide_dma_run(channel)))
+            return err;
         if (direction == ATA_READ)
         {
+            memcpy((void *)buffer, g_ide_channels[channel].dma_buffer, num_sectors * ATA_SECTOR_SIZE);
         }
         else
         {
+            ide_write_register(channel, ATA_REG_COMMAND, (char[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
+            ide_polling(channel, 0);
         }
     }
     else if (direction == ATA_READ)
@@ -460,7 +548,21 @@ int ide_write_sectors(uint8_t drive, uint8_t num_sectors, uint32_t lba, uint32_t
 
 void ata_init()
 {
-    ide_init(0x1F0, 0x3F6, 0x170, 0x376, 0x000);
+    uint32_t bus_master = 0;
+
+    // PIIX keeps the bus-master registers behind BAR4, needs pci_init first
+    pci_dev_t dev = pci_get_device(PCI_VENDOR_INTEL, PIIX3_IDE_DEVICE_ID, -1);
+    if (dev.bits == dev_zero.bits)
+        dev = pci_get_device(PCI_VENDOR_INTEL, PIIX4_IDE_DEVICE_ID, -1);
+    if (dev.bits != dev_zero.bits)
+    {
+        bus_master = pci_read(dev, PCI_BAR4) & 0xFFFC;
+        pci_write(dev, PCI_COMMAND, pci_read(dev, PCI_COMMAND) | (1 << 0) | (1 << 2));
+    }
+
+    ide_init(0x1F0, 0x3F6, 0x170, 0x376, bus_master);
+    if (bus_master)
+        ide_dma_init();
 }
 
 int ata_get_drive_by_model(const char *model)
@@ -8,6 +8,7 @@
 #include "io.h"
 #include "isr.h"
 #include "string.h"
+#include "pmm.h"
 
 static bool g_caps_lock = false;
 static bool g_shift_pressed = false;
@@ -157,12 +158,19 @@ void keyboard_init()
     isr_register_interrupt_handler(IRQ_BASE + 1, keyboard_handler);
 }
 
+// A key arrived, or a page was zeroed for the pool: sleep only once it is full
+static bool kb_wait_over(void *arg)
+{
+    (void)arg;
+    return g_ch > 0 || pmm_zero_pool_refill(1);
+}
+
 char kb_getchar()
 {
     char c;
 
     while (g_ch <= 0)
-        ;
+        halt_until(kb_wait_over, NULL);
     c = g_ch;
     g_ch = 0;
     g_scan_code = 0;
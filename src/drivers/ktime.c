@@ -0,0 +1,218 @@
+#include "ktime.h"
+#include "timer.h"
+#include "clockevent.h"
+#include "io.h"
+#include "serial.h"
+
+#define PIT_PORT_B        0x61
+#define PIT_PORT_B_GATE2  0x01
+#define PIT_PORT_B_SPKR   0x02
+#define PIT_PORT_B_OUT2   0x20
+#define PIT_CAL_MAX_LOOPS 10000000 // give up if channel 2 never fires (no PIT behind the ports)
+
+ktime_clock_t ktime_clock;
+
+static const char *ktime_source_names[] = {
+    [KTIME_NONE] = "none",
+    [KTIME_PIT] = "pit",
+    [KTIME_TSC] = "tsc",
+};
+
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t *remainder)
+{
+    uint32_t high = dividend >> 32;
+    uint32_t quotient_high = high / divisor;
+    uint32_t quotient_low, rem = high % divisor;
+
+    // rem < divisor, so the quotient of rem:low fits in 32 bits
+    __asm__("divl %4" : "=a"(quotient_low), "=d"(rem) : "a"((uint32_t)dividend), "d"(rem), "rm"(divisor));
+    if (remainder)
+        *remainder = rem;
+    return ((uint64_t)quotient_high << 32) | quotient_low;
+}
+
+// TSC kHz from one run of PIT channel 2 counting down KTIME_CAL_MS, 0 if it never finished
+static uint32_t ktime_calibrate_once()
+{
+    uint32_t latch = TIMER_INPUT_CLOCK_FREQUENCY / (MSEC_PER_SEC / KTIME_CAL_MS);
+
+    // Gate channel 2 on with the speaker off, mode 0: OUT2 rises when the count reaches zero
+    outportb(PIT_PORT_B, (inportb(PIT_PORT_B) & ~PIT_PORT_B_SPKR) | PIT_PORT_B_GATE2);
+    outportb(TIMER_COMMAND_PORT, 0b10110000);
+    outportb(TIMER_CHANNEL_2_DATA_PORT, latch & 0xFF);
+    outportb(TIMER_CHANNEL_2_DATA_PORT, (latch >> 8) & 0xFF);
+
+    uint64_t start = rdtsc();
+    uint32_t loops = 0;
+    while (!(inportb(PIT_PORT_B) & PIT_PORT_B_OUT2))
+    {
+        if (++loops > PIT_CAL_MAX_LOOPS)
+            return 0;
+    }
+    return (uint32_t)(rdtsc() - start) / KTIME_CAL_MS;
+}
+
+static bool ktime_init_tsc()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 4)))
+        return false;
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007)
+    {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        ktime_clock.invariant = (edx & (1 << 8)) != 0;
+    }
+
+    uint32_t khz = 0;
+    uint32_t flags = irq_save();
+    for (int i = 0; i < KTIME_CAL_ROUNDS; i++)
+    {
+        uint32_t round = ktime_calibrate_once();
+        if (round && (!khz || round < khz))
+            khz = round;
+    }
+    irq_restore(flags);
+
+    // Below 4MHz the multiplier would not fit in 32 bits
+    if (khz < 4000)
+    {
+        serial_printf("KTIME: TSC calibration failed (%d kHz)\n", khz);
+        return false;
+    }
+
+    ktime_clock.tsc_khz = khz;
+    ktime_clock.mult = div_u64((uint64_t)NSEC_PER_MSEC << KTIME_TSC_SHIFT, khz);
+    ktime_clock.tsc_base = rdtsc();
+    return true;
+}
+
+void ktime_init()
+{
+    ktime_clock.source = ktime_init_tsc() ? KTIME_TSC : KTIME_PIT;
+    if (ktime_clock.source == KTIME_TSC)
+        serial_printf("KTIME: TSC at %d.%03d MHz%s\n", ktime_clock.tsc_khz / 1000, ktime_clock.tsc_khz % 1000,
+                      ktime_clock.invariant ? ", invariant" : "");
+    else
+        serial_printf("KTIME: Using the PIT at %d Hz\n", g_freq_hz);
+}
+
+const char *ktime_source_name(ktime_source_t source)
+{
+    return source <= KTIME_TSC ? ktime_source_names[source] : "?";
+}
+
+// TSC cycles to nanoseconds, 0 without a calibrated TSC
+static uint64_t ktime_cycles_to_ns(uint64_t cycles)
+{
+    // Split so the 96-bit product never has to exist
+    uint32_t high = cycles >> 32;
+    return (((uint64_t)high * ktime_clock.mult) << (32 - KTIME_TSC_SHIFT)) +
+           (((uint64_t)(uint32_t)cycles * ktime_clock.mult) >> KTIME_TSC_SHIFT);
+}
+
+// Ticks so far plus how far channel 0 has counted down into the current one
+static uint64_t ktime_pit_ns()
+{
+    static uint64_t last;
+
+    if (!g_freq_hz)
+        return 0;
+
+    uint32_t flags = irq_save();
+    uint32_t ticks = g_ticks;
+    outportb(TIMER_COMMAND_PORT, 0); // latch channel 0
+    uint32_t count = inportb(TIMER_CHANNEL_0_DATA_PORT);
+    count |= inportb(TIMER_CHANNEL_0_DATA_PORT) << 8;
+
+    // A PIT clock cycle is 838.1ns = 3433000 / 4096 ns
+    uint32_t divisor = TIMER_INPUT_CLOCK_FREQUENCY / g_freq_hz;
+    uint32_t into_tick = count <= divisor ? ((uint64_t)(divisor - count) * 3433000) >> 12 : 0;
+    uint64_t ns = (uint64_t)ticks * (NSEC_PER_SEC / g_freq_hz) + into_tick;
+
+    // The count wraps before the tick interrupt is taken; never go backwards meanwhile
+    if (ns < last)
+        ns = last;
+    last = ns;
+    irq_restore(flags);
+    return ns;
+}
+
+uint64_t ktime_get_ns()
+{
+    if (ktime_clock.source == KTIME_TSC)
+        return ktime_cycles_to_ns(rdtsc() - ktime_clock.tsc_base);
+    return ktime_pit_ns();
+}
+
+uint32_t ktime_get_us()
+{
+    return div_u64(ktime_get_ns(), NSEC_PER_USEC);
+}
+
+uint32_t ktime_get_ms()
+{
+    return div_u64(ktime_get_ns(), NSEC_PER_MSEC);
+}
+
+void ndelay(uint32_t ns)
+{
+    if (ktime_clock.source == KTIME_TSC)
+    {
+        uint64_t cycles = div_u64((uint64_t)ns * ktime_clock.tsc_khz + NSEC_PER_MSEC - 1, NSEC_PER_MSEC);
+        uint64_t start = rdtsc();
+        while (rdtsc() - start < cycles)
+            __asm__ volatile("pause");
+        return;
+    }
+
+    if (ktime_clock.source == KTIME_PIT)
+    {
+        uint64_t end = ktime_get_ns() + ns;
+        while (ktime_get_ns() < end)
+            __asm__ volatile("pause");
+        return;
+    }
+
+    // An ISA port write takes about a microsecond
+    for (uint32_t i = 0; i < (ns + NSEC_PER_USEC - 1) / NSEC_PER_USEC; i++)
+        outportb(0x80, 0);
+}
+
+void udelay(uint32_t us)
+{
+    // In chunks so the nanosecond count can not overflow
+    while (us > 1000)
+    {
+        ndelay(1000 * NSEC_PER_USEC);
+        us -= 1000;
+    }
+    ndelay(us * NSEC_PER_USEC);
+}
+
+static void ktime_wakeup(hrtimer_t *timer)
+{
+    (void)timer; // the interrupt itself ends the hlt
+}
+
+// Close to the deadline (or before timer_init) nothing is sure to wake us, so stop halting
+static bool ktime_wait_close(void *arg)
+{
+    uint64_t deadline = *(uint64_t *)arg;
+    uint64_t now = ktime_get_ns();
+    uint32_t resolution = clockevent_resolution_ns();
+    return now >= deadline || !resolution || deadline - now <= resolution;
+}
+
+void ktime_wait_until(uint64_t deadline)
+{
+    hrtimer_t wakeup = {.function = ktime_wakeup};
+
+    hrtimer_start(&wakeup, deadline);
+    halt_until(ktime_wait_close, &deadline);
+    while (ktime_get_ns() < deadline)
+        __asm__ volatile("pause");
+    hrtimer_cancel(&wakeup);
+}
@@ -0,0 +1,251 @@
+#include "ktimer.h"
+#include "ktime.h"
+#include "clockevent.h"
+#include "io.h"
+#include "string.h"
+#include "serial.h"
+
+typedef struct
+{
+    ktimer_t *slots[KTIMER_LEVELS][KTIMER_LEVEL_SIZE];
+    uint64_t occupied[KTIMER_LEVELS]; // a bit per non-empty slot
+    uint32_t clk;                     // next millisecond to process
+    uint32_t next_event;              // what the hrtimer is armed for
+    bool armed;
+    bool running; // inside ktimer_run, which programs the hrtimer when done
+    hrtimer_t hrtimer;
+} ktimer_wheel_t;
+
+ktimer_stats_t ktimer_stats;
+static ktimer_wheel_t wheel;
+
+// Only a 32-bit bsf is inline on i386, the 64-bit builtin needs libgcc
+static inline uint32_t ktimer_ctz64(uint64_t value)
+{
+    uint32_t low = (uint32_t)value;
+    return low ? (uint32_t)__builtin_ctz(low) : 32 + (uint32_t)__builtin_ctz((uint32_t)(value >> 32));
+}
+
+/*
+ * When the wheel has to process a slot: the slot time itself on level 0,
+ * the cascade on the levels above. A slot of level L is cascaded at the
+ * first multiple of 64^L at or after clk whose level-L index is the slot.
+ */
+static uint32_t ktimer_slot_time(uint32_t level, uint32_t index)
+{
+    uint32_t shift = level * KTIMER_LEVEL_BITS;
+    uint32_t base = (wheel.clk >> shift) + ((wheel.clk & ((1u << shift) - 1)) != 0);
+    return (base + ((index - base) & KTIMER_LEVEL_MASK)) << shift;
+}
+
+static bool ktimer_next_event(uint32_t *next)
+{
+    bool found = false;
+    for (uint32_t level = 0; level < KTIMER_LEVELS; level++)
+    {
+        uint64_t occupied = wheel.occupied[level];
+        if (!occupied)
+            continue;
+
+        // First occupied slot at or after the one processed next on this level
+        uint32_t shift = level * KTIMER_LEVEL_BITS;
+        uint32_t start = ((wheel.clk >> shift) + ((wheel.clk & ((1u << shift) - 1)) != 0)) & KTIMER_LEVEL_MASK;
+        uint64_t rotated = start ? (occupied >> start) | (occupied << (KTIMER_LEVEL_SIZE - start)) : occupied;
+        uint32_t when = ktimer_slot_time(level, (start + ktimer_ctz64(rotated)) & KTIMER_LEVEL_MASK);
+
+        if (!found || when - wheel.clk < *next - wheel.clk)
+            *next = when;
+        found = true;
+    }
+    return found;
+}
+
+// Link into the slot for its deadline; returns when the wheel must look at it
+static uint32_t ktimer_enqueue(ktimer_t *timer)
+{
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel.clk;
+
+    if ((int32_t)delta < 0)
+    {
+        // Already due: the next millisecond processed picks it up
+        expires = wheel.clk;
+        delta = 0;
+    }
+    else if (delta > KTIMER_MAX_DELTA)
+    {
+        expires = wheel.clk + KTIMER_MAX_DELTA;
+        delta = KTIMER_MAX_DELTA;
+    }
+
+    uint32_t level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= (1u << ((level + 1) * KTIMER_LEVEL_BITS)))
+        level++;
+    uint32_t index = (expires >> (level * KTIMER_LEVEL_BITS)) & KTIMER_LEVEL_MASK;
+
+    ktimer_t **head = &wheel.slots[level][index];
+    timer->next = *head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = level * KTIMER_LEVEL_SIZE + index;
+    wheel.occupied[level] |= 1ull << index;
+    ktimer_stats.pending++;
+
+    return level ? ktimer_slot_time(level, index) : expires;
+}
+
+static void ktimer_unlink(ktimer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void ktimer_dequeue(ktimer_t *timer)
+{
+    uint32_t level = timer->slot / KTIMER_LEVEL_SIZE;
+    uint32_t index = timer->slot % KTIMER_LEVEL_SIZE;
+
+    ktimer_unlink(timer);
+    if (!wheel.slots[level][index])
+        wheel.occupied[level] &= ~(1ull << index);
+    ktimer_stats.pending--;
+}
+
+// Take a whole slot off the wheel; its timers stay linked to each other from *list
+static void ktimer_detach_slot(uint32_t level, uint32_t index, ktimer_t **list)
+{
+    *list = wheel.slots[level][index];
+    wheel.slots[level][index] = NULL;
+    wheel.occupied[level] &= ~(1ull << index);
+    if (*list)
+        (*list)->pprev = list;
+}
+
+static void ktimer_program(uint32_t when)
+{
+    uint32_t rem;
+    uint64_t now_ns = ktime_get_ns();
+    uint32_t now = div_u64_rem(now_ns, NSEC_PER_MSEC, &rem);
+    int32_t delta = (int32_t)(when - now);
+
+    wheel.next_event = when;
+    wheel.armed = true;
+    hrtimer_start(&wheel.hrtimer, now_ns - rem + (uint64_t)(delta > 0 ? delta : 0) * NSEC_PER_MSEC);
+}
+
+static void ktimer_run(uint32_t now)
+{
+    wheel.running = true;
+    while ((int32_t)(now - wheel.clk) >= 0)
+    {
+        // Jump over empty milliseconds: an idle wheel may be far behind
+        uint32_t next;
+        if (!ktimer_next_event(&next) || (int32_t)(next - now) > 0)
+        {
+            wheel.clk = now + 1;
+            break;
+        }
+        wheel.clk = next;
+
+        // Every level whose span starts here hands its current slot down
+        for (uint32_t level = 1; level < KTIMER_LEVELS; level++)
+        {
+            uint32_t shift = level * KTIMER_LEVEL_BITS;
+            if (wheel.clk & ((1u << shift) - 1))
+                break;
+
+            ktimer_t *list;
+            ktimer_detach_slot(level, (wheel.clk >> shift) & KTIMER_LEVEL_MASK, &list);
+            while (list)
+            {
+                ktimer_t *timer = list;
+                ktimer_unlink(timer);
+                ktimer_stats.pending--;
+                ktimer_enqueue(timer);
+                ktimer_stats.cascaded++;
+            }
+        }
+
+        // Advance first so timers re-armed for now land in the next millisecond, not this slot
+        ktimer_t *list;
+        ktimer_detach_slot(0, wheel.clk & KTIMER_LEVEL_MASK, &list);
+        wheel.clk++;
+        while (list)
+        {
+            ktimer_t *timer = list;
+            ktimer_unlink(timer);
+            ktimer_stats.pending--;
+            ktimer_stats.expired++;
+            timer->function(timer);
+        }
+    }
+    wheel.running = false;
+}
+
+static void ktimer_wheel_expired(hrtimer_t *hrtimer)
+{
+    (void)hrtimer;
+    uint32_t next;
+
+    wheel.armed = false;
+    ktimer_stats.wakeups++;
+    ktimer_run(ktime_get_ms());
+    if (ktimer_next_event(&next))
+        ktimer_program(next);
+}
+
+void ktimer_wheel_init()
+{
+    memset(&wheel, 0, sizeof(wheel));
+    wheel.clk = ktime_get_ms();
+    wheel.hrtimer.function = ktimer_wheel_expired;
+    serial_printf("KTIMER: %d levels of %d slots, 1 ms resolution\n", KTIMER_LEVELS, KTIMER_LEVEL_SIZE);
+}
+
+void ktimer_setup(ktimer_t *timer, void (*function)(ktimer_t *), void *data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->function = function;
+    timer->data = data;
+}
+
+void ktimer_mod(ktimer_t *timer, uint32_t expires)
+{
+    uint32_t flags = irq_save();
+    if (timer->pprev)
+        ktimer_dequeue(timer);
+
+    // Catch an idle wheel up so the timer lands on level 0 when it is close
+    uint32_t now = ktime_get_ms();
+    uint32_t next;
+    if (!wheel.running && (int32_t)(now - wheel.clk) > 0 && (!ktimer_next_event(&next) || (int32_t)(next - now) > 0))
+        wheel.clk = now;
+
+    timer->expires = expires;
+    uint32_t when = ktimer_enqueue(timer);
+    if (!wheel.running && (!wheel.armed || (int32_t)(when - wheel.next_event) < 0))
+        ktimer_program(when);
+    irq_restore(flags);
+}
+
+void ktimer_start(ktimer_t *timer, uint32_t delay_ms)
+{
+    ktimer_mod(timer, ktime_get_ms() + delay_ms);
+}
+
+bool ktimer_cancel(ktimer_t *timer)
+{
+    // A later event for the wheel stays programmed, it just finds nothing to do
+    uint32_t flags = irq_save();
+    bool pending = timer->pprev != NULL;
+    if (pending)
+        ktimer_dequeue(timer);
+    irq_restore(flags);
+    return pending;
+}
@@ -1,9 +1,11 @@
 #include <rtl8139.h>
 #include <arp.h>
 #include "liballoc.h"
+#include "slab.h"
 #include "network.h"
 #include "serial.h"
 #include "ipv4.h"
+#include "ktime.h"
 
 struct arp_cache_entry arp_cache[ARP_CACHE_SIZE];
 // ARP constants
@@ -12,6 +14,7 @@ struct arp_cache_entry arp_cache[ARP_CACHE_SIZE];
 
 struct pending_packet pending_queue[MAX_PENDING_PACKETS];
 int pending_count = 0;
+static kmem_cache_t *arp_payload_cache = NULL;
 
 static bool is_local_ip(uint32_t ip)
 {
@@ -22,8 +25,7 @@ bool arp_cache_contains(uint32_t ip)
 {
     for (int i = 0; i < ARP_CACHE_SIZE; i++)
     {
-        if (arp_cache[i].ip == ip &&
-            (get_ticks() - arp_cache[i].timestamp) < ARP_CACHE_TIMEOUT)
+        if (arp_cache[i].ip == ip)
         {
             return true;
         }
@@ -104,8 +106,7 @@ bool arp_lookup(uint32_t ip, uint8_t *mac)
     // Existing cache lookup for target_ip
     for (int i = 0; i < ARP_CACHE_SIZE; i++)
     {
-        if (arp_cache[i].ip == target_ip &&
-            (get_ticks() - arp_cache[i].timestamp) < ARP_CACHE_TIMEOUT)
+        if (arp_cache[i].ip == target_ip)
         {
             memcpy(mac, arp_cache[i].mac, 6);
             return true;
@@ -121,6 +122,14 @@ bool arp_lookup(uint32_t ip, uint8_t *mac)
     return false;
 }
 
+static void arp_cache_expired(ktimer_t *timer)
+{
+    struct arp_cache_entry *entry = timer->data;
+    serial_printf("ARP: Entry for %d.%d.%d.%d expired\n", (entry->ip >> 24) & 0xFF, (entry->ip >> 16) & 0xFF,
+                  (entry->ip >> 8) & 0xFF, entry->ip & 0xFF);
+    entry->ip = 0;
+}
+
 void arp_cache_update(uint32_t ip, uint8_t *mac)
 {
     if (!mac)
@@ -138,9 +147,12 @@ void arp_cache_update(uint32_t ip, uint8_t *mac)
     {
         if (arp_cache[i].ip == ip || arp_cache[i].ip == 0)
         {
+            if (arp_cache[i].ip == 0)
+                ktimer_setup(&arp_cache[i].expire, arp_cache_expired, &arp_cache[i]);
             arp_cache[i].ip = ip;
             memcpy(arp_cache[i].mac, mac, 6);
-            arp_cache[i].timestamp = get_ticks();
+            arp_cache[i].timestamp = ktime_get_ms();
+            ktimer_start(&arp_cache[i].expire, ARP_CACHE_TIMEOUT);
             return;
         }
     }
@@ -153,17 +165,25 @@ void queue_packet(uint32_t dst_ip, uint8_t protocol, uint8_t *payload, uint16_t
         serial_printf("ARP: Packet queue full\n");
         return;
     }
+    if (payload_len > ARP_PENDING_PAYLOAD)
+    {
+        serial_printf("ARP: Packet of %d bytes too large to queue\n", payload_len);
+        return;
+    }
+    if (!arp_payload_cache)
+        arp_payload_cache = kmem_cache_create("arp_pending", ARP_PENDING_PAYLOAD, 0, 0, NULL);
+
     struct pending_packet *pkt = &pending_queue[pending_count];
     pkt->dst_ip = dst_ip;
     pkt->protocol = protocol;
-    pkt->payload = malloc(payload_len);
+    pkt->payload = kmem_cache_alloc(arp_payload_cache);
     if (!pkt->payload) {
         serial_printf("ARP: Memory allocation failed for packet\n");
         return;
     }
     memcpy(pkt->payload, payload, payload_len);
     pkt->payload_len = payload_len;
-    pkt->timestamp = get_ticks();
+    pkt->timestamp = ktime_get_ms();
     pending_count++;
 }
 
@@ -177,7 +197,7 @@ void retry_pending_packets()
         {
             // Rebuild the IPv4 packet with current source IP
             net_send_ipv4_packet(pkt->dst_ip, pkt->protocol, pkt->payload, pkt->payload_len);
-            free(pkt->payload); // Free allocated payload
+            kmem_cache_free(arp_payload_cache, pkt->payload);
             pkt->payload = NULL;
 
             if (i != pending_count - 1)
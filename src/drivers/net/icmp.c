@@ -5,6 +5,7 @@
 #include "liballoc.h"
 #include "console.h"
 #include "timer.h"
+#include "ktime.h"
 
 // Track sequence numbers
 static uint16_t next_seq = 1;
@@ -95,6 +96,13 @@ void icmp_handle_packet(ipv4_header_t *ip, uint8_t *payload, uint16_t len) {
             console_printf("Sequence: %d\n", ntohs(icmp->seq));
             console_printf("Checksum: 0x%04x\n", icmp->checksum);
             console_printf("Data length: %d bytes\n", len - sizeof(icmp_header_t));
+            if (len >= ICMP_DATA_PATTERN_START + sizeof(uint32_t))
+            {
+                uint32_t sent;
+                memcpy(&sent, (uint8_t *)icmp + ICMP_DATA_PATTERN_START, sizeof(sent));
+                uint32_t rtt = ktime_get_us() - ntohl(sent);
+                console_printf("RTT: %d.%03d ms\n", rtt / 1000, rtt % 1000);
+            }
             prev_id = ntohs(icmp->id);
             break;
 
@@ -118,8 +126,8 @@ void icmp_send_echo_request(uint32_t dst_ip) {
     icmp->id = htons(next_id++);
     icmp->seq = htons(next_seq++);
 
-    // Fill payload with timestamp and pattern
-    uint32_t timestamp = htonl(get_ticks());
+    // Fill payload with the send time in microseconds and a pattern; the reply echoes it back
+    uint32_t timestamp = htonl(ktime_get_us());
     memcpy(packet + ICMP_DATA_PATTERN_START, &timestamp, sizeof(timestamp));
     
     for (int i = ICMP_DATA_PATTERN_START + sizeof(timestamp); i < ICMP_PACKET_SIZE; i++) {
@@ -6,8 +6,9 @@
 #include "arp.h"
 #include "icmp.h"
 #include "tcp.h"
+#include "heapprof.h"
 
-void net_process_packet(uint8_t *data, uint16_t len)
+static void net_dispatch_packet(uint8_t *data, uint16_t len)
 {
     if (!data || len < sizeof(struct eth_header))
     {
@@ -154,4 +155,11 @@ void net_process_packet(uint8_t *data, uint16_t len)
     default:
         break;
     }
-}
\ No newline at end of file
+}
+void net_process_packet(uint8_t *data, uint16_t len)
+{
+    // Everything allocated while handling the packet is charged to the network
+    heap_tag_t prev = heapprof_set_tag(HEAP_TAG_NET);
+    net_dispatch_packet(data, len);
+    heapprof_set_tag(prev);
+}
@@ -2,8 +2,12 @@
 #include "network.h"
 #include "serial.h"
 #include "liballoc.h"
+#include "slab.h"
+#include "arena.h"
+#include "io.h"
 #include "string.h"
 #include "timer.h"
+#include "ktime.h"
 #include "console.h"
 #include "fat.h"
 #include "printf.h"
@@ -11,8 +15,10 @@
 #define DEFAULT_WINDOW_SIZE 5840
 #define TCP_SYN_RETRANSMIT_TIMEOUT 3000
 #define TCP_DATA_RETRANSMIT_TIMEOUT 3000
+#define TCP_DELACK_TIMEOUT 40 // ms, RFC 1122 allows up to 500
 #define MAX_SYN_RETRIES 5
 #define DEFAULT_MSS 1460
+#define TCP_SEGMENT_CACHE_SIZE DEFAULT_MSS // retransmit copies up to this size come from a cache
 
 #define HTTP_PORT 8080
 // #define HTTP_RESPONSE                                                       \
@@ -42,23 +48,46 @@ struct listening_port
     struct listening_port *next;
 };
 
-typedef struct tcp_timer
+static struct listening_port *listen_ports = NULL;
+
+static kmem_cache_t *tcp_connection_cache = NULL;
+static kmem_cache_t *tcp_retransmit_cache = NULL;
+static kmem_cache_t *tcp_segment_cache = NULL;
+static kmem_cache_t *tcp_listen_cache = NULL;
+static arena_t *tcp_arena = NULL; // segments being built and HTTP responses, reset when each is sent
+
+static bool tcp_init_caches()
 {
-    tcp_connection_t *conn;
-    uint32_t timeout_ms;
-    uint32_t start_time;
-    uint8_t retries;
-    struct tcp_timer *next;
-} tcp_timer_t;
+    if (tcp_connection_cache)
+        return true;
 
-static struct listening_port *listen_ports = NULL;
-static tcp_timer_t *active_timers = NULL;
+    tcp_retransmit_cache = kmem_cache_create("tcp_retransmit", sizeof(retransmit_entry_t), 0, 0, NULL);
+    tcp_segment_cache = kmem_cache_create("tcp_segment", TCP_SEGMENT_CACHE_SIZE, 0, 0, NULL);
+    tcp_listen_cache = kmem_cache_create("tcp_listen", sizeof(struct listening_port), 0, 0, NULL);
+    tcp_arena = arena_create("tcp", 0);
+    tcp_connection_cache = kmem_cache_create("tcp_connection", sizeof(tcp_connection_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!tcp_connection_cache || !tcp_retransmit_cache || !tcp_segment_cache || !tcp_listen_cache || !tcp_arena)
+    {
+        serial_printf("TCP: Failed to create object caches\n");
+        return false;
+    }
+    return true;
+}
+
+static void free_retransmit_entry(retransmit_entry_t *entry)
+{
+    if (entry->data && entry->length <= TCP_SEGMENT_CACHE_SIZE)
+        kmem_cache_free(tcp_segment_cache, entry->data);
+    else if (entry->data)
+        free(entry->data);
+    kmem_cache_free(tcp_retransmit_cache, entry);
+}
 
 static uint32_t generate_secure_initial_seq()
 {
+    // RFC 793's clock: one step every 4 microseconds
     static uint32_t counter = 0;
-    uint32_t tick = get_ticks();
-    return (tick << 16) | (counter++ & 0xFFFF);
+    return (uint32_t)(ktime_get_ns() >> 12) + (counter++ << 16);
 }
 
 static tcp_connection_t *find_connection(uint32_t remote_ip, uint16_t remote_port,
@@ -85,31 +114,23 @@ static void add_connection(tcp_connection_t *conn)
 
 void cancel_retransmission_timer(tcp_connection_t *conn)
 {
-    tcp_timer_t **pp = &active_timers;
-    while (*pp)
-    {
-        tcp_timer_t *curr = *pp;
-        if (curr->conn == conn)
-        {
-            *pp = curr->next;
-            free(curr);
-            return;
-        }
-        pp = &(*pp)->next;
-    }
+    ktimer_cancel(&conn->rto_timer);
 }
 
+// Process context (telnet) and the NIC and timer interrupts all work on connections,
+// so the entry points below keep interrupts off while they touch one
 void remove_connection(tcp_connection_t *conn)
 {
+    uint32_t irq = irq_save();
     cancel_retransmission_timer(conn);
+    ktimer_cancel(&conn->delack_timer);
 
     // Free retransmission queue
     retransmit_entry_t *entry = conn->retransmit_queue;
     while (entry)
     {
         retransmit_entry_t *next = entry->next;
-        free(entry->data);
-        free(entry);
+        free_retransmit_entry(entry);
         entry = next;
     }
 
@@ -119,16 +140,20 @@ void remove_connection(tcp_connection_t *conn)
         if (*pp == conn)
         {
             *pp = conn->next;
-            free(conn);
-            return;
+            kmem_cache_free(tcp_connection_cache, conn);
+            break;
         }
         pp = &(*pp)->next;
     }
+    irq_restore(irq);
 }
 
 void tcp_listen(uint16_t port)
 {
-    struct listening_port *new_port = malloc(sizeof(struct listening_port));
+    if (!tcp_init_caches())
+        return;
+
+    struct listening_port *new_port = kmem_cache_alloc(tcp_listen_cache);
     if (!new_port)
     {
         serial_printf("TCP: Failed to allocate memory for listening port\n");
@@ -199,85 +224,72 @@ void process_tcp_options(tcp_connection_t *conn, uint8_t *options, uint8_t optio
 
 void start_retransmission_timer(tcp_connection_t *conn, uint32_t timeout_ms)
 {
-    tcp_timer_t *timer = malloc(sizeof(tcp_timer_t));
-    if (!timer)
-    {
-        serial_printf("TCP: Failed to allocate memory for retransmission timer\n");
-        return;
-    }
-    timer->conn = conn;
-    timer->timeout_ms = timeout_ms;
-    timer->start_time = get_ticks();
-    timer->retries = 0;
-    timer->next = active_timers;
-    active_timers = timer;
+    conn->rto_ms = timeout_ms;
+    conn->rto_retries = 0;
+    ktimer_start(&conn->rto_timer, timeout_ms);
 }
 
-void check_tcp_timers(void)
+static void tcp_rto_expired(ktimer_t *timer)
 {
-    tcp_timer_t **pp = &active_timers;
-    uint32_t current_time = get_ticks();
+    tcp_connection_t *conn = timer->data;
 
-    while (*pp)
+    if (conn->state == TCP_WAIT_FOR_ACK)
     {
-        tcp_timer_t *timer = *pp;
-        tcp_connection_t *conn = timer->conn;
-
-        if (current_time - timer->start_time >= timer->timeout_ms)
+        // Handle data retransmission
+        retransmit_entry_t *entry = conn->retransmit_queue;
+        if (entry && entry->retries < MAX_SYN_RETRIES)
         {
-            if (conn->state == TCP_WAIT_FOR_ACK)
-            {
-                // Handle data retransmission
-                retransmit_entry_t *entry = conn->retransmit_queue;
-                if (entry && entry->retries < MAX_SYN_RETRIES)
-                {
-                    // Retransmit the segment
-                    tcp_send_segment(conn, TCP_ACK, entry->data, entry->length);
-                    entry->start_time = get_ticks();
-                    entry->retries++;
-                    timer->start_time = get_ticks(); // Reset timer
-                    serial_printf("TCP: Retransmitting SEQ=%u (attempt %u)\n",
-                                  entry->seq, entry->retries);
-                    pp = &(*pp)->next; // Keep timer active
-                }
-                else
-                {
-                    // Max retries reached
-                    serial_printf("TCP: Max retries reached, closing connection\n");
-                    remove_connection(conn);
-                    tcp_timer_t *to_free = *pp;
-                    *pp = to_free->next;
-                    free(to_free);
-                }
-            }
-            else
-            {
-                // Handle SYN/FIN retransmission
-                if (timer->retries < MAX_SYN_RETRIES)
-                {
-                    tcp_send_segment(conn, timer->conn->state == TCP_SYN_SENT ? TCP_SYN : TCP_FIN,
-                                     NULL, 0);
-                    timer->retries++;
-                    timer->start_time = get_ticks();
-                    serial_printf("TCP: Retransmitting control packet (attempt %u)\n",
-                                  timer->retries);
-                    pp = &(*pp)->next;
-                }
-                else
-                {
-                    serial_printf("TCP: Max control retries reached, closing\n");
-                    remove_connection(conn);
-                    tcp_timer_t *to_free = *pp;
-                    *pp = to_free->next;
-                    free(to_free);
-                }
-            }
+            // Retransmit the segment
+            tcp_send_segment(conn, TCP_ACK, entry->data, entry->length);
+            entry->start_time = ktime_get_ms();
+            entry->retries++;
+            ktimer_start(timer, conn->rto_ms);
+            serial_printf("TCP: Retransmitting SEQ=%u (attempt %u)\n",
+                          entry->seq, entry->retries);
         }
         else
         {
-            pp = &(*pp)->next;
+            serial_printf("TCP: Max retries reached, closing connection\n");
+            remove_connection(conn);
         }
     }
+    else
+    {
+        // Handle SYN/FIN retransmission
+        if (conn->rto_retries < MAX_SYN_RETRIES)
+        {
+            tcp_send_segment(conn, conn->state == TCP_SYN_SENT ? TCP_SYN : TCP_FIN, NULL, 0);
+            conn->rto_retries++;
+            ktimer_start(timer, conn->rto_ms);
+            serial_printf("TCP: Retransmitting control packet (attempt %u)\n",
+                          conn->rto_retries);
+        }
+        else
+        {
+            serial_printf("TCP: Max control retries reached, closing\n");
+            remove_connection(conn);
+        }
+    }
+}
+
+static void tcp_delack_expired(ktimer_t *timer)
+{
+    tcp_send_segment(timer->data, TCP_ACK, NULL, 0);
+}
+
+// ACK every second segment at once, otherwise give the reply a chance to carry it
+static void tcp_delay_ack(tcp_connection_t *conn)
+{
+    if (ktimer_pending(&conn->delack_timer))
+        tcp_send_segment(conn, TCP_ACK, NULL, 0);
+    else
+        ktimer_start(&conn->delack_timer, TCP_DELACK_TIMEOUT);
+}
+
+static void tcp_init_timers(tcp_connection_t *conn)
+{
+    ktimer_setup(&conn->rto_timer, tcp_rto_expired, conn);
+    ktimer_setup(&conn->delack_timer, tcp_delack_expired, conn);
 }
 
 void tcp_send_reset(ipv4_header_t *ip, tcp_header_t *tcp)
@@ -333,7 +345,7 @@ uint16_t tcp_checksum(ipv4_header_t *ip, tcp_header_t *tcp, uint16_t tcp_len)
     return (uint16_t)~sum;
 }
 
-void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint16_t data_len)
+static void tcp_transmit(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint16_t data_len)
 {
     uint8_t options[4] = {0};
     uint8_t options_len = 0;
@@ -349,7 +361,13 @@ void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint
     }
 
     uint16_t header_len = sizeof(tcp_header_t) + options_len;
-    uint8_t packet[header_len + data_len];
+    arena_mark_t mark = arena_mark(tcp_arena);
+    uint8_t *packet = arena_alloc(tcp_arena, header_len + data_len);
+    if (!packet)
+    {
+        serial_printf("TCP: No buffer for a %d byte segment\n", header_len + data_len);
+        return;
+    }
     tcp_header_t *tcp = (tcp_header_t *)packet;
 
     tcp->src_port = htons(conn->local_port);
@@ -388,17 +406,20 @@ void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint
         .dst_ip = htonl(conn->remote_ip)};
     tcp->checksum = tcp_checksum(&ip_dummy, tcp, header_len + data_len);
 
+    net_send_ipv4_packet(conn->remote_ip, IP_PROTO_TCP, packet, header_len + data_len);
+    arena_reset(tcp_arena, mark);
+
+    // Whatever was being held back is acknowledged by this segment
+    if (flags & TCP_ACK)
+        ktimer_cancel(&conn->delack_timer);
+
     if (flags == TCP_ACK && data_len == 0)
-    {
-        net_send_ipv4_packet(conn->remote_ip, IP_PROTO_TCP, packet, header_len + data_len);
         return;
-    }
-    net_send_ipv4_packet(conn->remote_ip, IP_PROTO_TCP, packet, header_len + data_len);
 
     // Add to retransmit queue if needed
     if (flags & (TCP_SYN | TCP_FIN) || data_len > 0)
     {
-        retransmit_entry_t *entry = malloc(sizeof(retransmit_entry_t));
+        retransmit_entry_t *entry = kmem_cache_alloc(tcp_retransmit_cache);
         if (!entry)
         {
             serial_printf("TCP: Retransmit entry allocation failed\n");
@@ -411,10 +432,10 @@ void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint
 
         if (data_len > 0)
         {
-            entry->data = malloc(data_len);
+            entry->data = data_len <= TCP_SEGMENT_CACHE_SIZE ? kmem_cache_alloc(tcp_segment_cache) : malloc(data_len);
             if (!entry->data)
             {
-                free(entry);
+                kmem_cache_free(tcp_retransmit_cache, entry);
                 serial_printf("TCP: Data buffer allocation failed\n");
                 return;
             }
@@ -428,6 +449,14 @@ void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint
     }
 }
 
+// next_seq, the retransmit queue and the NIC's transmit slot are shared with the interrupts
+void tcp_send_segment(tcp_connection_t *conn, uint8_t flags, uint8_t *data, uint16_t data_len)
+{
+    uint32_t irq = irq_save();
+    tcp_transmit(conn, flags, data, data_len);
+    irq_restore(irq);
+}
+
 static void handle_http_request(tcp_connection_t *conn)
 {
     FAT32_File file;
@@ -442,7 +471,8 @@ static void handle_http_request(tcp_connection_t *conn)
         conn->state = TCP_CLOSE_WAIT;
         return;
     }
-    uint8_t *buffer = malloc(file.size);
+    arena_mark_t mark = arena_mark(tcp_arena);
+    uint8_t *buffer = arena_alloc(tcp_arena, file.size);
     if (!buffer)
     {
         serial_printf("HTTP: Buffer allocation failed\n");
@@ -477,7 +507,7 @@ static void handle_http_request(tcp_connection_t *conn)
     conn->state = TCP_WAIT_FOR_ACK;
     start_retransmission_timer(conn, TCP_DATA_RETRANSMIT_TIMEOUT);
 
-    free(buffer);
+    arena_reset(tcp_arena, mark);
 }
 
 static int is_http_get_request(uint8_t *data, uint16_t len)
@@ -493,7 +523,6 @@ static void handle_established_state(tcp_connection_t *conn, tcp_header_t *tcp,
 
     serial_printf("TCP: SEQ=%u ACK=%u DATA_LEN=%u\n", seq, ack, data_len);
 
-    check_tcp_timers();
     if (conn->state == TCP_SYN_SENT)
     {
         conn->state = TCP_ESTABLISHED;
@@ -543,8 +572,7 @@ static void handle_established_state(tcp_connection_t *conn, tcp_header_t *tcp,
             // Remove acknowledged entries
             serial_printf("TCP: Acknowledged SEQ=%u\n", entry->seq);
             *pp = entry->next;
-            free(entry->data);
-            free(entry);
+            free_retransmit_entry(entry);
         }
         else
         {
@@ -580,7 +608,7 @@ static void handle_established_state(tcp_connection_t *conn, tcp_header_t *tcp,
             //     console_putchar(payload[i]); // Print each character individually
             // }
             // console_flush();
-            tcp_send_segment(conn, TCP_ACK, NULL, 0);
+            tcp_delay_ack(conn);
         }
     }
 
@@ -611,8 +639,7 @@ static void handle_wait_for_ack_state(tcp_connection_t *conn, tcp_header_t *tcp)
             // Full ACK received, clean up
             serial_printf("TCP: Complete ACK %u >= %u\n", ack, expected_ack);
             conn->retransmit_queue = entry->next;
-            free(entry->data);
-            free(entry);
+            free_retransmit_entry(entry);
             
             if (!conn->retransmit_queue) {
                 remove_connection(conn);
@@ -693,14 +720,13 @@ void tcp_handle_packet(ipv4_header_t *ip, uint8_t *data, uint16_t len)
             return;
         }
 
-        conn = malloc(sizeof(tcp_connection_t));
+        conn = tcp_init_caches() ? kmem_cache_zalloc(tcp_connection_cache) : NULL;
         if (!conn)
         {
             serial_printf("TCP: Memory allocation failed\n");
             return;
         }
 
-        memset(conn, 0, sizeof(tcp_connection_t));
         conn->local_ip = ntohl(ip->dst_ip);
         conn->remote_ip = ntohl(ip->src_ip);
         conn->local_port = dest_port;
@@ -709,6 +735,7 @@ void tcp_handle_packet(ipv4_header_t *ip, uint8_t *data, uint16_t len)
         conn->expected_ack = ntohl(tcp->seq) + 1;
         conn->state = TCP_SYN_RECEIVED;
         conn->mss = DEFAULT_MSS;
+        tcp_init_timers(conn);
 
         uint8_t options_len = (tcp->data_offset >> 4) * 4 - sizeof(tcp_header_t);
         if (options_len > 0)
@@ -777,7 +804,10 @@ void tcp_handle_packet(ipv4_header_t *ip, uint8_t *data, uint16_t len)
 
 tcp_connection_t *tcp_connect(uint32_t remote_ip, uint16_t remote_port)
 {
-    tcp_connection_t *conn = malloc(sizeof(tcp_connection_t));
+    if (!tcp_init_caches())
+        return NULL;
+
+    tcp_connection_t *conn = kmem_cache_zalloc(tcp_connection_cache);
     if (!conn)
         return NULL;
 
@@ -789,9 +819,12 @@ tcp_connection_t *tcp_connect(uint32_t remote_ip, uint16_t remote_port)
     conn->state = TCP_SYN_SENT;
     conn->next_seq = generate_secure_initial_seq();
     conn->expected_ack = 0;
+    tcp_init_timers(conn);
 
     // Send SYN
+    uint32_t irq = irq_save();
     tcp_send_segment(conn, TCP_SYN, NULL, 0);
     add_connection(conn);
+    irq_restore(irq);
     return conn;
 }
\ No newline at end of file
@@ -62,10 +62,15 @@
 #define NE2K_ISR_RDC 0x40
 #define NE2K_ISR_RST 0x80
 
+#define NE2K_RX_BUFFER_SIZE 1536 // largest frame (1514) rounded up
+
 static uint16_t ne2k_iobase = 0;
 static uint8_t ne2k_mac[6] = {0};
 static int ne2k_present = 0;
 static uint8_t ne2k_irq = 0;
+// Filled by PIO from the card's own ring, so any kernel memory will do. The ISR
+// does not nest and net_process_packet is done with it before returning.
+static uint8_t ne2k_rx_buffer[NE2K_RX_BUFFER_SIZE];
 
 int ne2k_is_present()
 {
@@ -161,15 +166,22 @@ static void ne2k_isr(REGISTERS *regs)
         outportb(ne2k_iobase + NE2K_RBCR1, len >> 8);
         outportb(ne2k_iobase + NE2K_CR, NE2K_CR_STA | NE2K_CR_RD2 | 0x08);
 
-        uint8_t buf[1514];
+        uint8_t *buf = ne2k_rx_buffer;
         for (uint16_t i = 0; i < len; i++)
-            buf[i] = inportb(ne2k_iobase + 0x10);
+        {
+            uint8_t byte = inportb(ne2k_iobase + 0x10);
+            if (i < NE2K_RX_BUFFER_SIZE)
+                buf[i] = byte;
+        }
 
         while (!(inportb(ne2k_iobase + NE2K_ISR) & NE2K_ISR_RDC))
             ;
         outportb(ne2k_iobase + NE2K_ISR, NE2K_ISR_RDC);
 
-        net_process_packet(buf, len);
+        if (len <= NE2K_RX_BUFFER_SIZE)
+            net_process_packet(buf, len);
+        else
+            serial_printf("NE2K: Dropped %d byte packet\n", len);
 
         uint8_t new_bnry = (next == NE2K_RX_START) ? (NE2K_RX_STOP - 1) : (next - 1);
         outportb(ne2k_iobase + NE2K_BNRY, new_bnry);
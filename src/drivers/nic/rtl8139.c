@@ -54,30 +54,29 @@ void rtl8139_init()
         return;
     }
 
-    nic.rx_buffer = dma_alloc(RX_BUFFER_PAGES);
+    // With WRAP set the card may run a packet past the end of the ring, RX_BUFFER_SIZE leaves room for it
+    nic.rx_buffer = dma_alloc_coherent(RX_BUFFER_SIZE, &nic.rx_phys);
     if (!nic.rx_buffer)
     {
         serial_printf("RTL8139: Failed to allocate RX buffer\n");
         return;
     }
-    nic.rx_phys = virt_to_phys(nic.rx_buffer);
     outportl(nic.iobase + REG_RXBUF, nic.rx_phys);
 
-    // Correct TX buffer setup
-    uint32_t tx_total_size = NUM_TX_BUFFERS * TX_BUFFER_SIZE;
-    uint32_t tx_pages = (tx_total_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    nic.tx_buffer = dma_alloc(tx_pages);
-    if (!nic.tx_buffer)
-    {
-        serial_printf("RTL8139: Failed to allocate TX buffer\n");
-        dma_free(nic.rx_buffer, RX_BUFFER_PAGES);
-        return;
-    }
-    nic.tx_phys = virt_to_phys(nic.tx_buffer);
+    // Each TX descriptor gets its own buffer from a pool, 4-byte aligned as the card requires
+    nic.tx_pool = dma_pool_create("rtl8139 tx", TX_BUFFER_SIZE, TX_PACKET_ALIGN);
     for (int i = 0; i < NUM_TX_BUFFERS; i++)
     {
-        uint32_t tx_phys = nic.tx_phys + (i * TX_BUFFER_SIZE);
-        outportl(nic.iobase + REG_TXADDR0 + (i * 4), tx_phys);
+        nic.tx_buffers[i] = nic.tx_pool ? dma_pool_alloc(nic.tx_pool, &nic.tx_phys[i]) : NULL;
+        if (!nic.tx_buffers[i])
+        {
+            serial_printf("RTL8139: Failed to allocate TX buffer %d\n", i);
+            dma_pool_destroy(nic.tx_pool);
+            dma_free_coherent(nic.rx_buffer, RX_BUFFER_SIZE);
+            nic.rx_buffer = NULL;
+            return;
+        }
+        outportl(nic.iobase + REG_TXADDR0 + (i * 4), nic.tx_phys[i]);
     }
 
     outportb(nic.iobase + REG_CONFIG1, 0x0); 
@@ -118,7 +117,7 @@ void rtl8139_send_packet(uint8_t *data, uint16_t len)
         return;
     }
 
-    uint8_t *tx_buf = nic.tx_buffer + (nic.tx_current * TX_BUFFER_SIZE);
+    uint8_t *tx_buf = nic.tx_buffers[nic.tx_current];
     memcpy(tx_buf, data, len);
 
     outportl(nic.iobase + REG_TXSTATUS0 + (nic.tx_current *4), len);
@@ -6,6 +6,8 @@
 #include "vmm.h"
 #include "paging.h"
 #include "pmm.h"
+#include "vm_region.h"
+#include "cma.h"
 #include "liballoc.h"
 #include "io.h"
 
@@ -95,59 +97,34 @@ int vesa_init(uint32_t *framebuffer, uint32_t width, uint32_t height, uint32_t p
     uint32_t aligned_size = (buffer_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     uint32_t pages_needed = aligned_size / PAGE_SIZE;
     
-    serial_printf("VESA: Allocating %d pages (%d bytes) for back buffer\n", 
+    serial_printf("VESA: Reserving %d pages (%d bytes) for back buffer\n", 
                  pages_needed, aligned_size);
 
-    const uint32_t CHUNK_SIZE = 32; 
-    uint32_t remaining_pages = pages_needed;
-    uint32_t current_offset = 0;
-
-    void **phys_chunks = malloc(sizeof(void*) * ((pages_needed + CHUNK_SIZE - 1) / CHUNK_SIZE));
-    if (!phys_chunks) {
-        serial_printf("VESA: Failed to allocate chunk tracking array\n");
-        return -1;
-    }
-    int chunk_count = 0;
-
-    while (remaining_pages > 0) {
-        uint32_t chunk_pages = (remaining_pages > CHUNK_SIZE) ? CHUNK_SIZE : remaining_pages;
-        void *phys_chunk = pmm_alloc_blocks(chunk_pages);
-        
-        if (!phys_chunk) {
-            serial_printf("VESA: Failed to allocate chunk of %d pages\n", chunk_pages);
-            for (int i = 0; i < chunk_count; i++) {
-                pmm_free_blocks(phys_chunks[i], CHUNK_SIZE);
-            }
-            free(phys_chunks);
-            return -1;
+    // One contiguous run from the CMA area, 4MB aligned so it maps with large pages.
+    // It is ordinary RAM that gets read back, so keep it write-back cached: the
+    // physmap already maps it that way unless it lies above the physmap
+    void *back_phys = cma_alloc(pages_needed, CMA_ALIGN_BLOCKS);
+    if (back_phys) {
+        if (physmap_covers((uint32_t)back_phys, aligned_size))
+            g_back_buffer = (void *)phys_to_virt((uint32_t)back_phys);
+        else
+            g_back_buffer = vmm_map_mmio((uint32_t)back_phys, aligned_size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_WB);
+        if (g_back_buffer) {
+            pmm_set_owner(back_phys, pages_needed, PAGE_OWNER_FRAMEBUFFER);
+            memset(g_back_buffer, 0, aligned_size);
+        } else {
+            cma_release(back_phys, pages_needed);
         }
-        
-        phys_chunks[chunk_count++] = phys_chunk;
-        
-        void *virt_chunk = vmm_map_mmio((uintptr_t)phys_chunk, 
-                                       chunk_pages * PAGE_SIZE,
-                                       PAGE_PRESENT | PAGE_WRITABLE | PAGE_UNCACHED);
-        
-        if (!virt_chunk) {
-            serial_printf("VESA: Failed to map chunk\n");
-            for (int i = 0; i < chunk_count; i++) {
-                pmm_free_blocks(phys_chunks[i], CHUNK_SIZE);
-            }
-            free(phys_chunks);
-            return -1;
-        }
-
-        if (current_offset == 0) {
-            g_back_buffer = (uint32_t*)virt_chunk;
-        }
-
-        memset(virt_chunk, 0, chunk_pages * PAGE_SIZE);
-        
-        remaining_pages -= chunk_pages;
-        current_offset += chunk_pages * PAGE_SIZE;
     }
 
-    free(phys_chunks);
+    // Otherwise demand-zero: frames are only allocated for the parts that get drawn to
+    if (!g_back_buffer)
+        g_back_buffer = vm_region_create_anon("vesa back buffer", aligned_size,
+                                              PAGE_PRESENT | PAGE_WRITABLE | PAGE_WB, PAGE_OWNER_FRAMEBUFFER);
+    if (!g_back_buffer) {
+        serial_printf("VESA: Failed to reserve back buffer\n");
+        return -1;
+    }
     
     g_vsync_supported = true;
     uint8_t status = inportb(0x3DA);
@@ -10,6 +10,7 @@
 #include "kernel.h"
 #include "keyboard.h"
 #include "liballoc.h"
+#include "memops.h"
 #include "multiboot.h"
 #include "pmm.h"
 #include "pci.h"
@@ -18,6 +19,9 @@
 #include "shell.h"
 #include "string.h"
 #include "timer.h"
+#include "ktime.h"
+#include "clockevent.h"
+#include "ktimer.h"
 #include "tss.h"
 #include "vesa.h"
 #include "vmm.h"
@@ -118,14 +122,11 @@ void kmain(unsigned long magic, unsigned long addr)
     }
 
     uint32_t total_memory_kb = mboot_info->mem_lower + mboot_info->mem_upper;
-    uint32_t total_memory_bytes = total_memory_kb * 1024;
 
     serial_printf("Memory: Lower: %dKB, Upper: %dKB, Total: %dKB\n",
                   mboot_info->mem_lower, mboot_info->mem_upper, total_memory_kb);
 
-#define PMM_BITMAP_SIZE (128 * 1024) // 128KB bitmap can handle 4GB
-    static uint8_t pmm_bitmap[PMM_BITMAP_SIZE] __attribute__((aligned(4096)));
-    pmm_init(total_memory_bytes, pmm_bitmap);
+    pmm_init(mboot_info);
 
     serial_printf("Initializing paging and VMM...\n");
     vmm_init();
@@ -135,15 +136,21 @@ void kmain(unsigned long magic, unsigned long addr)
     // bios32_init();
 
     uint32_t fb_size = height * pitch; 
-    uint32_t fb_pages = (fb_size + PAGE_SIZE - 1) / PAGE_SIZE;
     uint32_t fb_phys = (uint32_t)framebuffer;
-    uint32_t fb_virt = KERNEL_VMEM_START + 0x3000000;
 
-    for (uint32_t i = 0; i < fb_pages; i++)
+    // VRAM BARs are bigger than the visible frame, so round up to whole 4MB
+    // pages when the framebuffer starts on one
+    uint32_t fb_map_size = fb_size;
+    if (paging_pse && !(fb_phys & (LARGE_PAGE_SIZE - 1)))
+        fb_map_size = (fb_size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+
+    // Take the window from the VMM so later allocations can not land on top of it
+    // Write-combining: the CPU only ever streams whole frames into VRAM
+    uint32_t fb_virt = (uint32_t)vmm_map_mmio(fb_phys, fb_map_size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_WC);
+    if (!fb_virt)
     {
-        paging_map_page(fb_phys + (i * PAGE_SIZE),
-                        fb_virt + (i * PAGE_SIZE),
-                        PAGE_PRESENT | PAGE_WRITABLE | PAGE_UNCACHED);
+        panic("Failed to map the framebuffer");
+        return;
     }
 
     framebuffer = (uint32_t *)fb_virt;
@@ -166,12 +173,19 @@ void kmain(unsigned long magic, unsigned long addr)
 
     serial_printf("Initializing timer...\n");
     timer_init();
+    ktime_init();
+    clockevent_init();
+    ktimer_wheel_init();
 
     serial_printf("Initializing keyboard...\n");
     keyboard_init();
 
     serial_printf("Enabling FPU...\n");
     fpu_enable();
+    memops_init();
+
+    serial_printf("Initializing PCI...\n");
+    pci_init();
 
     serial_printf("Initializing ATA...\n");
     ata_init();
@@ -188,9 +202,6 @@ void kmain(unsigned long magic, unsigned long addr)
         serial_printf("[IDE] Sector 0 read failed\n");
     }
 
-    serial_printf("Initializing PCI...\n");
-    pci_init();
-
     // __asm__ volatile("sti");
     serial_printf("Initializing Ethernet...\n");
     eth_init();
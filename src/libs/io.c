@@ -57,4 +57,44 @@ uint16_t inportd(uint16_t port)
 void outportd(uint16_t port, uint16_t data)
 {
     __asm__ volatile("outw %0, %1" : : "a"(data), "d"(port));
-}
\ No newline at end of file
+}
+
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+uint32_t irq_save()
+{
+    uint32_t flags;
+    __asm__ volatile("pushfl\n"
+                     "popl %0\n"
+                     "cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+void irq_restore(uint32_t flags)
+{
+    if (flags & 0x200)
+        __asm__ volatile("sti" ::: "memory");
+}
+
+void halt_until(bool (*done)(void *), void *arg)
+{
+    uint32_t flags = irq_save();
+    while (!done(arg))
+        __asm__ volatile("sti; hlt; cli" ::: "memory");
+    irq_restore(flags);
+}
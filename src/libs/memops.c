@@ -0,0 +1,303 @@
+#include "memops.h"
+#include "string.h"
+#include "serial.h"
+#include "io.h"
+
+memops_config_t memops = {false, false, MEMOPS_MOVSD, MEMOPS_MOVSD};
+
+static const char *memops_names[MEMOPS_IMPL_COUNT] = {
+    [MEMOPS_BYTES] = "bytes",
+    [MEMOPS_MOVSD] = "movsd",
+    [MEMOPS_MOVSB] = "movsb",
+    [MEMOPS_SSE2] = "sse2",
+    [MEMOPS_SSE2_NT] = "sse2-nt",
+};
+
+void memops_init()
+{
+    uint32_t eax, ebx, ecx, edx, cr4;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    // SSE2 needs the OS side too: fpu_enable sets CR4.OSFXSR when the CPU has FXSR
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    memops.sse2 = (edx & (1 << 26)) && (cr4 & (1 << 9));
+
+    if (max_leaf >= 7)
+    {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        memops.erms = (ebx & (1 << 9)) != 0;
+    }
+
+    memops.medium = memops.erms ? MEMOPS_MOVSB : memops.sse2 ? MEMOPS_SSE2 : MEMOPS_MOVSD;
+    memops.large = memops.sse2 ? MEMOPS_SSE2_NT : memops.medium;
+    serial_printf("MEMOPS: %s below %d KB, %s above\n", memops_names[memops.medium], MEMOPS_NT_THRESHOLD / 1024,
+                  memops_names[memops.large]);
+}
+
+bool memops_available(memops_impl_t impl)
+{
+    switch (impl)
+    {
+    case MEMOPS_BYTES:
+    case MEMOPS_MOVSD:
+        return true;
+    case MEMOPS_MOVSB:
+        return memops.erms;
+    case MEMOPS_SSE2:
+    case MEMOPS_SSE2_NT:
+        return memops.sse2;
+    default:
+        return false;
+    }
+}
+
+const char *memops_impl_name(memops_impl_t impl)
+{
+    return impl < MEMOPS_IMPL_COUNT ? memops_names[impl] : "?";
+}
+
+static inline void copy_movsd(void *dst, const void *src, size_t n)
+{
+    uint32_t ecx, edi, esi;
+    __asm__ volatile("rep movsl\n\t"
+                     "movl %4, %%ecx\n\t"
+                     "rep movsb"
+                     : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+                     : "0"(n / 4), "q"(n & 3), "1"(dst), "2"(src)
+                     : "memory");
+}
+
+static inline void copy_movsb(void *dst, const void *src, size_t n)
+{
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void set_stosd(void *dst, uint8_t c, size_t n)
+{
+    uint32_t ecx, edi;
+    __asm__ volatile("rep stosl\n\t"
+                     "movl %3, %%ecx\n\t"
+                     "rep stosb"
+                     : "=&c"(ecx), "=&D"(edi)
+                     : "a"(c * 0x01010101u), "q"(n & 3), "0"(n / 4), "1"(dst)
+                     : "memory");
+}
+
+static inline void set_stosb(void *dst, uint8_t c, size_t n)
+{
+    __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+}
+
+// The XMM registers the SSE2 loops use belong to whoever was interrupted
+static inline void xmm_save(uint8_t save[64])
+{
+    __asm__ volatile("movdqu %%xmm0, 0(%0)\n\t"
+                     "movdqu %%xmm1, 16(%0)\n\t"
+                     "movdqu %%xmm2, 32(%0)\n\t"
+                     "movdqu %%xmm3, 48(%0)" : : "r"(save) : "memory");
+}
+
+static inline void xmm_restore(const uint8_t save[64])
+{
+    __asm__ volatile("movdqu 0(%0), %%xmm0\n\t"
+                     "movdqu 16(%0), %%xmm1\n\t"
+                     "movdqu 32(%0), %%xmm2\n\t"
+                     "movdqu 48(%0), %%xmm3" : : "r"(save) : "memory");
+}
+
+// 64 bytes per iteration, destination 16-byte aligned first so the stores can be aligned
+static void copy_sse2(uint8_t *dst, const uint8_t *src, size_t n, bool nt)
+{
+    size_t head = -(uint32_t)dst & 15;
+    if (head > n)
+        head = n;
+    copy_movsd(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    uint32_t blocks = n / 64;
+    if (blocks)
+    {
+        uint8_t save[64];
+        xmm_save(save);
+        if (nt)
+        {
+            __asm__ volatile("1:\n\t"
+                             "prefetchnta 256(%1)\n\t"
+                             "movdqu 0(%1), %%xmm0\n\t"
+                             "movdqu 16(%1), %%xmm1\n\t"
+                             "movdqu 32(%1), %%xmm2\n\t"
+                             "movdqu 48(%1), %%xmm3\n\t"
+                             "movntdq %%xmm0, 0(%0)\n\t"
+                             "movntdq %%xmm1, 16(%0)\n\t"
+                             "movntdq %%xmm2, 32(%0)\n\t"
+                             "movntdq %%xmm3, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "add $64, %1\n\t"
+                             "dec %2\n\t"
+                             "jnz 1b\n\t"
+                             "sfence"
+                             : "+r"(dst), "+r"(src), "+r"(blocks) : : "memory");
+        }
+        else
+        {
+            __asm__ volatile("1:\n\t"
+                             "movdqu 0(%1), %%xmm0\n\t"
+                             "movdqu 16(%1), %%xmm1\n\t"
+                             "movdqu 32(%1), %%xmm2\n\t"
+                             "movdqu 48(%1), %%xmm3\n\t"
+                             "movdqa %%xmm0, 0(%0)\n\t"
+                             "movdqa %%xmm1, 16(%0)\n\t"
+                             "movdqa %%xmm2, 32(%0)\n\t"
+                             "movdqa %%xmm3, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "add $64, %1\n\t"
+                             "dec %2\n\t"
+                             "jnz 1b"
+                             : "+r"(dst), "+r"(src), "+r"(blocks) : : "memory");
+        }
+        xmm_restore(save);
+    }
+
+    copy_movsd(dst, src, n & 63);
+}
+
+static void set_sse2(uint8_t *dst, uint8_t c, size_t n, bool nt)
+{
+    size_t head = -(uint32_t)dst & 15;
+    if (head > n)
+        head = n;
+    set_stosd(dst, c, head);
+    dst += head;
+    n -= head;
+
+    uint32_t blocks = n / 64;
+    if (blocks)
+    {
+        uint8_t save[64];
+        uint32_t pattern[4];
+        for (int i = 0; i < 4; i++)
+            pattern[i] = c * 0x01010101u;
+
+        xmm_save(save);
+        __asm__ volatile("movdqu (%0), %%xmm0" : : "r"(pattern) : "memory");
+        if (nt)
+        {
+            __asm__ volatile("1:\n\t"
+                             "movntdq %%xmm0, 0(%0)\n\t"
+                             "movntdq %%xmm0, 16(%0)\n\t"
+                             "movntdq %%xmm0, 32(%0)\n\t"
+                             "movntdq %%xmm0, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "dec %1\n\t"
+                             "jnz 1b\n\t"
+                             "sfence"
+                             : "+r"(dst), "+r"(blocks) : : "memory");
+        }
+        else
+        {
+            __asm__ volatile("1:\n\t"
+                             "movdqa %%xmm0, 0(%0)\n\t"
+                             "movdqa %%xmm0, 16(%0)\n\t"
+                             "movdqa %%xmm0, 32(%0)\n\t"
+                             "movdqa %%xmm0, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "dec %1\n\t"
+                             "jnz 1b"
+                             : "+r"(dst), "+r"(blocks) : : "memory");
+        }
+        xmm_restore(save);
+    }
+
+    set_stosd(dst, c, n & 63);
+}
+
+void *memcpy_impl(memops_impl_t impl, void *dst, const void *src, size_t n)
+{
+    switch (impl)
+    {
+    case MEMOPS_BYTES:
+        for (size_t i = 0; i < n; i++)
+            ((uint8_t *)dst)[i] = ((const uint8_t *)src)[i];
+        break;
+    case MEMOPS_MOVSB:
+        copy_movsb(dst, src, n);
+        break;
+    case MEMOPS_SSE2:
+    case MEMOPS_SSE2_NT:
+        copy_sse2(dst, src, n, impl == MEMOPS_SSE2_NT);
+        break;
+    default:
+        copy_movsd(dst, src, n);
+        break;
+    }
+    return dst;
+}
+
+void *memset_impl(memops_impl_t impl, void *dst, int c, size_t n)
+{
+    switch (impl)
+    {
+    case MEMOPS_BYTES:
+        for (size_t i = 0; i < n; i++)
+            ((uint8_t *)dst)[i] = c;
+        break;
+    case MEMOPS_MOVSB:
+        set_stosb(dst, c, n);
+        break;
+    case MEMOPS_SSE2:
+    case MEMOPS_SSE2_NT:
+        set_sse2(dst, c, n, impl == MEMOPS_SSE2_NT);
+        break;
+    default:
+        set_stosd(dst, c, n);
+        break;
+    }
+    return dst;
+}
+
+static inline memops_impl_t memops_pick(size_t n)
+{
+    if (n < MEMOPS_SMALL)
+        return MEMOPS_MOVSD;
+    return n < MEMOPS_NT_THRESHOLD ? memops.medium : memops.large;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+    return memcpy_impl(memops_pick(n), dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+    return memset_impl(memops_pick(n), dst, c, n);
+}
+
+void *memmove(void *dest, const void *src, size_t n)
+{
+    uint8_t *pdest = (uint8_t *)dest;
+    const uint8_t *psrc = (const uint8_t *)src;
+
+    // Every forward copy loads a chunk before storing it, so a destination below the source is fine
+    if (pdest <= psrc || pdest >= psrc + n)
+        return memcpy(dest, src, n);
+
+    // Overlapping with the destination above: copy from the end, the odd bytes first.
+    // The interrupt stubs clear DF, so an interrupt in between does not see it set.
+    uint32_t ecx, edi, esi;
+    __asm__ volatile("std\n\t"
+                     "rep movsb\n\t"
+                     "sub $3, %%esi\n\t"
+                     "sub $3, %%edi\n\t"
+                     "movl %4, %%ecx\n\t"
+                     "rep movsl\n\t"
+                     "cld"
+                     : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+                     : "0"(n & 3), "q"(n / 4), "1"(pdest + n - 1), "2"(psrc + n - 1)
+                     : "memory");
+    return dest;
+}
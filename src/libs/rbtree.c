@@ -0,0 +1,298 @@
+#include "rbtree.h"
+
+static inline bool rb_is_red(const rb_node_t *node)
+{
+    return node && node->red;
+}
+
+// Put `to` where `from` hangs in the tree (to may be NULL)
+static void rb_replace_child(rb_tree_t *tree, rb_node_t *from, rb_node_t *to)
+{
+    rb_node_t *parent = from->parent;
+    if (!parent)
+        tree->root = to;
+    else if (parent->left == from)
+        parent->left = to;
+    else
+        parent->right = to;
+
+    if (to)
+        to->parent = parent;
+}
+
+static void rb_rotate_left(rb_tree_t *tree, rb_node_t *x)
+{
+    rb_node_t *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    rb_replace_child(tree, x, y);
+    y->left = x;
+    x->parent = y;
+
+    if (tree->augment)
+    {
+        tree->augment(x);
+        tree->augment(y);
+    }
+}
+
+static void rb_rotate_right(rb_tree_t *tree, rb_node_t *x)
+{
+    rb_node_t *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    rb_replace_child(tree, x, y);
+    y->right = x;
+    x->parent = y;
+
+    if (tree->augment)
+    {
+        tree->augment(x);
+        tree->augment(y);
+    }
+}
+
+void rb_propagate(rb_tree_t *tree, rb_node_t *node)
+{
+    if (!tree->augment)
+        return;
+    for (; node; node = node->parent)
+        tree->augment(node);
+}
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    rb_node_t *n = node;
+    rb_node_t *p;
+    while ((p = n->parent) && p->red)
+    {
+        rb_node_t *g = p->parent; // exists, a red node is never the root
+
+        if (p == g->left)
+        {
+            rb_node_t *uncle = g->right;
+            if (rb_is_red(uncle))
+            {
+                p->red = false;
+                uncle->red = false;
+                g->red = true;
+                n = g;
+                continue;
+            }
+            if (n == p->right)
+            {
+                rb_rotate_left(tree, p);
+                n = p;
+                p = n->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_right(tree, g);
+        }
+        else
+        {
+            rb_node_t *uncle = g->left;
+            if (rb_is_red(uncle))
+            {
+                p->red = false;
+                uncle->red = false;
+                g->red = true;
+                n = g;
+                continue;
+            }
+            if (n == p->left)
+            {
+                rb_rotate_right(tree, p);
+                n = p;
+                p = n->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_left(tree, g);
+        }
+    }
+    tree->root->red = false;
+
+    // Rotations fixed up the nodes they moved, the new node's ancestors still need it
+    rb_propagate(tree, node);
+}
+
+static void rb_erase_fixup(rb_tree_t *tree, rb_node_t *x, rb_node_t *parent)
+{
+    while (x != tree->root && !rb_is_red(x))
+    {
+        if (x == parent->left)
+        {
+            rb_node_t *w = parent->right;
+            if (w->red)
+            {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (!rb_is_red(w->left) && !rb_is_red(w->right))
+            {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!rb_is_red(w->right))
+            {
+                w->left->red = false;
+                w->red = true;
+                rb_rotate_right(tree, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->right->red = false;
+            rb_rotate_left(tree, parent);
+            x = tree->root;
+        }
+        else
+        {
+            rb_node_t *w = parent->left;
+            if (w->red)
+            {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (!rb_is_red(w->left) && !rb_is_red(w->right))
+            {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!rb_is_red(w->left))
+            {
+                w->right->red = false;
+                w->red = true;
+                rb_rotate_left(tree, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->left->red = false;
+            rb_rotate_right(tree, parent);
+            x = tree->root;
+        }
+    }
+
+    if (x)
+        x->red = false;
+}
+
+void rb_erase(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *x;
+    rb_node_t *parent; // parent of x, x itself may be NULL
+    bool removed_red = node->red;
+
+    if (!node->left)
+    {
+        x = node->right;
+        parent = node->parent;
+        rb_replace_child(tree, node, x);
+    }
+    else if (!node->right)
+    {
+        x = node->left;
+        parent = node->parent;
+        rb_replace_child(tree, node, x);
+    }
+    else
+    {
+        // Two children: the in-order successor takes the node's place
+        rb_node_t *next = node->right;
+        while (next->left)
+            next = next->left;
+
+        removed_red = next->red;
+        x = next->right;
+        if (next->parent == node)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = next->parent;
+            rb_replace_child(tree, next, x);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+
+        rb_replace_child(tree, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->red = node->red;
+    }
+
+    // Deepest node whose subtree lost something
+    rb_node_t *changed = parent;
+
+    if (!removed_red)
+        rb_erase_fixup(tree, x, parent);
+
+    rb_propagate(tree, changed);
+}
+
+rb_node_t *rb_first(const rb_tree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    while (node && node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node_t *rb_last(const rb_tree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    while (node && node->right)
+        node = node->right;
+    return node;
+}
+
+rb_node_t *rb_next(const rb_node_t *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (rb_node_t *)node;
+    }
+
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+rb_node_t *rb_prev(const rb_node_t *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return (rb_node_t *)node;
+    }
+
+    while (node->parent && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
+}
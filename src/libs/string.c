@@ -1,27 +1,102 @@
 #include "string.h"
+#include "memops.h"
 #include "serial.h"
 
-void *memset(void *dst, int c, size_t n)
+// Word-at-a-time helpers. Aligned word loads never cross into the next page,
+// so reading a little past the terminator of a string is safe.
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define ONES  0x01010101u
+#define HIGHS 0x80808080u
+// Non-zero when some byte of v is zero
+#define HAS_ZERO(v) (((v) - ONES) & ~(v) & HIGHS)
+
+#define STRLEN_SSE2_AFTER 64 // strings longer than this switch to 16-byte compares
+
+// Index of the first zero byte at or after p, p 16-byte aligned
+static size_t strlen_sse2(const char *p)
 {
-    uint8_t *temp = dst;
-    for (; n != 0; n--)
-        *temp++ = c;
-    return dst;
+    const char *start = p;
+    uint32_t mask;
+    uint8_t save[32];
+    __asm__ volatile("movdqu %%xmm0, 0(%2)\n\t"
+                     "movdqu %%xmm1, 16(%2)\n\t"
+                     "pxor %%xmm0, %%xmm0\n"
+                     "1:\n\t"
+                     "movdqa (%0), %%xmm1\n\t"
+                     "pcmpeqb %%xmm0, %%xmm1\n\t"
+                     "pmovmskb %%xmm1, %1\n\t"
+                     "test %1, %1\n\t"
+                     "jnz 2f\n\t"
+                     "add $16, %0\n\t"
+                     "jmp 1b\n"
+                     "2:\n\t"
+                     "bsf %1, %1\n\t"
+                     "add %1, %0\n\t"
+                     "movdqu 0(%2), %%xmm0\n\t"
+                     "movdqu 16(%2), %%xmm1"
+                     : "+r"(p), "=&r"(mask)
+                     : "r"(save)
+                     : "memory", "cc");
+    return p - start;
 }
 
-void *memcpy(void *dst, const void *src, size_t n)
+// Offset of the first 16-byte block where s1 and s2 differ, or n rounded down to 16
+static size_t memcmp_sse2(const uint8_t *s1, const uint8_t *s2, size_t n)
 {
-    uint8_t *ret = dst;
-    uint8_t *p = dst;
-    const uint8_t *q = src;
-    while (n--)
-        *p++ = *q++;
-    return ret;
+    size_t offset = 0;
+    uint32_t blocks = n / 16;
+    uint8_t save[32];
+    if (!blocks)
+        return 0;
+
+    __asm__ volatile("movdqu %%xmm0, 0(%4)\n\t"
+                     "movdqu %%xmm1, 16(%4)\n"
+                     "1:\n\t"
+                     "movdqu (%2,%0), %%xmm0\n\t"
+                     "movdqu (%3,%0), %%xmm1\n\t"
+                     "pcmpeqb %%xmm1, %%xmm0\n\t"
+                     "pmovmskb %%xmm0, %%eax\n\t"
+                     "cmp $0xFFFF, %%eax\n\t"
+                     "jne 2f\n\t"
+                     "add $16, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b\n"
+                     "2:\n\t"
+                     "movdqu 0(%4), %%xmm0\n\t"
+                     "movdqu 16(%4), %%xmm1"
+                     : "+r"(offset), "+r"(blocks)
+                     : "r"(s1), "r"(s2), "r"(save)
+                     : "eax", "memory", "cc");
+    return offset;
 }
 
 int memcmp(const void *s1, const void *s2, size_t n)
 {
     const uint8_t *p1 = s1, *p2 = s2;
+
+    if (n >= 64 && memops.sse2)
+    {
+        size_t same = memcmp_sse2(p1, p2, n);
+        p1 += same;
+        p2 += same;
+        n -= same;
+    }
+
+    // x86 loads words from any address
+    while (n >= 4)
+    {
+        uint32_t diff = *(const word_t *)p1 ^ *(const word_t *)p2;
+        if (diff)
+        {
+            int i = __builtin_ctz(diff) / 8; // lowest address is the lowest byte
+            return p1[i] - p2[i];
+        }
+        p1 += 4;
+        p2 += 4;
+        n -= 4;
+    }
+
     while (n--)
     {
         if (*p1 != *p2)
@@ -34,10 +109,27 @@ int memcmp(const void *s1, const void *s2, size_t n)
 
 size_t strlen(const char *s)
 {
-    size_t len = 0;
-    while (*s++)
-        len++;
-    return len;
+    const char *p = s;
+    while ((uint32_t)p & 3)
+    {
+        if (!*p)
+            return p - s;
+        p++;
+    }
+
+    const word_t *w = (const word_t *)p;
+    while (!HAS_ZERO(*w))
+    {
+        w++;
+        // Long string: finish it 16 bytes at a time
+        if (memops.sse2 && !((uint32_t)w & 15) && (const char *)w - s >= STRLEN_SSE2_AFTER)
+            return (const char *)w - s + strlen_sse2((const char *)w);
+    }
+
+    p = (const char *)w;
+    while (*p)
+        p++;
+    return p - s;
 }
 
 char *strncpy(char *dest, const char *src, size_t n)
@@ -62,14 +154,35 @@ char *strncpy(char *dest, const char *src, size_t n)
 
 int strcmp(const char *s1, const char *s2)
 {
-    int i = 0;
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+
+    // Words only when both strings can be aligned together
+    if (!(((uint32_t)p1 ^ (uint32_t)p2) & 3))
+    {
+        while ((uint32_t)p1 & 3)
+        {
+            if (*p1 != *p2 || !*p1)
+                return *p1 - *p2;
+            p1++;
+            p2++;
+        }
 
-    while ((s1[i] == s2[i]))
+        const word_t *w1 = (const word_t *)p1, *w2 = (const word_t *)p2;
+        while (*w1 == *w2 && !HAS_ZERO(*w1))
+        {
+            w1++;
+            w2++;
+        }
+        p1 = (const uint8_t *)w1;
+        p2 = (const uint8_t *)w2;
+    }
+
+    while (*p1 == *p2 && *p1)
     {
-        if (s2[i++] == 0)
-            return 0;
+        p1++;
+        p2++;
     }
-    return 1;
+    return *p1 - *p2;
 }
 
 int strncmp(const char *s1, const char *s2, size_t c)
@@ -165,73 +278,174 @@ void itoa(char *buf, int base, int d)
         p2--;
     }
 }
-char *strstr(const char *in, const char *str)
+// End of the haystack if it is within `max` bytes of h, otherwise h + max
+static const uint8_t *strstr_extend(const uint8_t *h, size_t max)
 {
-    char c;
-    size_t len;
-
-    c = *str++;
-    if (!c)
-        return (char *)in;
-
-    len = strlen(str);
-    do
-    {
-        char sc;
-        do
-        {
-            sc = *in++;
-            if (!sc)
-                return (char *)0;
-        } while (sc != c);
-    } while (strncmp(in, str, len) != 0);
-
-    return (char *)(in - 1);
+    for (size_t i = 0; i < max; i++)
+        if (!h[i])
+            return h + i;
+    return h + max;
 }
 
-char *strchr(const char *s, int c)
+/*
+ * Two-Way string matching (Crochemore and Perrin): the needle is split at a
+ * critical factorisation, the right part is matched left to right and the
+ * left part right to left, and after a mismatch the needle moves by an amount
+ * that never skips a match and never re-reads more than the period. Linear
+ * time and constant space.
+ */
+static char *strstr_twoway(const uint8_t *h, const uint8_t *n, size_t l)
 {
-    const char ch = (char)c;
+    size_t ip, jp, k, p, ms, p0, mem, mem0;
 
-    // Search through the string
-    while (*s != '\0')
+    // Maximal suffix for the < ordering
+    ip = -1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l)
     {
-        if (*s == ch)
+        if (n[ip + k] == n[jp + k])
         {
-            return (char *)s; // Found match
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+                k++;
+        }
+        else if (n[ip + k] > n[jp + k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
         }
-        s++;
     }
-
-    // Check if we're looking for null terminator
-    if (ch == '\0')
+    ms = ip;
+    p0 = p;
+
+    // And for the > ordering; the longer of the two gives the factorisation
+    ip = -1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l)
     {
-        return (char *)s;
+        if (n[ip + k] == n[jp + k])
+        {
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+                k++;
+        }
+        else if (n[ip + k] < n[jp + k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
+        }
     }
+    if (ip + 1 > ms + 1)
+        ms = ip;
+    else
+        p = p0;
 
-    return NULL; // Character not found
-}
+    // A periodic needle remembers how much of its left part already matched
+    if (memcmp(n, n + p, ms + 1))
+    {
+        mem0 = 0;
+        p = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    }
+    else
+        mem0 = l - p;
+    mem = 0;
 
-void *memmove(void *dest, const void *src, size_t n)
-{
-    uint8_t *pdest = (uint8_t *)dest;
-    const uint8_t *psrc = (const uint8_t *)src;
+    // Known end of the haystack, found lazily so a match near the start never reads it all
+    const uint8_t *z = h;
 
-    if (pdest < psrc)
+    for (;;)
     {
-        for (size_t i = 0; i < n; i++)
+        if ((size_t)(z - h) < l)
         {
-            pdest[i] = psrc[i];
+            size_t grow = l | 63;
+            const uint8_t *end = strstr_extend(z, grow);
+            if (end < z + grow)
+            {
+                z = end;
+                if ((size_t)(z - h) < l)
+                    return NULL;
+            }
+            else
+                z += grow;
         }
-    }
-    else
-    {
-        for (size_t i = n; i > 0; i--)
+
+        // Right part, left to right
+        for (k = (ms + 1 > mem ? ms + 1 : mem); n[k] && n[k] == h[k]; k++)
+            ;
+        if (n[k])
         {
-            pdest[i - 1] = psrc[i - 1];
+            h += k - ms;
+            mem = 0;
+            continue;
         }
+
+        // Left part, right to left
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--)
+            ;
+        if (k <= mem)
+            return (char *)h;
+        h += p;
+        mem = mem0;
     }
-    return dest;
+}
+
+char *strstr(const char *in, const char *str)
+{
+    if (!str[0])
+        return (char *)in;
+    if (!str[1])
+        return strchr(in, str[0]);
+
+    return strstr_twoway((const uint8_t *)in, (const uint8_t *)str, strlen(str));
+}
+
+char *strchr(const char *s, int c)
+{
+    const char ch = (char)c;
+
+    while ((uint32_t)s & 3)
+    {
+        if (*s == ch)
+            return (char *)s;
+        if (!*s)
+            return NULL;
+        s++;
+    }
+
+    // Stop at the word holding either the character or the terminator
+    uint32_t pattern = (uint8_t)ch * ONES;
+    const word_t *w = (const word_t *)s;
+    while (!HAS_ZERO(*w) && !HAS_ZERO(*w ^ pattern))
+        w++;
+
+    s = (const char *)w;
+    while (*s && *s != ch)
+        s++;
+
+    // Also finds the terminator when ch is '\0'
+    return *s == ch ? (char *)s : NULL;
 }
 
 int atoi(const char *str)
@@ -0,0 +1,162 @@
+#include "arena.h"
+#include "liballoc.h"
+#include "paging.h"
+#include "io.h"
+#include "string.h"
+#include "serial.h"
+
+static arena_t arenas[ARENA_MAX];
+
+static inline uint32_t arena_chunk_pages(const arena_t *arena)
+{
+    return arena->chunk_size / PAGE_SIZE;
+}
+
+arena_t *arena_create(const char *name, uint32_t chunk_size)
+{
+    if (chunk_size == 0)
+        chunk_size = ARENA_CHUNK_SIZE;
+    chunk_size = (chunk_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    uint32_t flags = irq_save();
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        arena_t *arena = &arenas[i];
+        if (arena->active)
+            continue;
+
+        memset(arena, 0, sizeof(arena_t));
+        arena->name = name;
+        arena->chunk_size = chunk_size;
+        arena->active = true;
+        irq_restore(flags);
+        return arena;
+    }
+    irq_restore(flags);
+
+    serial_printf("ARENA: Out of arenas for %s\n", name);
+    return NULL;
+}
+
+// A chunk with room for `size` bytes: the spare, a standard chunk, or one sized for the request
+static arena_chunk_t *arena_get_chunk(arena_t *arena, uint32_t size)
+{
+    uint32_t standard = arena->chunk_size - sizeof(arena_chunk_t);
+    if (size <= standard && arena->spare)
+    {
+        arena_chunk_t *chunk = arena->spare;
+        arena->spare = NULL;
+        return chunk;
+    }
+
+    uint32_t pages = size <= standard ? arena_chunk_pages(arena)
+                                      : (size + sizeof(arena_chunk_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    arena_chunk_t *chunk = liballoc_alloc(pages);
+    if (!chunk)
+        return NULL;
+
+    chunk->size = pages * PAGE_SIZE - sizeof(arena_chunk_t);
+    chunk->used = 0;
+    chunk->pages = pages;
+    arena->chunk_allocs++;
+    return chunk;
+}
+
+static void arena_put_chunk(arena_t *arena, arena_chunk_t *chunk)
+{
+    if (!arena->spare && chunk->pages == arena_chunk_pages(arena))
+    {
+        chunk->used = 0;
+        arena->spare = chunk;
+        return;
+    }
+    liballoc_free(chunk, chunk->pages);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    if (!arena || !arena->active)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    uint32_t flags = irq_save();
+    arena_chunk_t *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        chunk = arena_get_chunk(arena, size);
+        if (!chunk)
+        {
+            irq_restore(flags);
+            serial_printf("ARENA: %s cannot grow by %d bytes\n", arena->name, size);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = (uint8_t *)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    arena->bytes += size;
+    if (arena->bytes > arena->peak)
+        arena->peak = arena->bytes;
+    arena->allocs++;
+    irq_restore(flags);
+    return ptr;
+}
+
+arena_mark_t arena_mark(arena_t *arena)
+{
+    if (!arena)
+        return (arena_mark_t){NULL, 0, 0};
+
+    uint32_t flags = irq_save();
+    arena_mark_t mark = {arena->chunks, arena->chunks ? arena->chunks->used : 0, arena->bytes};
+    irq_restore(flags);
+    return mark;
+}
+
+void arena_reset(arena_t *arena, arena_mark_t mark)
+{
+    if (!arena || !arena->active)
+        return;
+
+    uint32_t flags = irq_save();
+    while (arena->chunks && arena->chunks != mark.chunk)
+    {
+        arena_chunk_t *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        arena_put_chunk(arena, chunk);
+    }
+    if (arena->chunks)
+        arena->chunks->used = mark.used;
+    arena->bytes = mark.bytes;
+    arena->resets++;
+    irq_restore(flags);
+}
+
+void arena_release(arena_t *arena)
+{
+    arena_mark_t empty = {NULL, 0, 0};
+    arena_reset(arena, empty);
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (!arena || !arena->active)
+        return;
+
+    arena_release(arena);
+    uint32_t flags = irq_save();
+    if (arena->spare)
+        liballoc_free(arena->spare, arena->spare->pages);
+    arena->spare = NULL;
+    arena->active = false;
+    irq_restore(flags);
+}
+
+const arena_t *arena_get(int index)
+{
+    if (index < 0 || index >= ARENA_MAX || !arenas[index].active)
+        return NULL;
+    return &arenas[index];
+}
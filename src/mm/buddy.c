@@ -0,0 +1,266 @@
+#include "buddy.h"
+#include "string.h"
+#include "serial.h"
+
+#define BUDDY_BITS_PER_WORD 32
+
+static inline uint32_t buddy_words(uint32_t bits)
+{
+    return (bits + BUDDY_BITS_PER_WORD - 1) / BUDDY_BITS_PER_WORD;
+}
+
+static inline bool buddy_test(buddy_area_t *area, uint32_t order, uint32_t block)
+{
+    uint32_t bit = block >> order;
+    return area->free_map[order][bit / BUDDY_BITS_PER_WORD] & (1u << (bit % BUDDY_BITS_PER_WORD));
+}
+
+static inline void buddy_set(buddy_area_t *area, uint32_t order, uint32_t block)
+{
+    uint32_t bit = block >> order;
+    uint32_t word = bit / BUDDY_BITS_PER_WORD;
+    uint32_t *map = area->free_map[order];
+
+    if (!map[word])
+        area->summary[order][word / BUDDY_BITS_PER_WORD] |= (1u << (word % BUDDY_BITS_PER_WORD));
+    map[word] |= (1u << (bit % BUDDY_BITS_PER_WORD));
+
+    area->free_count[order]++;
+    area->free_blocks += (1u << order);
+    if (word < area->hint[order])
+        area->hint[order] = word;
+}
+
+static inline void buddy_clear(buddy_area_t *area, uint32_t order, uint32_t block)
+{
+    uint32_t bit = block >> order;
+    uint32_t word = bit / BUDDY_BITS_PER_WORD;
+    uint32_t *map = area->free_map[order];
+
+    map[word] &= ~(1u << (bit % BUDDY_BITS_PER_WORD));
+    if (!map[word])
+        area->summary[order][word / BUDDY_BITS_PER_WORD] &= ~(1u << (word % BUDDY_BITS_PER_WORD));
+
+    area->free_count[order]--;
+    area->free_blocks -= (1u << order);
+}
+
+// First free head bit of `order` in [from, to), or BUDDY_NONE
+static uint32_t buddy_find(buddy_area_t *area, uint32_t order, uint32_t from, uint32_t to)
+{
+    uint32_t *map = area->free_map[order];
+    uint32_t *summary = area->summary[order];
+    uint32_t words = area->map_words[order];
+
+    if (from < area->hint[order] * BUDDY_BITS_PER_WORD)
+        from = area->hint[order] * BUDDY_BITS_PER_WORD;
+    if (from >= to)
+        return BUDDY_NONE;
+
+    uint32_t word = from / BUDDY_BITS_PER_WORD;
+    uint32_t bits = map[word] & (0xFFFFFFFF << (from % BUDDY_BITS_PER_WORD));
+
+    while (!bits)
+    {
+        if (++word >= words || word * BUDDY_BITS_PER_WORD >= to)
+            return BUDDY_NONE;
+
+        // Skip empty map words through the summary
+        uint32_t s = word / BUDDY_BITS_PER_WORD;
+        uint32_t summary_bits = summary[s] & (0xFFFFFFFF << (word % BUDDY_BITS_PER_WORD));
+        while (!summary_bits)
+        {
+            if (++s >= buddy_words(words) || s * BUDDY_BITS_PER_WORD * BUDDY_BITS_PER_WORD >= to)
+                return BUDDY_NONE;
+            summary_bits = summary[s];
+        }
+
+        word = s * BUDDY_BITS_PER_WORD + __builtin_ctz(summary_bits);
+        if (word >= words)
+            return BUDDY_NONE;
+        bits = map[word];
+    }
+
+    uint32_t bit = word * BUDDY_BITS_PER_WORD + __builtin_ctz(bits);
+    return bit < to ? bit : BUDDY_NONE;
+}
+
+uint32_t buddy_storage_words(uint32_t blocks)
+{
+    uint32_t total = 0;
+    for (uint32_t order = 0; order < BUDDY_MAX_ORDER; order++)
+    {
+        uint32_t words = buddy_words(blocks >> order);
+        total += words + buddy_words(words);
+    }
+    return total;
+}
+
+void buddy_init(buddy_area_t *area, uint32_t base, uint32_t blocks, uint32_t *storage)
+{
+    memset(area, 0, sizeof(buddy_area_t));
+    area->base = base;
+    area->blocks = blocks;
+
+    memset(storage, 0, buddy_storage_words(blocks) * sizeof(uint32_t));
+
+    for (uint32_t order = 0; order < BUDDY_MAX_ORDER; order++)
+    {
+        uint32_t words = buddy_words(blocks >> order);
+        area->map_words[order] = words;
+        area->free_map[order] = storage;
+        storage += words;
+        area->summary[order] = storage;
+        storage += buddy_words(words);
+    }
+}
+
+uint32_t buddy_order_for(uint32_t count)
+{
+    if (count <= 1)
+        return 0;
+    return 32 - __builtin_clz(count - 1);
+}
+
+// Take the head at `block`/`found` and split it down to `order`, keeping the low half
+static uint32_t buddy_take(buddy_area_t *area, uint32_t block, uint32_t found, uint32_t order)
+{
+    buddy_clear(area, found, block);
+    while (found > order)
+    {
+        found--;
+        buddy_set(area, found, block + (1u << found));
+    }
+    return block;
+}
+
+uint32_t buddy_alloc(buddy_area_t *area, uint32_t order)
+{
+    for (uint32_t k = order; k < BUDDY_MAX_ORDER; k++)
+    {
+        if (!area->free_count[k])
+            continue;
+
+        uint32_t bit = buddy_find(area, k, 0, area->blocks >> k);
+        if (bit == BUDDY_NONE)
+            continue;
+
+        area->hint[k] = bit / BUDDY_BITS_PER_WORD;
+        return buddy_take(area, bit << k, k, order);
+    }
+    return BUDDY_NONE;
+}
+
+uint32_t buddy_alloc_in_range(buddy_area_t *area, uint32_t order, uint32_t start, uint32_t end)
+{
+    if (end > area->blocks)
+        end = area->blocks;
+
+    for (uint32_t k = order; k < BUDDY_MAX_ORDER; k++)
+    {
+        if (!area->free_count[k])
+            continue;
+
+        uint32_t size = 1u << k;
+        uint32_t from = (start + size - 1) >> k;
+        uint32_t bit = buddy_find(area, k, from, end >> k);
+        if (bit == BUDDY_NONE)
+            continue;
+
+        return buddy_take(area, bit << k, k, order);
+    }
+    return BUDDY_NONE;
+}
+
+uint32_t buddy_alloc_blocks(buddy_area_t *area, uint32_t count)
+{
+    uint32_t order = buddy_order_for(count);
+    if (count == 0 || order >= BUDDY_MAX_ORDER)
+        return BUDDY_NONE;
+
+    uint32_t block = buddy_alloc(area, order);
+    if (block != BUDDY_NONE && (1u << order) > count)
+        buddy_free_range(area, block + count, (1u << order) - count);
+    return block;
+}
+
+void buddy_free(buddy_area_t *area, uint32_t block, uint32_t order)
+{
+    while (order + 1 < BUDDY_MAX_ORDER)
+    {
+        uint32_t buddy = block ^ (1u << order);
+        if (buddy + (1u << order) > area->blocks || !buddy_test(area, order, buddy))
+            break;
+
+        buddy_clear(area, order, buddy);
+        block &= ~(1u << order);
+        order++;
+    }
+    buddy_set(area, order, block);
+}
+
+void buddy_free_range(buddy_area_t *area, uint32_t block, uint32_t count)
+{
+    while (count)
+    {
+        // Largest naturally aligned block that starts here and fits
+        uint32_t order = block ? (uint32_t)__builtin_ctz(block) : BUDDY_MAX_ORDER - 1;
+        if (order >= BUDDY_MAX_ORDER)
+            order = BUDDY_MAX_ORDER - 1;
+        while ((1u << order) > count)
+            order--;
+
+        buddy_free(area, block, order);
+        block += (1u << order);
+        count -= (1u << order);
+    }
+}
+
+// Find the free head that contains `block`, returns its order or BUDDY_NONE
+static uint32_t buddy_find_containing(buddy_area_t *area, uint32_t block, uint32_t *head)
+{
+    for (uint32_t order = 0; order < BUDDY_MAX_ORDER; order++)
+    {
+        uint32_t h = block & ~((1u << order) - 1);
+        if (h + (1u << order) > area->blocks)
+            break;
+        if (buddy_test(area, order, h))
+        {
+            *head = h;
+            return order;
+        }
+    }
+    return BUDDY_NONE;
+}
+
+void buddy_reserve_range(buddy_area_t *area, uint32_t block, uint32_t count)
+{
+    uint32_t start = block;
+    uint32_t end = block + count;
+    if (end > area->blocks)
+        end = area->blocks;
+
+    while (block < end)
+    {
+        uint32_t head;
+        uint32_t order = buddy_find_containing(area, block, &head);
+        if (order == BUDDY_NONE)
+        {
+            block++;
+            continue;
+        }
+
+        uint32_t size = 1u << order;
+        if (head >= start && head + size <= end)
+        {
+            buddy_clear(area, order, head);
+            block = head + size;
+            continue;
+        }
+
+        // Head sticks out of the range, split it and look again
+        buddy_clear(area, order, head);
+        buddy_set(area, order - 1, head);
+        buddy_set(area, order - 1, head + (size >> 1));
+    }
+}
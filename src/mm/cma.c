@@ -0,0 +1,184 @@
+#include "cma.h"
+#include "pmm.h"
+#include "string.h"
+#include "serial.h"
+
+cma_stats_t cma_stats;
+
+// Bit set when a block is claimed or lent; lent blocks also have their bit in cma_lent_map
+static uint32_t cma_used_map[CMA_MAX_BLOCKS / 32];
+static uint32_t cma_lent_map[CMA_MAX_BLOCKS / 32];
+
+static inline bool cma_test(const uint32_t *map, uint32_t i)
+{
+    return map[i / 32] & (1u << (i % 32));
+}
+
+static inline void cma_set(uint32_t *map, uint32_t i)
+{
+    map[i / 32] |= 1u << (i % 32);
+}
+
+static inline void cma_clear(uint32_t *map, uint32_t i)
+{
+    map[i / 32] &= ~(1u << (i % 32));
+}
+
+static inline uint32_t cma_phys(uint32_t i)
+{
+    return (cma_stats.start_block + i) * PMM_BLOCK_SIZE;
+}
+
+void cma_init(uint32_t start_block, uint32_t blocks)
+{
+    if (blocks > CMA_MAX_BLOCKS)
+        blocks = CMA_MAX_BLOCKS;
+
+    memset(cma_used_map, 0, sizeof(cma_used_map));
+    memset(cma_lent_map, 0, sizeof(cma_lent_map));
+    memset(&cma_stats, 0, sizeof(cma_stats));
+    cma_stats.start_block = start_block;
+    cma_stats.blocks = blocks;
+
+    pmm_set_owner((void *)(start_block * PMM_BLOCK_SIZE), blocks, PAGE_OWNER_CMA);
+    serial_printf("CMA: %d blocks at 0x%x\n", blocks, start_block * PMM_BLOCK_SIZE);
+}
+
+bool cma_contains(uint32_t block)
+{
+    return block - cma_stats.start_block < cma_stats.blocks;
+}
+
+// Free, or lent and still idle in the zero pool
+static bool cma_block_available(uint32_t i)
+{
+    if (!cma_test(cma_used_map, i))
+        return true;
+    return cma_test(cma_lent_map, i) && pmm_pfn_to_page(cma_stats.start_block + i)->owner == PAGE_OWNER_ZERO_POOL;
+}
+
+// First index at or after `i` whose physical block is aligned to `align`
+static inline uint32_t cma_align_index(uint32_t i, uint32_t align)
+{
+    uint32_t block = cma_stats.start_block + i;
+    return ((block + align - 1) & ~(align - 1)) - cma_stats.start_block;
+}
+
+void *cma_alloc(uint32_t count, uint32_t align_blocks)
+{
+    if (count == 0 || count > cma_stats.blocks || align_blocks == 0 || (align_blocks & (align_blocks - 1)))
+    {
+        cma_stats.failures++;
+        return NULL;
+    }
+
+    uint32_t i = cma_align_index(0, align_blocks);
+    while (i + count <= cma_stats.blocks)
+    {
+        uint32_t j = 0;
+        while (j < count && cma_block_available(i + j))
+            j++;
+
+        // Take lent blocks back; an interrupt may have pulled one out of the pool meanwhile
+        for (uint32_t k = 0; j == count && k < count; k++)
+        {
+            if (!cma_test(cma_used_map, i + k))
+                continue;
+            if (!pmm_zero_pool_reclaim((void *)cma_phys(i + k)))
+            {
+                j = k;
+                break;
+            }
+            cma_put_blocks(cma_stats.start_block + i + k, 1);
+            cma_stats.reclaimed++;
+        }
+
+        if (j < count)
+        {
+            i = cma_align_index(i + j + 1, align_blocks);
+            continue;
+        }
+
+        for (uint32_t k = 0; k < count; k++)
+        {
+            cma_set(cma_used_map, i + k);
+            page_t *page = pmm_pfn_to_page(cma_stats.start_block + i + k);
+            page->owner = PAGE_OWNER_NONE;
+            page->flags |= PG_PINNED;
+        }
+        cma_stats.claimed += count;
+        cma_stats.claims++;
+        return (void *)cma_phys(i);
+    }
+
+    cma_stats.failures++;
+    return NULL;
+}
+
+void cma_release(void *phys, uint32_t count)
+{
+    uint32_t block = (uint32_t)phys / PMM_BLOCK_SIZE;
+    if (!cma_contains(block) || count > cma_stats.start_block + cma_stats.blocks - block)
+    {
+        serial_printf("CMA: Bad release of %d blocks at 0x%x\n", count, (uint32_t)phys);
+        return;
+    }
+    cma_put_blocks(block, count);
+}
+
+void *cma_lend_block()
+{
+    if (cma_stats.lent >= cma_stats.blocks / CMA_LEND_DIVISOR)
+        return NULL;
+
+    // Lend from the top so claims, which go bottom up, find long free runs
+    for (uint32_t word = (cma_stats.blocks + 31) / 32; word-- > 0;)
+    {
+        uint32_t free_bits = ~cma_used_map[word];
+        if (word == cma_stats.blocks / 32)
+            free_bits &= (1u << (cma_stats.blocks % 32)) - 1;
+        if (!free_bits)
+            continue;
+
+        uint32_t i = word * 32 + 31 - __builtin_clz(free_bits);
+        cma_set(cma_used_map, i);
+        cma_set(cma_lent_map, i);
+        cma_stats.lent++;
+
+        page_t *page = pmm_pfn_to_page(cma_stats.start_block + i);
+        page->owner = PAGE_OWNER_NONE;
+        page->flags = 0;
+        return (void *)cma_phys(i);
+    }
+    return NULL;
+}
+
+void cma_put_blocks(uint32_t block, uint32_t count)
+{
+    for (uint32_t b = block; b < block + count; b++)
+    {
+        uint32_t i = b - cma_stats.start_block;
+        if (!cma_contains(b) || !cma_test(cma_used_map, i))
+        {
+            serial_printf("CMA: Double free of block %d\n", b);
+            continue;
+        }
+
+        cma_clear(cma_used_map, i);
+        if (cma_test(cma_lent_map, i))
+        {
+            cma_clear(cma_lent_map, i);
+            cma_stats.lent--;
+        }
+        else
+        {
+            cma_stats.claimed--;
+        }
+
+        // The block stays used in the PMM bitmap, owned by the area
+        page_t *page = pmm_pfn_to_page(b);
+        page->refcount = 1;
+        page->flags = 0;
+        page->owner = PAGE_OWNER_CMA;
+    }
+}
@@ -0,0 +1,239 @@
+#include "dma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "cma.h"
+#include "paging.h"
+#include "io.h"
+#include "string.h"
+#include "serial.h"
+
+static dma_pool_t dma_pools[DMA_MAX_POOLS];
+static dma_chunk_t dma_chunk_slots[DMA_MAX_CHUNKS];
+static dma_chunk_t *dma_chunk_free = NULL;
+static bool dma_chunks_ready = false;
+
+static void dma_free_frames(void *frames, uint32_t pages)
+{
+    if (cma_contains((uint32_t)frames / PAGE_SIZE))
+        cma_release(frames, pages);
+    else
+        pmm_free_blocks(frames, pages);
+}
+
+void *dma_alloc_coherent(size_t size, uint32_t *phys)
+{
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 0)
+        return NULL;
+
+    // The CMA area keeps contiguous runs available, then below 16MB, then anything
+    void *frames = cma_alloc(pages, 1);
+    if (!frames)
+        frames = pmm_alloc_zone_blocks(PMM_ZONE_DMA, pages);
+    if (!frames)
+        frames = pmm_alloc_contiguous(pages);
+    if (!frames)
+    {
+        serial_printf("DMA: No %d contiguous pages\n", pages);
+        return NULL;
+    }
+
+    // Low RAM is already mapped write-back in the physmap; only frames above it need a mapping
+    uint32_t virt = phys_to_virt((uint32_t)frames);
+    if (!physmap_covers((uint32_t)frames, pages * PAGE_SIZE))
+    {
+        virt = vmm_reserve_virtual(pages);
+        if (!virt)
+        {
+            dma_free_frames(frames, pages);
+            return NULL;
+        }
+
+        if (!paging_map_range((uint32_t)frames, virt, pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE | PAGE_WB))
+        {
+            paging_unmap_range(virt, pages * PAGE_SIZE);
+            vmm_release_virtual(virt, pages);
+            dma_free_frames(frames, pages);
+            return NULL;
+        }
+    }
+
+    pmm_set_owner(frames, pages, PAGE_OWNER_DMA);
+    for (uint32_t i = 0; i < pages; i++)
+        pmm_phys_to_page((uint32_t)frames + i * PAGE_SIZE)->flags |= PG_PINNED;
+
+    memset((void *)virt, 0, pages * PAGE_SIZE);
+    if (phys)
+        *phys = (uint32_t)frames;
+    return (void *)virt;
+}
+
+void dma_free_coherent(void *virt, size_t size)
+{
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!virt || pages == 0 || ((uint32_t)virt & (PAGE_SIZE - 1)))
+    {
+        serial_printf("DMA: Bad free of 0x%x (%d bytes)\n", (uint32_t)virt, size);
+        return;
+    }
+
+    uint32_t phys = virt_to_phys(virt);
+    if (phys == UINT32_MAX)
+    {
+        serial_printf("DMA: 0x%x is not mapped\n", (uint32_t)virt);
+        return;
+    }
+
+    for (uint32_t i = 0; i < pages; i++)
+        pmm_phys_to_page(phys + i * PAGE_SIZE)->flags &= ~PG_PINNED;
+
+    if (!is_physmap_addr(virt))
+    {
+        paging_unmap_range((uint32_t)virt, pages * PAGE_SIZE);
+        vmm_release_virtual((uint32_t)virt, pages);
+    }
+    dma_free_frames((void *)phys, pages);
+}
+
+static dma_chunk_t *dma_get_chunk()
+{
+    if (!dma_chunks_ready)
+    {
+        for (int i = 0; i < DMA_MAX_CHUNKS; i++)
+        {
+            dma_chunk_slots[i].next = dma_chunk_free;
+            dma_chunk_free = &dma_chunk_slots[i];
+        }
+        dma_chunks_ready = true;
+    }
+
+    dma_chunk_t *chunk = dma_chunk_free;
+    if (chunk)
+        dma_chunk_free = chunk->next;
+    return chunk;
+}
+
+dma_pool_t *dma_pool_create(const char *name, size_t size, size_t align)
+{
+    if (size == 0 || align == 0 || (align & (align - 1)))
+        return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    for (int i = 0; i < DMA_MAX_POOLS; i++)
+    {
+        dma_pool_t *pool = &dma_pools[i];
+        if (pool->active)
+            continue;
+
+        memset(pool, 0, sizeof(dma_pool_t));
+        pool->name = name;
+        pool->align = align;
+        pool->size = (size + align - 1) & ~(align - 1);
+        pool->active = true;
+        return pool;
+    }
+
+    serial_printf("DMA: Out of pools for %s\n", name);
+    return NULL;
+}
+
+// Add a chunk and thread its blocks onto the free list
+static bool dma_pool_grow(dma_pool_t *pool)
+{
+    dma_chunk_t *chunk = dma_get_chunk();
+    if (!chunk)
+    {
+        serial_printf("DMA: Out of chunk descriptors for %s\n", pool->name);
+        return false;
+    }
+
+    chunk->size = (pool->size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    chunk->virt = dma_alloc_coherent(chunk->size, &chunk->phys);
+    if (!chunk->virt)
+    {
+        chunk->next = dma_chunk_free;
+        dma_chunk_free = chunk;
+        return false;
+    }
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    uint32_t per_page = pool->size <= PAGE_SIZE ? PAGE_SIZE / pool->size : 1;
+    for (uint32_t page = 0; page < chunk->size / PAGE_SIZE; page += (pool->size + PAGE_SIZE - 1) / PAGE_SIZE)
+    {
+        for (uint32_t i = 0; i < per_page; i++)
+        {
+            void **block = (void **)(chunk->virt + page * PAGE_SIZE + i * pool->size);
+            *block = pool->free_list;
+            pool->free_list = block;
+            pool->total++;
+        }
+    }
+    return true;
+}
+
+void *dma_pool_alloc(dma_pool_t *pool, uint32_t *phys)
+{
+    if (!pool || !pool->active)
+        return NULL;
+
+    // Drivers allocate and free blocks from their interrupt handlers too
+    uint32_t flags = irq_save();
+    if (!pool->free_list && !dma_pool_grow(pool))
+    {
+        irq_restore(flags);
+        return NULL;
+    }
+
+    void **block = pool->free_list;
+    pool->free_list = *block;
+    pool->in_use++;
+    irq_restore(flags);
+    memset(block, 0, pool->size);
+
+    if (phys)
+        *phys = virt_to_phys(block);
+    return block;
+}
+
+void dma_pool_free(dma_pool_t *pool, void *virt)
+{
+    if (!pool || !virt)
+        return;
+
+    uint32_t flags = irq_save();
+    void **block = virt;
+    *block = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+    irq_restore(flags);
+}
+
+void dma_pool_destroy(dma_pool_t *pool)
+{
+    if (!pool || !pool->active)
+        return;
+    if (pool->in_use)
+        serial_printf("DMA: Destroying %s with %d blocks in use\n", pool->name, pool->in_use);
+
+    uint32_t flags = irq_save();
+    dma_chunk_t *chunk = pool->chunks;
+    while (chunk)
+    {
+        dma_chunk_t *next = chunk->next;
+        dma_free_coherent(chunk->virt, chunk->size);
+        chunk->next = dma_chunk_free;
+        dma_chunk_free = chunk;
+        chunk = next;
+    }
+    pool->active = false;
+    irq_restore(flags);
+}
+
+const dma_pool_t *dma_get_pool(int index)
+{
+    if (index < 0 || index >= DMA_MAX_POOLS || !dma_pools[index].active)
+        return NULL;
+    return &dma_pools[index];
+}
@@ -0,0 +1,183 @@
+#include "heapprof.h"
+#include "io.h"
+#include "timer.h"
+#include "string.h"
+#include "serial.h"
+
+heapprof_stats_t heapprof_stats;
+
+// A live allocation; ptr 0 marks an empty slot
+typedef struct
+{
+    uint32_t ptr;
+    uint32_t size;
+    uint32_t site;
+} heapprof_live_t;
+
+static heapprof_live_t heapprof_live[HEAPPROF_LIVE_SLOTS];
+static heapprof_site_t heapprof_sites[HEAPPROF_SITE_SLOTS];
+static heap_tag_t heapprof_tag = HEAP_TAG_KERNEL;
+
+static const char *heapprof_tag_names[HEAP_TAG_COUNT] = {
+    [HEAP_TAG_KERNEL] = "kernel",
+    [HEAP_TAG_SHELL] = "shell",
+    [HEAP_TAG_NET] = "net",
+};
+
+// Fibonacci hashing; heap pointers are at least 16-byte aligned, so drop the low bits
+static inline uint32_t heapprof_hash(uint32_t key, uint32_t slots)
+{
+    return ((key >> 4) * 2654435761u) >> (32 - __builtin_ctz(slots));
+}
+
+heap_tag_t heapprof_set_tag(heap_tag_t tag)
+{
+    heap_tag_t prev = heapprof_tag;
+    heapprof_tag = tag;
+    return prev;
+}
+
+const char *heapprof_tag_name(heap_tag_t tag)
+{
+    return tag < HEAP_TAG_COUNT ? heapprof_tag_names[tag] : "?";
+}
+
+static heapprof_site_t *heapprof_find_site(uint32_t caller, heap_tag_t tag)
+{
+    uint32_t mask = HEAPPROF_SITE_SLOTS - 1;
+    uint32_t i = heapprof_hash(caller ^ (tag << 4), HEAPPROF_SITE_SLOTS);
+
+    for (uint32_t probes = 0; probes < HEAPPROF_SITE_SLOTS; probes++, i = (i + 1) & mask)
+    {
+        heapprof_site_t *site = &heapprof_sites[i];
+        if (site->caller == caller && site->tag == tag)
+            return site;
+        if (site->caller == 0)
+        {
+            site->caller = caller;
+            site->tag = tag;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+void heapprof_alloc(void *ptr, size_t size, void *caller)
+{
+    if (!ptr)
+        return;
+
+    uint32_t flags = irq_save();
+    heapprof_site_t *site = heapprof_find_site((uint32_t)caller, heapprof_tag);
+    if (!site || heapprof_stats.live_count >= HEAPPROF_LIVE_SLOTS - HEAPPROF_LIVE_SLOTS / 8)
+    {
+        heapprof_stats.untracked++;
+        irq_restore(flags);
+        return;
+    }
+
+    uint32_t mask = HEAPPROF_LIVE_SLOTS - 1;
+    uint32_t i = heapprof_hash((uint32_t)ptr, HEAPPROF_LIVE_SLOTS);
+    while (heapprof_live[i].ptr)
+        i = (i + 1) & mask;
+    heapprof_live[i].ptr = (uint32_t)ptr;
+    heapprof_live[i].size = size;
+    heapprof_live[i].site = site - heapprof_sites;
+
+    site->live_bytes += size;
+    site->live_count++;
+    site->allocs++;
+    site->alloc_bytes += size;
+
+    heapprof_stats.live_bytes += size;
+    heapprof_stats.live_count++;
+    heapprof_stats.allocs++;
+    if (heapprof_stats.live_bytes > heapprof_stats.peak_bytes)
+        heapprof_stats.peak_bytes = heapprof_stats.live_bytes;
+    irq_restore(flags);
+}
+
+void heapprof_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    uint32_t flags = irq_save();
+    uint32_t mask = HEAPPROF_LIVE_SLOTS - 1;
+    uint32_t i = heapprof_hash((uint32_t)ptr, HEAPPROF_LIVE_SLOTS);
+    while (heapprof_live[i].ptr && heapprof_live[i].ptr != (uint32_t)ptr)
+        i = (i + 1) & mask;
+
+    // Untracked allocation
+    if (!heapprof_live[i].ptr)
+    {
+        irq_restore(flags);
+        return;
+    }
+
+    heapprof_site_t *site = &heapprof_sites[heapprof_live[i].site];
+    site->live_bytes -= heapprof_live[i].size;
+    site->live_count--;
+    site->frees++;
+    heapprof_stats.live_bytes -= heapprof_live[i].size;
+    heapprof_stats.live_count--;
+    heapprof_stats.frees++;
+
+    // Backward-shift deletion keeps every probe chain intact without tombstones
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & mask; heapprof_live[j].ptr; j = (j + 1) & mask)
+    {
+        uint32_t home = heapprof_hash(heapprof_live[j].ptr, HEAPPROF_LIVE_SLOTS);
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            heapprof_live[hole] = heapprof_live[j];
+            hole = j;
+        }
+    }
+    heapprof_live[hole].ptr = 0;
+    irq_restore(flags);
+}
+
+const heapprof_site_t *heapprof_get_site(int index)
+{
+    if (index < 0 || index >= HEAPPROF_SITE_SLOTS || !heapprof_sites[index].caller)
+        return NULL;
+    return &heapprof_sites[index];
+}
+
+void heapprof_mark()
+{
+    uint32_t flags = irq_save();
+    for (int i = 0; i < HEAPPROF_SITE_SLOTS; i++)
+        heapprof_sites[i].allocs_at_mark = heapprof_sites[i].allocs;
+    heapprof_stats.mark_ticks = get_ticks();
+    irq_restore(flags);
+}
+
+void heapprof_dump_serial()
+{
+    uint32_t tag_bytes[HEAP_TAG_COUNT];
+    uint32_t tag_count[HEAP_TAG_COUNT];
+    memset(tag_bytes, 0, sizeof(tag_bytes));
+    memset(tag_count, 0, sizeof(tag_count));
+
+    // One line per record, space separated key=value pairs
+    serial_printf("heapprof begin ticks=%d live_bytes=%d live_count=%d peak_bytes=%d allocs=%d frees=%d untracked=%d\n",
+                  get_ticks(), heapprof_stats.live_bytes, heapprof_stats.live_count, heapprof_stats.peak_bytes,
+                  heapprof_stats.allocs, heapprof_stats.frees, heapprof_stats.untracked);
+    for (int i = 0; i < HEAPPROF_SITE_SLOTS; i++)
+    {
+        const heapprof_site_t *site = heapprof_get_site(i);
+        if (!site)
+            continue;
+        serial_printf("heapprof site caller=0x%x tag=%s live_bytes=%d live_count=%d allocs=%d alloc_bytes=%d frees=%d\n",
+                      site->caller, heapprof_tag_name(site->tag), site->live_bytes, site->live_count,
+                      site->allocs, site->alloc_bytes, site->frees);
+        tag_bytes[site->tag] += site->live_bytes;
+        tag_count[site->tag] += site->live_count;
+    }
+    for (int i = 0; i < HEAP_TAG_COUNT; i++)
+        serial_printf("heapprof tag name=%s live_bytes=%d live_count=%d\n", heapprof_tag_name(i), tag_bytes[i],
+                      tag_count[i]);
+    serial_printf("heapprof end\n");
+}
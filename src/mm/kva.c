@@ -0,0 +1,346 @@
+#include "kva.h"
+#include "paging.h"
+#include "serial.h"
+
+/*
+ * Kernel virtual address allocator. Free space is a set of extents kept in
+ * two red-black trees, so allocation, reservation and release are all
+ * O(log n) in the number of free extents instead of a scan over every page
+ * of the window. Extent descriptors come from a static pool since this runs
+ * underneath the heap.
+ */
+static kva_extent_t kva_pool[KVA_MAX_EXTENTS];
+static kva_extent_t *kva_free_list = NULL;
+static bool kva_pool_ready = false;
+
+static inline kva_extent_t *kva_addr_entry(rb_node_t *node)
+{
+    return node ? rb_entry(node, kva_extent_t, addr_node) : NULL;
+}
+
+static inline kva_extent_t *kva_size_entry(rb_node_t *node)
+{
+    return node ? rb_entry(node, kva_extent_t, size_node) : NULL;
+}
+
+static inline uint32_t kva_extent_end(const kva_extent_t *extent)
+{
+    return extent->start + extent->pages * PAGE_SIZE;
+}
+
+static kva_extent_t *kva_get_extent()
+{
+    if (!kva_pool_ready)
+    {
+        for (int i = 0; i < KVA_MAX_EXTENTS; i++)
+        {
+            kva_pool[i].next_free = kva_free_list;
+            kva_free_list = &kva_pool[i];
+        }
+        kva_pool_ready = true;
+    }
+
+    kva_extent_t *extent = kva_free_list;
+    if (extent)
+        kva_free_list = extent->next_free;
+    return extent;
+}
+
+static void kva_put_extent(kva_extent_t *extent)
+{
+    extent->next_free = kva_free_list;
+    kva_free_list = extent;
+}
+
+static void kva_augment(rb_node_t *node)
+{
+    kva_extent_t *extent = kva_addr_entry(node);
+    uint32_t max = extent->pages;
+
+    if (node->left && kva_addr_entry(node->left)->max_pages > max)
+        max = kva_addr_entry(node->left)->max_pages;
+    if (node->right && kva_addr_entry(node->right)->max_pages > max)
+        max = kva_addr_entry(node->right)->max_pages;
+    extent->max_pages = max;
+}
+
+static void kva_size_insert(kva_space_t *space, kva_extent_t *extent)
+{
+    rb_node_t **link = &space->by_size.root;
+    rb_node_t *parent = NULL;
+
+    while (*link)
+    {
+        kva_extent_t *cur = kva_size_entry(*link);
+        parent = *link;
+        if (extent->pages < cur->pages || (extent->pages == cur->pages && extent->start < cur->start))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_insert(&space->by_size, &extent->size_node, parent, link);
+}
+
+static bool kva_insert(kva_space_t *space, uint32_t start, uint32_t pages)
+{
+    kva_extent_t *extent = kva_get_extent();
+    if (!extent)
+    {
+        serial_printf("KVA: %s out of extent descriptors, losing 0x%x (%d pages)\n", space->name, start, pages);
+        return false;
+    }
+
+    extent->start = start;
+    extent->pages = pages;
+    extent->max_pages = pages;
+
+    rb_node_t **link = &space->by_addr.root;
+    rb_node_t *parent = NULL;
+    while (*link)
+    {
+        parent = *link;
+        link = (start < kva_addr_entry(parent)->start) ? &parent->left : &parent->right;
+    }
+    rb_insert(&space->by_addr, &extent->addr_node, parent, link);
+    kva_size_insert(space, extent);
+
+    space->extents++;
+    return true;
+}
+
+static void kva_remove(kva_space_t *space, kva_extent_t *extent)
+{
+    rb_erase(&space->by_addr, &extent->addr_node);
+    rb_erase(&space->by_size, &extent->size_node);
+    kva_put_extent(extent);
+    space->extents--;
+}
+
+// Change an extent in place; callers keep it between its address-order neighbours
+static void kva_resize(kva_space_t *space, kva_extent_t *extent, uint32_t start, uint32_t pages)
+{
+    rb_erase(&space->by_size, &extent->size_node);
+    extent->start = start;
+    extent->pages = pages;
+    rb_propagate(&space->by_addr, &extent->addr_node);
+    kva_size_insert(space, extent);
+}
+
+// Extent with the highest start <= addr
+static kva_extent_t *kva_find_le(const kva_space_t *space, uint32_t addr)
+{
+    rb_node_t *node = space->by_addr.root;
+    kva_extent_t *found = NULL;
+
+    while (node)
+    {
+        kva_extent_t *extent = kva_addr_entry(node);
+        if (extent->start <= addr)
+        {
+            found = extent;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+// Lowest extent starting at or after `from` with at least `pages` pages
+static kva_extent_t *kva_find_from(rb_node_t *node, uint32_t from, uint32_t pages)
+{
+    if (!node || kva_addr_entry(node)->max_pages < pages)
+        return NULL;
+
+    kva_extent_t *extent = kva_addr_entry(node);
+    if (extent->start < from)
+        return kva_find_from(node->right, from, pages);
+
+    kva_extent_t *found = kva_find_from(node->left, from, pages);
+    if (found)
+        return found;
+    if (extent->pages >= pages)
+        return extent;
+    return kva_find_from(node->right, from, pages);
+}
+
+static kva_extent_t *kva_best_fit(const kva_space_t *space, uint32_t pages)
+{
+    rb_node_t *node = space->by_size.root;
+    kva_extent_t *best = NULL;
+
+    while (node)
+    {
+        kva_extent_t *extent = kva_size_entry(node);
+        if (extent->pages >= pages)
+        {
+            best = extent;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+// Carve [addr, addr + pages) out of a free extent that contains it
+static bool kva_take(kva_space_t *space, kva_extent_t *extent, uint32_t addr, uint32_t pages)
+{
+    uint32_t end = kva_extent_end(extent);
+    uint32_t take_end = addr + pages * PAGE_SIZE;
+
+    if (addr == extent->start && take_end == end)
+    {
+        kva_remove(space, extent);
+    }
+    else if (addr == extent->start)
+    {
+        kva_resize(space, extent, take_end, extent->pages - pages);
+    }
+    else if (take_end == end)
+    {
+        kva_resize(space, extent, extent->start, extent->pages - pages);
+    }
+    else
+    {
+        if (!kva_insert(space, take_end, (end - take_end) / PAGE_SIZE))
+            return false;
+        kva_resize(space, extent, extent->start, (addr - extent->start) / PAGE_SIZE);
+    }
+
+    space->free_pages -= pages;
+    return true;
+}
+
+void kva_init(kva_space_t *space, const char *name, uint32_t start, uint32_t end)
+{
+    space->name = name;
+    space->start = start;
+    space->end = end;
+    space->by_addr.root = NULL;
+    space->by_addr.augment = kva_augment;
+    space->by_size.root = NULL;
+    space->by_size.augment = NULL;
+    space->free_pages = 0;
+    space->extents = 0;
+    space->cursor = start;
+
+    if (start < end && kva_insert(space, start, (end - start) / PAGE_SIZE))
+        space->free_pages = (end - start) / PAGE_SIZE;
+
+    serial_printf("KVA: %s window 0x%x-0x%x (%d pages)\n", name, start, end, space->free_pages);
+}
+
+uint32_t kva_alloc(kva_space_t *space, uint32_t pages, kva_policy_t policy)
+{
+    if (pages == 0 || pages > space->free_pages)
+        return 0;
+
+    kva_extent_t *extent;
+    if (policy == KVA_NEXT_FIT)
+    {
+        extent = kva_find_from(space->by_addr.root, space->cursor, pages);
+        if (!extent)
+            extent = kva_find_from(space->by_addr.root, space->start, pages);
+    }
+    else
+    {
+        extent = kva_best_fit(space, pages);
+    }
+
+    if (!extent)
+        return 0;
+
+    uint32_t addr = extent->start;
+    if (!kva_take(space, extent, addr, pages))
+        return 0;
+
+    space->cursor = addr + pages * PAGE_SIZE;
+    return addr;
+}
+
+uint32_t kva_alloc_aligned(kva_space_t *space, uint32_t pages, uint32_t align, uint32_t offset)
+{
+    if (align <= PAGE_SIZE)
+        return kva_alloc(space, pages, KVA_BEST_FIT);
+
+    // Any extent this big has a suitably aligned start somewhere inside it
+    uint32_t slack = align / PAGE_SIZE - 1;
+    if (pages == 0 || pages + slack > space->free_pages)
+        return 0;
+
+    kva_extent_t *extent = kva_best_fit(space, pages + slack);
+    if (!extent)
+        return 0;
+
+    uint32_t addr = extent->start + ((offset - extent->start) & (align - 1));
+    if (!kva_take(space, extent, addr, pages))
+        return 0;
+    return addr;
+}
+
+bool kva_reserve(kva_space_t *space, uint32_t addr, uint32_t pages)
+{
+    kva_extent_t *extent = kva_find_le(space, addr);
+    if (!extent || addr + pages * PAGE_SIZE > kva_extent_end(extent))
+        return false;
+    return kva_take(space, extent, addr, pages);
+}
+
+void kva_release(kva_space_t *space, uint32_t addr, uint32_t pages)
+{
+    uint32_t end = addr + pages * PAGE_SIZE;
+
+    if (pages == 0 || (addr & (PAGE_SIZE - 1)) || addr < space->start || end > space->end || end < addr)
+    {
+        serial_printf("KVA: %s bad release 0x%x (%d pages)\n", space->name, addr, pages);
+        return;
+    }
+
+    kva_extent_t *prev = kva_find_le(space, addr);
+    kva_extent_t *next = kva_addr_entry(prev ? rb_next(&prev->addr_node) : rb_first(&space->by_addr));
+
+    if ((prev && kva_extent_end(prev) > addr) || (next && next->start < end))
+    {
+        serial_printf("KVA: %s double release 0x%x (%d pages)\n", space->name, addr, pages);
+        return;
+    }
+
+    bool join_prev = prev && kva_extent_end(prev) == addr;
+    bool join_next = next && next->start == end;
+
+    if (join_prev && join_next)
+    {
+        uint32_t next_pages = next->pages;
+        kva_remove(space, next);
+        kva_resize(space, prev, prev->start, prev->pages + pages + next_pages);
+    }
+    else if (join_prev)
+    {
+        kva_resize(space, prev, prev->start, prev->pages + pages);
+    }
+    else if (join_next)
+    {
+        kva_resize(space, next, addr, next->pages + pages);
+    }
+    else if (!kva_insert(space, addr, pages))
+    {
+        return;
+    }
+
+    space->free_pages += pages;
+}
+
+bool kva_contains(const kva_space_t *space, uint32_t addr)
+{
+    return addr >= space->start && addr < space->end;
+}
+
+uint32_t kva_largest_free(const kva_space_t *space)
+{
+    return space->by_addr.root ? kva_addr_entry(space->by_addr.root)->max_pages : 0;
+}
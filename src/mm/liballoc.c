@@ -1,4 +1,6 @@
 #include <liballoc.h>
+#include "sizeclass.h"
+#include "heapprof.h"
 
 /**  Durand's Ridiculously Amazing Super Duper Memory functions.  */
 
@@ -6,6 +8,7 @@
 
 #define LIBALLOC_MAGIC 0xc001c0de
 #define MAXCOMPLETE 5
+#define TRIM_PAGES 16 //< Free tails of at least this many pages go back to the system
 #define MAXEXP 32
 #define MINEXP 8
 
@@ -62,40 +65,6 @@ static inline int getexp(unsigned int size)
 	return shift - 1;
 }
 
-static void *liballoc_memset(void *s, int c, size_t n)
-{
-	int i;
-	for (i = 0; i < n; i++)
-		((char *)s)[i] = c;
-
-	return s;
-}
-
-static void *liballoc_memcpy(void *s1, const void *s2, size_t n)
-{
-	char *cdest;
-	char *csrc;
-	unsigned int *ldest = (unsigned int *)s1;
-	unsigned int *lsrc = (unsigned int *)s2;
-
-	while (n >= sizeof(unsigned int))
-	{
-		*ldest++ = *lsrc++;
-		n -= sizeof(unsigned int);
-	}
-
-	cdest = (char *)ldest;
-	csrc = (char *)lsrc;
-
-	while (n > 0)
-	{
-		*cdest++ = *csrc++;
-		n -= 1;
-	}
-
-	return s1;
-}
-
 #ifdef DEBUG
 static void dump_array()
 {
@@ -224,6 +193,31 @@ static inline struct boundary_tag *split_tag(struct boundary_tag *tag)
 	return new_tag;
 }
 
+/** Give the page-aligned end of a free, rightmost tag back to the system.
+ *  The block keeps at least l_pageCount pages, which free() relies on when
+ *  it releases a whole block.
+ */
+static inline void trim_tail(struct boundary_tag *tag)
+{
+	struct boundary_tag *head = tag;
+	while (head->split_left != NULL)
+		head = head->split_left;
+
+	unsigned int end = (unsigned int)tag + tag->real_size;
+	unsigned int keep = (unsigned int)tag + sizeof(struct boundary_tag) + (1 << MINEXP);
+	unsigned int floor = (unsigned int)head + l_pageCount * l_pageSize;
+
+	if (keep < floor)
+		keep = floor;
+	keep = (keep + l_pageSize - 1) & ~(l_pageSize - 1);
+
+	if (keep >= end || (end - keep) / l_pageSize < TRIM_PAGES)
+		return;
+
+	if (liballoc_free((void *)keep, (end - keep) / l_pageSize) == 0)
+		tag->real_size = keep - (unsigned int)tag;
+}
+
 // ***************************************************************
 
 static struct boundary_tag *allocate_new_tag(unsigned int size)
@@ -270,7 +264,7 @@ static struct boundary_tag *allocate_new_tag(unsigned int size)
 	return tag;
 }
 
-void *malloc(size_t size)
+void *liballoc_malloc_tagged(size_t size)
 {
 	int index;
 	void *ptr;
@@ -374,7 +368,7 @@ void *malloc(size_t size)
 	return ptr;
 }
 
-void free(void *ptr)
+void liballoc_free_tagged(void *ptr)
 {
 	int index;
 	struct boundary_tag *tag;
@@ -416,6 +410,10 @@ void free(void *ptr)
 		tag = absorb_right(tag);
 	}
 
+	// Large free tail at the end of a block?
+	if (tag->split_right == NULL)
+		trim_tail(tag);
+
 	// Where is it going back to?
 	index = getexp(tag->real_size - sizeof(struct boundary_tag));
 	if (index < MINEXP)
@@ -462,6 +460,58 @@ void free(void *ptr)
 	liballoc_unlock();
 }
 
+static inline void *alloc_object(size_t size)
+{
+	// Small requests are served by the size classes, liballoc takes the rest
+	if (size <= SIZECLASS_MAX)
+	{
+		void *ptr = sizeclass_alloc(size);
+		if (ptr != NULL)
+			return ptr;
+	}
+
+	return liballoc_malloc_tagged(size);
+}
+
+static inline void free_object(void *ptr)
+{
+	if (sizeclass_owns(ptr))
+		sizeclass_free(ptr);
+	else
+		liballoc_free_tagged(ptr);
+}
+
+// Same paths as malloc()/free(), minus the heap profiler; for benchmarking the front end
+void *liballoc_malloc_classes(size_t size)
+{
+	return alloc_object(size);
+}
+
+void liballoc_free_classes(void *ptr)
+{
+	if (ptr != NULL)
+		free_object(ptr);
+}
+
+// The public functions record their caller with the heap profiler.
+
+void *malloc(size_t size)
+{
+	void *ptr = alloc_object(size);
+
+	heapprof_alloc(ptr, size, __builtin_return_address(0));
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	heapprof_free(ptr);
+	free_object(ptr);
+}
+
 void *calloc(size_t nobj, size_t size)
 {
 	int real_size;
@@ -469,10 +519,12 @@ void *calloc(size_t nobj, size_t size)
 
 	real_size = nobj * size;
 
-	p = malloc(real_size);
+	p = alloc_object(real_size);
 
-	liballoc_memset(p, 0, real_size);
+	if (p != NULL)
+		memset(p, 0, real_size);
 
+	heapprof_alloc(p, real_size, __builtin_return_address(0));
 	return p;
 }
 
@@ -488,21 +540,44 @@ void *realloc(void *p, size_t size)
 		return NULL;
 	}
 	if (p == NULL)
-		return malloc(size);
+	{
+		ptr = alloc_object(size);
+		heapprof_alloc(ptr, size, __builtin_return_address(0));
+		return ptr;
+	}
 
-	if (liballoc_lock != NULL)
-		liballoc_lock(); // lockit
-	tag = (struct boundary_tag *)((unsigned int)p - sizeof(struct boundary_tag));
-	real_size = tag->size;
-	if (liballoc_unlock != NULL)
-		liballoc_unlock();
+	if (sizeclass_owns(p))
+	{
+		real_size = sizeclass_size(p);
+
+		// Still fits its class and would not move to a smaller one
+		if (size <= (size_t)real_size && sizeclass_index(size) == sizeclass_index(real_size))
+		{
+			heapprof_free(p);
+			heapprof_alloc(p, size, __builtin_return_address(0));
+			return p;
+		}
+	}
+	else
+	{
+		if (liballoc_lock != NULL)
+			liballoc_lock(); // lockit
+		tag = (struct boundary_tag *)((unsigned int)p - sizeof(struct boundary_tag));
+		real_size = tag->size;
+		if (liballoc_unlock != NULL)
+			liballoc_unlock();
+	}
 
 	if (real_size > size)
 		real_size = size;
 
-	ptr = malloc(size);
-	liballoc_memcpy(ptr, p, real_size);
-	free(p);
+	ptr = alloc_object(size);
+	if (ptr == NULL)
+		return NULL;
+	memcpy(ptr, p, real_size);
+	heapprof_free(p);
+	free_object(p);
 
+	heapprof_alloc(ptr, size, __builtin_return_address(0));
 	return ptr;
 }
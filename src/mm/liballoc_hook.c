@@ -1,7 +1,13 @@
 #include "liballoc_hook.h"
 #include "vmm.h"
+#include "pmm.h"
+#include "kva.h"
+#include "paging.h"
 #include "serial.h"
 
+heap_stats_t heap_stats;
+static kva_space_t heap_space;
+
 int liballoc_lock()
 {
     __asm__("cli");
@@ -14,54 +20,118 @@ int liballoc_unlock()
     return 0;
 }
 
-void *liballoc_alloc(int num_blocks)
+// Unmap [virt, virt + pages) and free its frames, a physically contiguous run at a time
+static void heap_release(uint32_t virt, uint32_t pages)
 {
-    // serial_printf("liballoc: Request to allocate %d blocks\n", num_blocks);
+    paging_batch_begin();
+    uint32_t i = 0;
+    while (i < pages)
+    {
+        uint32_t run_virt = virt + i * PAGE_SIZE;
+        uint32_t run_phys = virt_to_phys((void *)run_virt);
+        uint32_t run_pages = 1;
+        while (i + run_pages < pages &&
+               virt_to_phys((void *)(run_virt + run_pages * PAGE_SIZE)) == run_phys + run_pages * PAGE_SIZE)
+            run_pages++;
+
+        if (run_phys != UINT32_MAX)
+        {
+            paging_unmap_range(run_virt, run_pages * PAGE_SIZE);
+            pmm_free_blocks((void *)run_phys, run_pages);
+        }
+        i += run_pages;
+    }
+    paging_batch_end();
+}
 
+void *liballoc_alloc(int num_blocks)
+{
     if (num_blocks <= 0)
     {
         serial_printf("liballoc: Invalid number of blocks requested: %d\n", num_blocks);
         return NULL;
     }
 
-    void *virt_addr = NULL;
-    for (int i = 0; i < num_blocks; i++)
+    if (!heap_stats.start)
     {
-        void *page = vmm_alloc_page();
-        if (!page)
+        // 4MB aligned so large contiguous growths can use large pages
+        heap_stats.start = vmm_reserve_virtual_aligned(HEAP_WINDOW_PAGES, LARGE_PAGE_SIZE);
+        if (!heap_stats.start)
         {
-            serial_printf("liballoc: Failed to allocate page %d of %d\n", i, num_blocks);
+            serial_printf("liballoc: Cannot reserve a %d page heap window\n", HEAP_WINDOW_PAGES);
+            return NULL;
+        }
+        kva_init(&heap_space, "heap", heap_stats.start, heap_stats.start + HEAP_WINDOW_PAGES * PAGE_SIZE);
+    }
 
-            for (int j = 0; j < i; j++)
+    uint32_t virt = kva_alloc(&heap_space, num_blocks, KVA_BEST_FIT);
+    if (!virt)
+    {
+        serial_printf("liballoc: Heap window has no room for %d pages\n", num_blocks);
+        return NULL;
+    }
+
+    void *frames = pmm_alloc_blocks(num_blocks);
+    if (frames)
+    {
+        if (!paging_map_range((uint32_t)frames, virt, num_blocks * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE))
+        {
+            paging_unmap_range(virt, num_blocks * PAGE_SIZE);
+            pmm_free_blocks(frames, num_blocks);
+            kva_release(&heap_space, virt, num_blocks);
+            return NULL;
+        }
+        pmm_set_owner(frames, num_blocks, PAGE_OWNER_HEAP);
+        heap_stats.contiguous_grows++;
+    }
+    else
+    {
+        // Fragmented physical memory: back the range a page at a time
+        paging_batch_begin();
+        int mapped = 0;
+        for (; mapped < num_blocks; mapped++)
+        {
+            void *frame = pmm_alloc_block();
+            if (!frame)
+                break;
+            if (!paging_map_page((uint32_t)frame, virt + mapped * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE))
             {
-                vmm_free_page((char *)virt_addr + (j * PAGE_SIZE));
+                pmm_free_block(frame);
+                break;
             }
+            pmm_set_owner(frame, 1, PAGE_OWNER_HEAP);
+        }
+        paging_batch_end();
+
+        if (mapped < num_blocks)
+        {
+            serial_printf("liballoc: Failed to allocate page %d of %d\n", mapped, num_blocks);
+            heap_release(virt, mapped);
+            kva_release(&heap_space, virt, num_blocks);
             return NULL;
         }
-        if (i == 0)
-            virt_addr = page;
     }
 
-    // serial_printf("liballoc: Allocated %d pages at virtual address 0x%lx\n",
-                //   num_blocks, (uintptr_t)virt_addr);
-    return virt_addr;
+    heap_stats.pages += num_blocks;
+    heap_stats.grows++;
+    return (void *)virt;
 }
 
 int liballoc_free(void *ptr, int num_blocks)
 {
-    // serial_printf("liballoc: Request to free %d blocks at address 0x%lx\n", num_blocks, (uintptr_t)ptr);
+    uint32_t virt = (uint32_t)ptr;
 
-    if (!ptr)
+    if (!ptr || (virt & (PAGE_SIZE - 1)) || !kva_contains(&heap_space, virt))
     {
-        serial_printf("liballoc: Failed to free memory: NULL pointer\n");
+        serial_printf("liballoc: Failed to free memory at 0x%x\n", virt);
         return -1;
     }
 
-    for (int i = 0; i < num_blocks; i++)
-    {
-        vmm_free_page((char *)ptr + (i * PAGE_SIZE));
-    }
+    heap_release(virt, num_blocks);
+    kva_release(&heap_space, virt, num_blocks);
 
-    // serial_printf("liballoc: Successfully freed %d blocks at address 0x%lx\n", num_blocks, (uintptr_t)ptr);
+    heap_stats.pages -= num_blocks;
+    heap_stats.releases++;
+    heap_stats.released_pages += num_blocks;
     return 0;
 }
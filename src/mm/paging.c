@@ -6,43 +6,267 @@
 #include <stdbool.h>
 #include "isr.h"
 #include "8259_pic.h"
+#include "io.h"
 
 extern uint32_t __kernel_physical_start;
 extern uint32_t __kernel_physical_end;
 
 static uint32_t *page_directory __attribute__((aligned(4096))) = NULL;
 bool paging_active = false; // Track if paging is enabled
+bool paging_pse = false;    // CR4.PSE set, PDEs may map 4MB pages
+bool paging_pat = false;    // PAT programmed, PAGE_WC is write-combining
+bool paging_pge = false;    // CR4.PGE set, kernel mappings survive CR3 reloads
+static bool paging_pge_supported = false;
+paging_stats_t paging_stats;
+
+/*
+ * Every address space shares the kernel half (the identity map and
+ * everything from KERNEL_VMEM_START up). page_directory is the master copy:
+ * kernel PDEs are only ever changed there, through paging_set_pde, which
+ * copies the change into every other directory. User PDEs are private.
+ */
+static uint32_t *paging_directories[PAGING_MAX_DIRECTORIES];
+
+uint32_t physmap_end = 0;
+uint32_t identity_end = 0;
+
+/*
+ * TLB flushes are deferred while a batch is open: changed pages are queued
+ * and paging_batch_end() either invlpg's each of them or, past
+ * PAGING_FLUSH_MAX pages, reloads CR3 once. Batches nest.
+ */
+static struct
+{
+    uint32_t depth;
+    uint32_t count;
+    bool full; // too many pages queued, flush everything
+    uint32_t pages[PAGING_FLUSH_MAX];
+} paging_batch;
+
+#define CR4_PGE (1 << 7)
+
+static inline bool paging_kernel_pde(uint32_t pd_index)
+{
+    return pd_index >= (KERNEL_VMEM_START >> 22) || pd_index < (identity_end >> 22);
+}
+
+static void paging_set_pde(uint32_t pd_index, uint32_t pde)
+{
+    page_directory[pd_index] = pde;
+    if (!paging_kernel_pde(pd_index))
+        return;
+
+    for (int i = 0; i < PAGING_MAX_DIRECTORIES; i++)
+        if (paging_directories[i])
+            paging_directories[i][pd_index] = pde;
+}
+
+// Kernel-half entries are global, the CPU ignores the bit until CR4.PGE is set
+static inline uint32_t paging_global(uint32_t virt_addr)
+{
+    return paging_kernel_pde(virt_addr >> 22) ? PAGE_GLOBAL : 0;
+}
+
+// A CR3 reload keeps global entries, toggling CR4.PGE drops them too
+static void paging_flush_all()
+{
+    uint32_t reg;
+    if (paging_pge)
+        __asm__ volatile("mov %%cr4, %0\n"
+                         "xor %1, %0\n"
+                         "mov %0, %%cr4\n"
+                         "xor %1, %0\n"
+                         "mov %0, %%cr4" : "=&r"(reg) : "i"(CR4_PGE) : "memory");
+    else
+        __asm__ volatile("mov %%cr3, %0\n"
+                         "mov %0, %%cr3" : "=r"(reg) :: "memory");
+    paging_stats.cr3_reloads++;
+}
+
+static inline void paging_invlpg(uint32_t virt_addr)
+{
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    paging_stats.invlpg++;
+}
+
+static void paging_flush_page(uint32_t virt_addr)
+{
+    if (!paging_active)
+        return;
+
+    if (!paging_batch.depth)
+    {
+        paging_invlpg(virt_addr);
+        return;
+    }
+
+    if (paging_batch.full)
+        return;
+    if (paging_batch.count < PAGING_FLUSH_MAX)
+        paging_batch.pages[paging_batch.count++] = virt_addr;
+    else
+        paging_batch.full = true;
+}
+
+void paging_batch_begin()
+{
+    paging_batch.depth++;
+}
+
+void paging_batch_end()
+{
+    if (!paging_batch.depth || --paging_batch.depth)
+        return;
+
+    if (paging_batch.full)
+        paging_flush_all();
+    else
+    {
+        for (uint32_t i = 0; i < paging_batch.count; i++)
+            paging_invlpg(paging_batch.pages[i]);
+    }
+
+    if (paging_batch.full || paging_batch.count)
+        paging_stats.batches++;
+    paging_batch.count = 0;
+    paging_batch.full = false;
+}
+
+// Page tables are reached through the physmap once paging is on
+static void *paging_alloc_table()
+{
+    void *table = pmm_alloc_blocks_in_range(1, 0, physmap_end);
+    if (table)
+        pmm_set_owner(table, 1, PAGE_OWNER_PAGE_TABLE);
+    return table;
+}
+
+static inline uint32_t *paging_table_virt(uint32_t pt_phys)
+{
+    return (uint32_t *)(paging_active ? phys_to_virt(pt_phys) : pt_phys);
+}
+
+static void paging_enable_pse()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 3)))
+    {
+        serial_printf("Paging: PSE not supported, using 4KB pages only\n");
+        return;
+    }
+
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1 << 4);
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+    paging_pse = true;
+}
+
+static void paging_enable_pge()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 13)))
+    {
+        serial_printf("Paging: PGE not supported, CR3 reloads flush kernel mappings\n");
+        return;
+    }
+
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PGE;
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+    paging_pge_supported = true;
+    paging_pge = true;
+}
+
+#define MSR_PAT 0x277
+#define PAT_UC  0x00
+#define PAT_WC  0x01
+#define PAT_WB  0x06
+#define PAT_UCM 0x07 // UC-, can be overridden by MTRR write-combining
+
+// Entries 0-3 are selected by PWT/PCD alone and repeat in 4-7 for the PAT bit
+#define PAT_ENTRIES ((uint32_t)PAT_WB | (PAT_WC << 8) | (PAT_UCM << 16) | (PAT_UC << 24))
+
+static void paging_enable_pat()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 16)))
+    {
+        serial_printf("Paging: PAT not supported, write-combining maps as write-through\n");
+        return;
+    }
+
+    // Runs before paging is enabled, so no stale TLB entries carry the old types
+    __asm__ volatile("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, ((uint64_t)PAT_ENTRIES << 32) | PAT_ENTRIES);
+    __asm__ volatile("wbinvd" ::: "memory");
+
+    paging_pat = true;
+    serial_printf("Paging: PAT programmed (WB, WC, UC-, UC)\n");
+}
+
+// Replace a 4MB PDE by a page table mapping the same memory, so single pages can change
+static bool paging_split_large(uint32_t pd_index)
+{
+    uint32_t pde = page_directory[pd_index];
+    uint32_t *table = paging_alloc_table();
+    if (!table)
+    {
+        serial_printf("PAGING: Failed to allocate page table to split PDE %d\n", pd_index);
+        return false;
+    }
+
+    uint32_t *virt_table = paging_table_virt((uint32_t)table);
+    uint32_t base = pde & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t flags = pde & 0xFFF & ~PAGE_LARGE;
+    for (uint32_t i = 0; i < 1024; i++)
+        virt_table[i] = (base + i * PAGE_SIZE) | flags;
+
+    paging_set_pde(pd_index, (uint32_t)table | (flags & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)));
+    paging_flush_page(pd_index << 22);
+    return true;
+}
 
 void paging_init()
 {
+    physmap_end = pmm_get_total_memory() & ~(PAGE_SIZE - 1);
+    if (physmap_end > PHYSMAP_SIZE)
+        physmap_end = PHYSMAP_SIZE;
+
     // Allocate page directory (must be 4KB aligned)
-    page_directory = pmm_alloc_block();
+    page_directory = paging_alloc_table();
     if (!page_directory)
     {
         serial_printf("Paging: Failed to allocate page directory!\n");
-        serial_printf("Paging: Failed to allocate first page table!\n");
         return;
     }
-    // serial_printf("Paging: Page directory allocated at 0x%x\n", (uint32_t)page_directory);
 
     memset(page_directory, 0, PAGE_SIZE);
 
-    uint32_t *first_page_table = pmm_alloc_block();
-    if (!first_page_table)
-        return;
+    paging_enable_pse();
+    paging_enable_pge();
+    paging_enable_pat();
 
-    memset(first_page_table, 0, PAGE_SIZE);
+    // Low memory holds the kernel, its stack and the PMM's boot allocations,
+    // which run at their physical addresses: identity map it. All RAM up to
+    // PHYSMAP_SIZE goes in the physmap, page tables included
+    identity_end = (pmm_get_boot_end() + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (identity_end < LARGE_PAGE_SIZE)
+        identity_end = LARGE_PAGE_SIZE;
 
-    for (uint32_t i = 0; i < 2048; i++)
+    if (!paging_map_range(0, 0, identity_end, PAGE_PRESENT | PAGE_WRITABLE) ||
+        !paging_map_range(0, PHYSMAP_BASE, physmap_end, PAGE_PRESENT | PAGE_WRITABLE))
     {
-        first_page_table[i] = (i * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE;
+        serial_printf("Paging: Failed to map low memory!\n");
+        return;
     }
 
-    page_directory[0] = ((uint32_t)first_page_table & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITABLE;
-
-    page_directory[768] = ((uint32_t)first_page_table) | PAGE_PRESENT | PAGE_WRITABLE;
-
-    // serial_printf("Paging: Page directory initialized at 0x%x\n", (uint32_t)page_directory);
+    serial_printf("Paging: Identity map 0x0-0x%x, physmap of 0x%x bytes at 0x%x, %s pages\n", identity_end,
+                  physmap_end, PHYSMAP_BASE, paging_pse ? "4MB" : "4KB");
 }
 
 static inline void load_page_directory(uint32_t pd_addr)
@@ -50,11 +274,12 @@ static inline void load_page_directory(uint32_t pd_addr)
     __asm__ volatile("mov %0, %%cr3" ::"r"(pd_addr) : "memory");
 }
 
+// CR0.WP makes read-only pages fault in ring 0 too, the zero page relies on it
 static inline void enable_paging_internal()
 {
     __asm__ volatile(
         "mov %%cr0, %%eax\n"
-        "or $0x80000000, %%eax\n"
+        "or $0x80010000, %%eax\n"
         "mov %%eax, %%cr0\n"
         "jmp 1f\n"
         "1:\n" ::: "eax", "memory");
@@ -81,7 +306,7 @@ void paging_enable(uint32_t page_directory_addr)
         "1:\n");
 
     paging_active = true;
-    page_directory = (uint32_t*)(0xC0000000 + (uint32_t)page_directory);
+    page_directory = (uint32_t *)phys_to_virt((uint32_t)page_directory);
     serial_printf("Paging: Enabled successfully\n");
 }
 
@@ -90,10 +315,13 @@ bool paging_map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags)
     uint32_t pd_index = virt_addr >> 22;
     uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
 
+    if ((page_directory[pd_index] & PAGE_LARGE) && !paging_split_large(pd_index))
+        return false;
+
     if (!(page_directory[pd_index] & PAGE_PRESENT))
     {
         // 1. Allocate physical memory for the new page table
-        void *phys_table = pmm_alloc_block();
+        void *phys_table = paging_alloc_table();
         if (!phys_table)
         {
             serial_printf("PAGING: Failed to allocate page table for PDE %d\n", pd_index);
@@ -101,37 +329,28 @@ bool paging_map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags)
         }
         
         // 2. CORRECT WAY: Convert to virtual address BEFORE using as pointer
-        uint32_t *virt_table;
-        if (paging_active) {
-            virt_table = (uint32_t *)(0xC0000000 + (uint32_t)phys_table);
-        } else {
-            virt_table = (uint32_t *)phys_table;
-        }
+        uint32_t *virt_table = paging_table_virt((uint32_t)phys_table);
         
         // 3. Now we can safely zero the page table
         memset(virt_table, 0, PAGE_SIZE);
 
         // 4. Store PHYSICAL address in page directory
         uint32_t pde_flags = PAGE_PRESENT | PAGE_WRITABLE;
-        page_directory[pd_index] = (uint32_t)phys_table | pde_flags;
+        paging_set_pde(pd_index, (uint32_t)phys_table | pde_flags);
     }
 
     // Get the physical address of the page table from PDE
     uint32_t pt_phys = page_directory[pd_index] & ~0xFFF;
     
     // Convert to virtual address if needed
-    uint32_t *page_table;
-    if (paging_active) {
-        page_table = (uint32_t *)(0xC0000000 + pt_phys);
-    } else {
-        page_table = (uint32_t *)pt_phys;
-    }
+    uint32_t *page_table = paging_table_virt(pt_phys);
 
     // Set up the page table entry
-    page_table[pt_index] = (phys_addr & ~0xFFF) | flags | PAGE_PRESENT;
+    page_table[pt_index] = (phys_addr & ~0xFFF) | flags | paging_global(virt_addr) | PAGE_PRESENT;
     
     // CRITICAL: Flush TLB to make the mapping active immediately
-    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    paging_flush_page(virt_addr);
+    paging_stats.pages_mapped++;
 
     return true;
 }
@@ -147,7 +366,10 @@ void paging_unmap_page(uint32_t virt_addr)
         return;
     }
 
-    uint32_t *pt = (uint32_t *)(page_directory[pd_index] & ~0xFFF);
+    if ((page_directory[pd_index] & PAGE_LARGE) && !paging_split_large(pd_index))
+        return;
+
+    uint32_t *pt = paging_table_virt(page_directory[pd_index] & ~0xFFF);
 
     if (!(pt[pt_index] & PAGE_PRESENT))
     {
@@ -157,7 +379,218 @@ void paging_unmap_page(uint32_t virt_addr)
 
     pt[pt_index] = 0; 
 
-    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    paging_flush_page(virt_addr);
+    paging_stats.pages_unmapped++;
+}
+
+bool paging_map_range(uint32_t phys_addr, uint32_t virt_addr, uint32_t size, uint32_t flags)
+{
+    uint32_t end = virt_addr + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    phys_addr &= ~(PAGE_SIZE - 1);
+    virt_addr &= ~(PAGE_SIZE - 1);
+    bool ok = true;
+
+    paging_batch_begin();
+    while (virt_addr != end)
+    {
+        uint32_t pd_index = virt_addr >> 22;
+        bool aligned = !((phys_addr | virt_addr) & (LARGE_PAGE_SIZE - 1));
+
+        // A whole 4MB slot with nothing mapped in it yet: one PDE instead of a table
+        if (paging_pse && aligned && end - virt_addr >= LARGE_PAGE_SIZE &&
+            (!(page_directory[pd_index] & PAGE_PRESENT) || (page_directory[pd_index] & PAGE_LARGE)))
+        {
+            paging_set_pde(pd_index, phys_addr | flags | paging_global(virt_addr) | PAGE_PRESENT | PAGE_LARGE);
+            paging_flush_page(virt_addr);
+            paging_stats.pages_mapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+            phys_addr += LARGE_PAGE_SIZE;
+            virt_addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (!paging_map_page(phys_addr, virt_addr, flags))
+        {
+            ok = false;
+            break;
+        }
+        phys_addr += PAGE_SIZE;
+        virt_addr += PAGE_SIZE;
+    }
+    paging_batch_end();
+    return ok;
+}
+
+void paging_unmap_range(uint32_t virt_addr, uint32_t size)
+{
+    uint32_t end = virt_addr + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    paging_batch_begin();
+    while (virt_addr != end)
+    {
+        uint32_t pd_index = virt_addr >> 22;
+        uint32_t pde = page_directory[pd_index];
+
+        if (!(pde & PAGE_PRESENT))
+        {
+            // Nothing mapped in this 4MB slot, skip to the next one
+            uint32_t next = (pd_index + 1) << 22;
+            virt_addr = (next == 0 || next > end || next < virt_addr) ? end : next;
+            continue;
+        }
+
+        if ((pde & PAGE_LARGE) && !(virt_addr & (LARGE_PAGE_SIZE - 1)) && end - virt_addr >= LARGE_PAGE_SIZE)
+        {
+            paging_set_pde(pd_index, 0);
+            paging_flush_page(virt_addr);
+            paging_stats.pages_unmapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+            virt_addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        paging_unmap_page(virt_addr);
+        virt_addr += PAGE_SIZE;
+    }
+    paging_batch_end();
+}
+
+bool paging_set_cache(uint32_t virt_addr, uint32_t size, uint32_t cache)
+{
+    uint32_t end = virt_addr + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    virt_addr &= ~(PAGE_SIZE - 1);
+    cache &= PAGE_CACHE_MASK;
+    bool ok = true;
+
+    paging_batch_begin();
+    while (virt_addr != end)
+    {
+        uint32_t pd_index = virt_addr >> 22;
+        uint32_t pde = page_directory[pd_index];
+
+        if (!(pde & PAGE_PRESENT))
+        {
+            uint32_t next = (pd_index + 1) << 22;
+            virt_addr = (next == 0 || next > end || next < virt_addr) ? end : next;
+            continue;
+        }
+
+        if (pde & PAGE_LARGE)
+        {
+            if (!(virt_addr & (LARGE_PAGE_SIZE - 1)) && end - virt_addr >= LARGE_PAGE_SIZE)
+            {
+                paging_set_pde(pd_index, (pde & ~PAGE_CACHE_MASK) | cache);
+                paging_flush_page(virt_addr);
+                virt_addr += LARGE_PAGE_SIZE;
+                continue;
+            }
+            if (!paging_split_large(pd_index))
+            {
+                ok = false;
+                break;
+            }
+        }
+
+        uint32_t *pt = paging_table_virt(page_directory[pd_index] & ~0xFFF);
+        uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
+        if (pt[pt_index] & PAGE_PRESENT)
+        {
+            pt[pt_index] = (pt[pt_index] & ~PAGE_CACHE_MASK) | cache;
+            paging_flush_page(virt_addr);
+        }
+        virt_addr += PAGE_SIZE;
+    }
+    paging_batch_end();
+
+    // Lines cached under the old type must not be written back over the new one
+    __asm__ volatile("wbinvd" ::: "memory");
+    return ok;
+}
+
+uint32_t paging_get_entry(uint32_t virt_addr)
+{
+    uint32_t pde = page_directory[virt_addr >> 22];
+    if (!(pde & PAGE_PRESENT))
+        return 0;
+
+    if (pde & PAGE_LARGE)
+        return ((pde & ~(LARGE_PAGE_SIZE - 1)) | (virt_addr & (LARGE_PAGE_SIZE - 1) & ~0xFFF)) | (pde & 0xFFF & ~PAGE_LARGE);
+
+    return paging_table_virt(pde & ~0xFFF)[(virt_addr >> 12) & 0x3FF];
+}
+
+uint32_t paging_create_directory()
+{
+    uint32_t *table = paging_alloc_table();
+    if (!table)
+        return 0;
+    uint32_t *pd = paging_table_virt((uint32_t)table);
+
+    uint32_t flags = irq_save();
+    int slot = -1;
+    for (int i = 0; i < PAGING_MAX_DIRECTORIES && slot < 0; i++)
+        if (!paging_directories[i])
+            slot = i;
+    if (slot < 0)
+    {
+        irq_restore(flags);
+        pmm_free_block(table);
+        serial_printf("Paging: Out of page directories\n");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < 1024; i++)
+        pd[i] = paging_kernel_pde(i) ? page_directory[i] : 0;
+    paging_directories[slot] = pd;
+    irq_restore(flags);
+    return (uint32_t)table;
+}
+
+void paging_destroy_directory(uint32_t directory)
+{
+    uint32_t *pd = paging_table_virt(directory);
+    uint32_t current;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(current));
+    if (pd == page_directory || directory == current)
+    {
+        serial_printf("Paging: Refusing to free directory 0x%x in use\n", directory);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    for (int i = 0; i < PAGING_MAX_DIRECTORIES; i++)
+        if (paging_directories[i] == pd)
+            paging_directories[i] = NULL;
+    irq_restore(flags);
+
+    // The user half's page tables are private, the frames they map belong to whoever mapped them
+    for (uint32_t i = 0; i < 1024; i++)
+        if (!paging_kernel_pde(i) && (pd[i] & PAGE_PRESENT) && !(pd[i] & PAGE_LARGE))
+            pmm_free_block((void *)(pd[i] & ~0xFFF));
+    pmm_free_block((void *)directory);
+}
+
+void paging_switch_directory(uint32_t directory)
+{
+    __asm__ volatile("mov %0, %%cr3" ::"r"(directory) : "memory");
+}
+
+uint32_t paging_kernel_directory()
+{
+    return paging_active ? virt_to_phys(page_directory) : (uint32_t)page_directory;
+}
+
+bool paging_set_global(bool enable)
+{
+    bool was = paging_pge;
+    if (enable == was || (enable && !paging_pge_supported))
+        return was;
+
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 = enable ? cr4 | CR4_PGE : cr4 & ~CR4_PGE;
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+    paging_pge = enable;
+    return was;
 }
 
 uint32_t *get_page_directory()
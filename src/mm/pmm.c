@@ -1,4 +1,5 @@
 #include "pmm.h"
+#include "cma.h"
 #include "serial.h"
 #include "string.h"
 #include <stdbool.h>
@@ -7,154 +8,809 @@
 #define PMM_ERROR(msg, ...) serial_printf("PMM ERROR: " msg "\n", ##__VA_ARGS__)
 #define PMM_LOG(msg, ...) if(PMM_DEBUG) serial_printf("PMM: " msg "\n", ##__VA_ARGS__)
 
+/*
+ * Two-level bitmap: pmm_memory_map holds one bit per block (1 = used) and is
+ * scanned a word at a time. pmm_summary holds one bit per bitmap word, set when
+ * all 32 blocks of that word are used, so full regions are skipped 1024 blocks
+ * per summary word. pmm_next_free is the lowest bitmap word that may still have
+ * a free block; nothing below it is scanned.
+ *
+ * Allocations themselves are served by a buddy allocator (buddy.c) built from
+ * the bitmap at the end of pmm_init. The bitmap stays the record of which
+ * blocks are used and is only searched directly for runs larger than the
+ * biggest buddy block, or when a range has no suitably aligned buddy left.
+ *
+ * Memory is split into zones, each with its own buddy area and watermarks.
+ * General allocations try NORMAL first (keeping its min watermark), then DMA
+ * as long as DMA stays above its high watermark, and only then drain NORMAL
+ * completely. DMA requests come straight from the DMA zone, so the heap can
+ * not starve drivers that need memory below 16MB.
+ *
+ * pmm_pages is the per-block descriptor array (page_t). The bitmap says
+ * whether a block is used, the descriptor says by whom and how many times.
+ */
+#define PMM_NO_BLOCK 0xFFFFFFFF
+#define PMM_SUMMARY_WORDS (PMM_MAX_BITMAP_WORDS / PMM_BLOCKS_PER_WORD)
+
 static uint32_t pmm_memory_size = 0;
 uint32_t pmm_used_blocks = 0;
 static uint32_t pmm_max_blocks = 0;
-static uint8_t *pmm_memory_map = 0;
+static uint32_t *pmm_memory_map = 0;
+static uint32_t pmm_map_words = 0;
+static uint32_t pmm_summary[PMM_SUMMARY_WORDS];
+static uint32_t pmm_next_free = 0;
 static bool pmm_initialized = false;
-static uint32_t pmm_last_alloc = 0;
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static uint32_t pmm_region_count = 0;
+static uint32_t pmm_early_start = 0; // boot-time bump allocator for the bitmap and buddy maps
+static uint32_t pmm_early_next = 0;
+static page_t *pmm_pages = NULL;
+static pmm_zone_t pmm_zones[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA] = {.name = "DMA"},
+    [PMM_ZONE_NORMAL] = {.name = "NORMAL"},
+};
+static const pmm_zone_id_t pmm_fallback_order[PMM_ZONE_COUNT] = {PMM_ZONE_NORMAL, PMM_ZONE_DMA};
 
-void pmm_init(size_t mem_size, uint8_t *bitmap)
+static inline void pmm_update_summary(uint32_t word)
 {
-    if (mem_size == 0 || bitmap == NULL)
-    {
-        serial_printf("PMM: Invalid parameters\n");
-        return;
-    }
+    if (pmm_memory_map[word] == 0xFFFFFFFF)
+        pmm_summary[word / PMM_BLOCKS_PER_WORD] |= (1u << (word % PMM_BLOCKS_PER_WORD));
+    else
+        pmm_summary[word / PMM_BLOCKS_PER_WORD] &= ~(1u << (word % PMM_BLOCKS_PER_WORD));
+}
 
-    pmm_memory_size = mem_size;
-    pmm_memory_map = bitmap;
-    pmm_max_blocks = (mem_size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
-    pmm_used_blocks = 0;
+static inline bool pmm_test_block(uint32_t block)
+{
+    return pmm_memory_map[block / PMM_BLOCKS_PER_WORD] & (1u << (block % PMM_BLOCKS_PER_WORD));
+}
 
-    size_t bitmap_size = (pmm_max_blocks + PMM_BLOCKS_PER_BYTE - 1) / PMM_BLOCKS_PER_BYTE;
-    memset(pmm_memory_map, 0x00, bitmap_size);
+static inline void pmm_clear_block(uint32_t block)
+{
+    uint32_t word = block / PMM_BLOCKS_PER_WORD;
+    pmm_memory_map[word] &= ~(1u << (block % PMM_BLOCKS_PER_WORD));
+    pmm_update_summary(word);
+    pmm_used_blocks--;
+    if (word < pmm_next_free)
+        pmm_next_free = word;
+}
 
-    pmm_mark_used_region(0, 0x100000);
+// Descriptor of a block that just became free
+static inline void pmm_page_reset(page_t *page)
+{
+    page->refcount = 0;
+    page->flags = 0;
+    page->owner = PAGE_OWNER_NONE;
+    page->private = 0;
+}
 
-    uint32_t kernel_start = (uint32_t)&__kernel_physical_start;
-    uint32_t kernel_end = (uint32_t)&__kernel_physical_end;
-    uint32_t kernel_size = kernel_end - kernel_start;
+static inline uint32_t pmm_popcount(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
 
-    serial_printf("PMM: Kernel physical start: 0x%x, end: 0x%x, size: %d bytes\n",
-                  kernel_start, kernel_end, kernel_size);
+// Bits of bitmap word `block / 32` covered by [block, end), *n gets the number of blocks
+static inline uint32_t pmm_word_mask(uint32_t block, uint32_t end, uint32_t *n)
+{
+    uint32_t bit = block % PMM_BLOCKS_PER_WORD;
+    uint32_t count = PMM_BLOCKS_PER_WORD - bit;
+    if (end - block < count)
+        count = end - block;
 
-    pmm_mark_used_region(kernel_start, kernel_size);
+    *n = count;
+    return count == PMM_BLOCKS_PER_WORD ? 0xFFFFFFFF : ((1u << count) - 1) << bit;
+}
 
-    pmm_mark_used_region((uint32_t)bitmap, pmm_max_blocks / PMM_BLOCKS_PER_BYTE);
+// Returns the first bitmap word at or after `word` that is not full.
+static uint32_t pmm_next_nonfull_word(uint32_t word)
+{
+    uint32_t s = word / PMM_BLOCKS_PER_WORD;
+    uint32_t summary_words = (pmm_map_words + PMM_BLOCKS_PER_WORD - 1) / PMM_BLOCKS_PER_WORD;
+    // word may be one past the map, which with a full 4GB map is past pmm_summary too
+    if (s >= summary_words)
+        return PMM_NO_BLOCK;
+    uint32_t free_bits = ~pmm_summary[s] & (0xFFFFFFFF << (word % PMM_BLOCKS_PER_WORD));
 
-    serial_printf("PMM: Initialized with %d blocks (%.2f MB)\n",
-                  pmm_max_blocks, (float)pmm_memory_size / (1024 * 1024));
-    serial_printf("PMM: Used blocks: %d\n", pmm_used_blocks);
-    serial_printf("PMM: Bitmap at 0x%x\n", (uint32_t)bitmap);
-    serial_printf("PMM: Free blocks: %d\n", pmm_max_blocks - pmm_used_blocks);
+    while (!free_bits)
+    {
+        if (++s >= summary_words)
+            return PMM_NO_BLOCK;
+        free_bits = ~pmm_summary[s];
+    }
 
-    pmm_initialized = true;
+    word = s * PMM_BLOCKS_PER_WORD + __builtin_ctz(free_bits);
+    return word < pmm_map_words ? word : PMM_NO_BLOCK;
 }
 
-uint32_t pmm_get_total_memory()
+// Returns the first free block in [block, end), or PMM_NO_BLOCK.
+static uint32_t pmm_next_free_block(uint32_t block, uint32_t end)
 {
-    return pmm_memory_size;
+    if (block >= end)
+        return PMM_NO_BLOCK;
+
+    uint32_t word = block / PMM_BLOCKS_PER_WORD;
+    uint32_t free_bits = ~pmm_memory_map[word] & (0xFFFFFFFF << (block % PMM_BLOCKS_PER_WORD));
+
+    if (!free_bits)
+    {
+        word = pmm_next_nonfull_word(word + 1);
+        if (word == PMM_NO_BLOCK)
+            return PMM_NO_BLOCK;
+        free_bits = ~pmm_memory_map[word];
+    }
+
+    block = word * PMM_BLOCKS_PER_WORD + __builtin_ctz(free_bits);
+    return block < end ? block : PMM_NO_BLOCK;
 }
 
-void pmm_mark_used_region(uint32_t base, uint32_t size)
+// Returns the first used block in [block, end), or end if the whole range is free.
+static uint32_t pmm_next_used_block(uint32_t block, uint32_t end)
 {
-    uint32_t start_block = base / PMM_BLOCK_SIZE;
-    uint32_t num_blocks = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+    uint32_t word = block / PMM_BLOCKS_PER_WORD;
+    uint32_t used_bits = pmm_memory_map[word] & (0xFFFFFFFF << (block % PMM_BLOCKS_PER_WORD));
 
-    for (uint32_t i = 0; i < num_blocks; i++)
+    while (!used_bits)
+    {
+        word++;
+        if (word * PMM_BLOCKS_PER_WORD >= end)
+            return end;
+        used_bits = pmm_memory_map[word];
+    }
+
+    block = word * PMM_BLOCKS_PER_WORD + __builtin_ctz(used_bits);
+    return block < end ? block : end;
+}
+
+// First-fit search for `count` free blocks inside [start, end).
+static uint32_t pmm_find_free_run(uint32_t count, uint32_t start, uint32_t end)
+{
+    if (end > pmm_max_blocks)
+        end = pmm_max_blocks;
+    if (start < pmm_next_free * PMM_BLOCKS_PER_WORD)
+        start = pmm_next_free * PMM_BLOCKS_PER_WORD;
+
+    uint32_t block = start;
+    while (block < end && end - block >= count)
     {
-        uint32_t block = start_block + i;
-        if (block >= pmm_max_blocks)
+        block = pmm_next_free_block(block, end);
+        if (block == PMM_NO_BLOCK || end - block < count)
             break;
 
-        uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-        uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
+        uint32_t run_end = pmm_next_used_block(block, block + count);
+        if (run_end == block + count)
+            return block;
+        block = run_end;
+    }
+    return PMM_NO_BLOCK;
+}
+
+// Mark [block, block + count) used a word at a time, returns how many blocks were free before
+static uint32_t pmm_mark_run_used(uint32_t block, uint32_t count)
+{
+    uint32_t end = (count > pmm_max_blocks - block) ? pmm_max_blocks : block + count;
+    uint32_t marked = 0;
+
+    while (block < end)
+    {
+        uint32_t n;
+        uint32_t word = block / PMM_BLOCKS_PER_WORD;
+        uint32_t mask = pmm_word_mask(block, end, &n);
 
-        if (!(pmm_memory_map[byte_idx] & (1 << bit_idx)))
+        uint32_t fresh = ~pmm_memory_map[word] & mask;
+        marked += pmm_popcount(fresh);
+        pmm_memory_map[word] |= mask;
+        pmm_update_summary(word);
+        block += n;
+
+        while (fresh)
         {
-            pmm_memory_map[byte_idx] |= (1 << bit_idx);
-            pmm_used_blocks++;
+            page_t *page = &pmm_pages[word * PMM_BLOCKS_PER_WORD + __builtin_ctz(fresh)];
+            pmm_page_reset(page);
+            page->refcount = 1;
+            fresh &= fresh - 1;
         }
     }
+
+    pmm_used_blocks += marked;
+    return marked;
 }
 
-void pmm_mark_unused_region(uint32_t base, uint32_t size)
+// Give [block, block + count) back to the buddy areas of the zones it spans
+static void pmm_zones_free_range(uint32_t block, uint32_t count)
 {
-    uint32_t start_block = base / PMM_BLOCK_SIZE;
-    uint32_t num_blocks = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+    // Blocks of the CMA area go back to it and stay used in the bitmap
+    uint32_t cma_end = cma_stats.start_block + cma_stats.blocks;
+    if (block < cma_end && block + count > cma_stats.start_block)
+    {
+        uint32_t start = block > cma_stats.start_block ? block : cma_stats.start_block;
+        uint32_t end = block + count < cma_end ? block + count : cma_end;
+        if (block < start)
+            pmm_zones_free_range(block, start - block);
+        pmm_mark_run_used(start, end - start);
+        cma_put_blocks(start, end - start);
+        if (end < block + count)
+            pmm_zones_free_range(end, block + count - end);
+        return;
+    }
 
-    for (uint32_t i = 0; i < num_blocks; i++)
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
     {
-        uint32_t block = start_block + i;
-        if (block >= pmm_max_blocks)
-            break;
+        pmm_zone_t *zone = &pmm_zones[i];
+        uint32_t start = block > zone->start_block ? block : zone->start_block;
+        uint32_t end = block + count < zone->end_block ? block + count : zone->end_block;
+        if (start >= end)
+            continue;
+
+        buddy_free_range(&zone->area, start - zone->start_block, end - start);
+        if (zone->area.free_blocks > zone->watermark_high)
+            zone->low_warned = false;
+    }
+}
 
-        uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-        uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
+static void pmm_zones_reserve_range(uint32_t block, uint32_t count)
+{
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+    {
+        pmm_zone_t *zone = &pmm_zones[i];
+        uint32_t start = block > zone->start_block ? block : zone->start_block;
+        uint32_t end = block + count < zone->end_block ? block + count : zone->end_block;
+        if (start < end)
+            buddy_reserve_range(&zone->area, start - zone->start_block, end - start);
+    }
+}
 
-        if (pmm_memory_map[byte_idx] & (1 << bit_idx))
+// Take `count` blocks from one zone, restricted to [start, end)
+static uint32_t pmm_zone_take(pmm_zone_t *zone, uint32_t count, uint32_t start, uint32_t end)
+{
+    if (start < zone->start_block)
+        start = zone->start_block;
+    if (end > zone->end_block)
+        end = zone->end_block;
+    if (start >= end || end - start < count)
+        return PMM_NO_BLOCK;
+
+    uint32_t order = buddy_order_for(count);
+    uint32_t block = BUDDY_NONE;
+
+    if (order < BUDDY_MAX_ORDER)
+    {
+        if (start == zone->start_block && end == zone->end_block)
+        {
+            block = buddy_alloc_blocks(&zone->area, count);
+        }
+        else
         {
-            pmm_memory_map[byte_idx] &= ~(1 << bit_idx);
-            pmm_used_blocks--;
+            block = buddy_alloc_in_range(&zone->area, order, start - zone->start_block, end - zone->start_block);
+            if (block != BUDDY_NONE && (1u << order) > count)
+                buddy_free_range(&zone->area, block + count, (1u << order) - count);
         }
     }
+
+    if (block == BUDDY_NONE)
+    {
+        // Too large for one buddy block, or no aligned block left: first-fit on the bitmap
+        block = pmm_find_free_run(count, start, end);
+        if (block == PMM_NO_BLOCK)
+            return PMM_NO_BLOCK;
+        buddy_reserve_range(&zone->area, block - zone->start_block, count);
+        return block;
+    }
+
+    return block + zone->start_block;
 }
 
-void *pmm_alloc_block()
+static uint32_t pmm_zone_commit(pmm_zone_t *zone, uint32_t block, uint32_t count)
 {
-    if (pmm_used_blocks >= pmm_max_blocks)
+    pmm_mark_run_used(block, count);
+
+    if (zone->area.free_blocks < zone->watermark_low && !zone->low_warned)
     {
-        serial_printf("PMM: No free blocks available\n");
-        return NULL;
+        zone->low_warned = true;
+        serial_printf("PMM: Zone %s below low watermark (%d blocks free)\n", zone->name, zone->area.free_blocks);
+    }
+    return block;
+}
+
+/*
+ * Allocate `count` blocks inside [start, end) and mark them used. General
+ * requests follow the zone fallback order and respect watermarks, explicit
+ * range requests may use anything inside the range.
+ */
+static uint32_t pmm_take_run(uint32_t count, uint32_t start, uint32_t end, bool general)
+{
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+    {
+        pmm_zone_t *zone = &pmm_zones[pmm_fallback_order[i]];
+        uint32_t keep = 0;
+        if (general)
+            keep = (i == 0) ? zone->watermark_min : zone->watermark_high;
+        if (zone->area.free_blocks < count + keep)
+            continue;
+
+        uint32_t block = pmm_zone_take(zone, count, start, end);
+        if (block != PMM_NO_BLOCK)
+            return pmm_zone_commit(zone, block, count);
+    }
+
+    if (general)
+    {
+        // Last resort: NORMAL below its min watermark, DMA only when there is no NORMAL zone
+        pmm_zone_t *zone = &pmm_zones[PMM_ZONE_NORMAL];
+        if (zone->start_block == zone->end_block)
+            zone = &pmm_zones[PMM_ZONE_DMA];
+
+        uint32_t block = pmm_zone_take(zone, count, start, end);
+        if (block != PMM_NO_BLOCK)
+            return pmm_zone_commit(zone, block, count);
     }
 
-    for (uint32_t byte_idx = 0; byte_idx < pmm_max_blocks / PMM_BLOCKS_PER_BYTE; byte_idx++)
+    return PMM_NO_BLOCK;
+}
+
+// Mark [block, block + count) free, returns how many blocks were actually used before
+static uint32_t pmm_release_run(uint32_t block, uint32_t count)
+{
+    uint32_t end = (count > pmm_max_blocks - block) ? pmm_max_blocks : block + count;
+    uint32_t released = 0;
+    uint32_t run_start = 0, run_len = 0;
+
+    while (block < end)
     {
-        if (pmm_memory_map[byte_idx] == 0xFF)
+        uint32_t n;
+        uint32_t word = block / PMM_BLOCKS_PER_WORD;
+        uint32_t used = pmm_memory_map[word] & pmm_word_mask(block, end, &n);
+        block += n;
+
+        if (!used)
+            continue;
+
+        pmm_memory_map[word] &= ~used;
+        pmm_update_summary(word);
+        if (word < pmm_next_free)
+            pmm_next_free = word;
+        released += pmm_popcount(used);
+
+        for (uint32_t bits = used; bits; bits &= bits - 1)
+            pmm_page_reset(&pmm_pages[word * PMM_BLOCKS_PER_WORD + __builtin_ctz(bits)]);
+
+        if (!pmm_initialized)
             continue;
 
-        for (uint32_t bit_idx = 0; bit_idx < PMM_BLOCKS_PER_BYTE; bit_idx++)
+        // Hand runs of previously used blocks to the buddy areas, joining runs across words
+        while (used)
         {
-            uint32_t block = byte_idx * PMM_BLOCKS_PER_BYTE + bit_idx;
-            if (block >= pmm_max_blocks)
-                break;
+            uint32_t bit = __builtin_ctz(used);
+            uint32_t rest = ~(used >> bit);
+            uint32_t len = rest ? (uint32_t)__builtin_ctz(rest) : PMM_BLOCKS_PER_WORD - bit;
+            uint32_t first = word * PMM_BLOCKS_PER_WORD + bit;
 
-            if (!(pmm_memory_map[byte_idx] & (1 << bit_idx)))
+            if (run_len && run_start + run_len == first)
+            {
+                run_len += len;
+            }
+            else
             {
-                pmm_memory_map[byte_idx] |= (1 << bit_idx);
-                pmm_used_blocks++;
-                return (void *)(block * PMM_BLOCK_SIZE);
+                if (run_len)
+                    pmm_zones_free_range(run_start, run_len);
+                run_start = first;
+                run_len = len;
             }
+            used = (bit + len >= PMM_BLOCKS_PER_WORD) ? 0 : used & ~(((1u << len) - 1) << bit);
         }
     }
-    serial_printf("PMM: Out of memory!\n");
-    return NULL;
+
+    if (run_len)
+        pmm_zones_free_range(run_start, run_len);
+    pmm_used_blocks -= released;
+    return released;
 }
 
-static int find_contiguous_free_blocks(uint32_t num_blocks)
+// Drop one reference from every used block in the run, returns how many were in use
+static uint32_t pmm_put_run(uint32_t block, uint32_t count)
 {
-    for (uint32_t i = 0; i < pmm_max_blocks; i++) {
-        if (pmm_is_block_free(i)) {
-            uint32_t j;
-            for (j = 0; j < num_blocks; j++) {
-                if (i + j >= pmm_max_blocks || !pmm_is_block_free(i + j))
-                    break;
-            }
-            if (j == num_blocks)
-                return i;
+    uint32_t end = (count > pmm_max_blocks - block) ? pmm_max_blocks : block + count;
+    uint32_t in_use = 0;
+    uint32_t run = block;
+
+    for (uint32_t b = block; b < end; b++)
+    {
+        if (!pmm_test_block(b))
+            continue;
+
+        in_use++;
+        if (pmm_pages[b].refcount > 1)
+        {
+            // Still held elsewhere, release what came before it
+            pmm_pages[b].refcount--;
+            if (run < b)
+                pmm_release_run(run, b - run);
+            run = b + 1;
+        }
+    }
+
+    if (run < end)
+        pmm_release_run(run, end - run);
+    return in_use;
+}
+
+static inline uint32_t pmm_align_up(uint32_t addr)
+{
+    return (addr + PMM_BLOCK_SIZE - 1) & ~(PMM_BLOCK_SIZE - 1);
+}
+
+static void pmm_add_region(uint64_t base, uint64_t len, uint32_t type)
+{
+    if (pmm_region_count >= PMM_MAX_REGIONS)
+    {
+        PMM_ERROR("Too many memory map entries, ignoring 0x%x", (uint32_t)base);
+        return;
+    }
+    pmm_regions[pmm_region_count].base = base;
+    pmm_regions[pmm_region_count].len = len;
+    pmm_regions[pmm_region_count].type = type;
+    pmm_region_count++;
+}
+
+// Copy the memory map out of the multiboot info before anything can overwrite it
+static void pmm_load_memory_map(multiboot_info_t *mboot_info)
+{
+    pmm_region_count = 0;
+
+    if (mboot_info->flags & MULTIBOOT_INFO_MEM_MAP)
+    {
+        uint32_t addr = mboot_info->mmap_addr;
+        uint32_t end = mboot_info->mmap_addr + mboot_info->mmap_length;
+
+        while (addr < end)
+        {
+            multiboot_memory_map_t *entry = (multiboot_memory_map_t *)addr;
+            if (entry->len)
+                pmm_add_region(entry->addr, entry->len, entry->type);
+            addr += entry->size + sizeof(entry->size);
+        }
+    }
+
+    if (pmm_region_count == 0)
+    {
+        // No E820 map, fall back to the BIOS lower/upper memory sizes
+        pmm_add_region(0, (uint64_t)mboot_info->mem_lower * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+        pmm_add_region(0x100000, (uint64_t)mboot_info->mem_upper * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+}
+
+// Physical addresses are only tracked below 4GB
+static inline uint32_t pmm_clamp_addr(uint64_t addr)
+{
+    return addr > PMM_MAX_ADDRESS ? PMM_MAX_ADDRESS : (uint32_t)addr;
+}
+
+static uint32_t pmm_find_top_of_ram()
+{
+    uint32_t top = 0;
+    for (uint32_t i = 0; i < pmm_region_count; i++)
+    {
+        if (pmm_regions[i].type != MULTIBOOT_MEMORY_AVAILABLE)
+            continue;
+        uint32_t end = pmm_clamp_addr(pmm_regions[i].base + pmm_regions[i].len);
+        if (end > top)
+            top = end;
+    }
+    return top & ~(PMM_BLOCK_SIZE - 1);
+}
+
+// Returns the end of the available region containing `addr`, or 0
+static uint32_t pmm_available_end(uint32_t addr)
+{
+    for (uint32_t i = 0; i < pmm_region_count; i++)
+    {
+        pmm_region_t *region = &pmm_regions[i];
+        if (region->type == MULTIBOOT_MEMORY_AVAILABLE && addr >= region->base &&
+            addr < region->base + region->len)
+            return pmm_clamp_addr(region->base + region->len);
+    }
+    return 0;
+}
+
+static void *pmm_early_alloc(uint32_t size)
+{
+    uint32_t addr = pmm_early_next;
+    uint32_t end = pmm_align_up(addr + size);
+
+    if (pmm_initialized || end > pmm_available_end(pmm_early_start))
+        return NULL;
+
+    pmm_early_next = end;
+    return (void *)addr;
+}
+
+static inline uint32_t pmm_max_u32(uint32_t a, uint32_t b)
+{
+    return a > b ? a : b;
+}
+
+static void pmm_zone_set_watermarks(pmm_zone_t *zone)
+{
+    uint32_t blocks = zone->end_block - zone->start_block;
+    uint32_t min = blocks / 64;
+
+    if (min < 16)
+        min = 16;
+    if (min > 1024)
+        min = 1024;
+    if (min > blocks)
+        min = blocks;
+
+    zone->watermark_min = min;
+    zone->watermark_low = min + min / 4;
+    zone->watermark_high = min + min / 2;
+}
+
+// Take a 4MB aligned run for the CMA area, above the DMA zone when possible
+static void pmm_cma_reserve()
+{
+    uint32_t blocks = CMA_MAX_BLOCKS;
+    if (blocks > pmm_max_blocks / 4)
+        blocks = (pmm_max_blocks / 4) & ~(CMA_ALIGN_BLOCKS - 1);
+    if (blocks == 0)
+        return;
+
+    uint32_t from[2] = {PMM_ZONE_DMA_LIMIT / PMM_BLOCK_SIZE, CMA_ALIGN_BLOCKS};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint32_t block = from[pass]; block + blocks <= pmm_max_blocks; block += CMA_ALIGN_BLOCKS)
+        {
+            if (pmm_next_used_block(block, block + blocks) != block + blocks)
+                continue;
+
+            pmm_mark_run_used(block, blocks);
+            cma_init(block, blocks);
+            return;
         }
     }
-    return -1;
+    PMM_ERROR("No room for a %d block CMA area", blocks);
+}
+
+// Split memory into zones and hand every free run of the bitmap to their buddy areas
+static bool pmm_zones_init()
+{
+    uint32_t dma_end = PMM_ZONE_DMA_LIMIT / PMM_BLOCK_SIZE;
+    if (dma_end > pmm_max_blocks)
+        dma_end = pmm_max_blocks;
+
+    pmm_zones[PMM_ZONE_DMA].start_block = 0;
+    pmm_zones[PMM_ZONE_DMA].end_block = dma_end;
+    pmm_zones[PMM_ZONE_NORMAL].start_block = dma_end;
+    pmm_zones[PMM_ZONE_NORMAL].end_block = pmm_max_blocks;
+
+    uint32_t words = 0;
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+        words += buddy_storage_words(pmm_zones[i].end_block - pmm_zones[i].start_block);
+
+    uint32_t *maps = pmm_early_alloc(words * sizeof(uint32_t));
+    if (!maps)
+    {
+        PMM_ERROR("No room for %d bytes of buddy maps", words * sizeof(uint32_t));
+        return false;
+    }
+    uint32_t *storage = maps;
+
+    // Everything the early allocator handed out stays allocated for good
+    pmm_mark_used_region(pmm_early_start, pmm_early_next - pmm_early_start);
+    pmm_cma_reserve();
+
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+    {
+        pmm_zone_t *zone = &pmm_zones[i];
+        uint32_t blocks = zone->end_block - zone->start_block;
+
+        buddy_init(&zone->area, zone->start_block, blocks, maps);
+        maps += buddy_storage_words(blocks);
+        pmm_zone_set_watermarks(zone);
+        zone->low_warned = false;
+    }
+
+    uint32_t block = 0;
+    while ((block = pmm_next_free_block(block, pmm_max_blocks)) != PMM_NO_BLOCK)
+    {
+        uint32_t end = pmm_next_used_block(block, pmm_max_blocks);
+        pmm_zones_free_range(block, end - block);
+        block = end;
+    }
+
+    serial_printf("PMM: Buddy maps at 0x%x (%d bytes)\n", (uint32_t)storage, words * sizeof(uint32_t));
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+    {
+        pmm_zone_t *zone = &pmm_zones[i];
+        serial_printf("PMM: Zone %s blocks %d-%d, %d free, watermarks %d/%d/%d\n",
+                      zone->name, zone->start_block, zone->end_block, zone->area.free_blocks,
+                      zone->watermark_min, zone->watermark_low, zone->watermark_high);
+    }
+    return true;
+}
+
+// First page after the kernel that does not hold anything GRUB handed us
+static uint32_t pmm_boot_data_end(multiboot_info_t *mboot_info)
+{
+    uint32_t end = (uint32_t)&__kernel_physical_end;
+
+    end = pmm_max_u32(end, (uint32_t)mboot_info + sizeof(multiboot_info_t));
+    if (mboot_info->flags & MULTIBOOT_INFO_MEM_MAP)
+        end = pmm_max_u32(end, mboot_info->mmap_addr + mboot_info->mmap_length);
+    if (mboot_info->flags & MULTIBOOT_INFO_MODS)
+    {
+        multiboot_module_t *mods = (multiboot_module_t *)mboot_info->mods_addr;
+        end = pmm_max_u32(end, mboot_info->mods_addr + mboot_info->mods_count * sizeof(multiboot_module_t));
+        for (uint32_t i = 0; i < mboot_info->mods_count; i++)
+            end = pmm_max_u32(end, mods[i].mod_end);
+    }
+    return pmm_align_up(end);
+}
+
+void pmm_init(multiboot_info_t *mboot_info)
+{
+    if (mboot_info == NULL)
+    {
+        serial_printf("PMM: Invalid parameters\n");
+        return;
+    }
+
+    pmm_load_memory_map(mboot_info);
+    for (uint32_t i = 0; i < pmm_region_count; i++)
+    {
+        serial_printf("PMM: Region 0x%x len 0x%x type %d\n", (uint32_t)pmm_regions[i].base,
+                      pmm_clamp_addr(pmm_regions[i].len), pmm_regions[i].type);
+    }
+
+    pmm_memory_size = pmm_find_top_of_ram();
+    if (pmm_memory_size == 0)
+    {
+        serial_printf("PMM: No usable memory in the memory map\n");
+        return;
+    }
+
+    pmm_max_blocks = pmm_memory_size / PMM_BLOCK_SIZE;
+    pmm_map_words = (pmm_max_blocks + PMM_BLOCKS_PER_WORD - 1) / PMM_BLOCKS_PER_WORD;
+    pmm_next_free = 0;
+
+    pmm_early_start = pmm_boot_data_end(mboot_info);
+    pmm_early_next = pmm_early_start;
+
+    pmm_memory_map = pmm_early_alloc(pmm_map_words * sizeof(uint32_t));
+    if (!pmm_memory_map)
+    {
+        serial_printf("PMM: No room for the bitmap after 0x%x\n", pmm_early_start);
+        return;
+    }
+
+    pmm_pages = pmm_early_alloc(pmm_max_blocks * sizeof(page_t));
+    if (!pmm_pages)
+    {
+        serial_printf("PMM: No room for %d page descriptors\n", pmm_max_blocks);
+        return;
+    }
+
+    // Start with everything used, then free what the memory map says is RAM
+    memset(pmm_memory_map, 0xFF, pmm_map_words * sizeof(uint32_t));
+    memset(pmm_summary, 0xFF, sizeof(pmm_summary));
+    pmm_used_blocks = pmm_max_blocks;
+
+    for (uint32_t i = 0; i < pmm_max_blocks; i++)
+    {
+        pmm_pages[i].refcount = 1;
+        pmm_pages[i].flags = PG_RESERVED;
+        pmm_pages[i].zone = (i < PMM_ZONE_DMA_LIMIT / PMM_BLOCK_SIZE) ? PMM_ZONE_DMA : PMM_ZONE_NORMAL;
+        pmm_pages[i].owner = PAGE_OWNER_BOOT;
+        pmm_pages[i].private = 0;
+    }
+
+    for (uint32_t i = 0; i < pmm_region_count; i++)
+    {
+        pmm_region_t *region = &pmm_regions[i];
+        if (region->type != MULTIBOOT_MEMORY_AVAILABLE || region->base >= pmm_memory_size)
+            continue;
+
+        uint32_t start = pmm_align_up((uint32_t)region->base);
+        uint32_t end = pmm_clamp_addr(region->base + region->len) & ~(PMM_BLOCK_SIZE - 1);
+        if (start < end)
+            pmm_mark_unused_region(start, end - start);
+    }
+
+    pmm_mark_used_region(0, 0x100000);
+
+    uint32_t kernel_start = (uint32_t)&__kernel_physical_start;
+    uint32_t kernel_end = (uint32_t)&__kernel_physical_end;
+    uint32_t kernel_size = kernel_end - kernel_start;
+
+    serial_printf("PMM: Kernel physical start: 0x%x, end: 0x%x, size: %d bytes\n",
+                  kernel_start, kernel_end, kernel_size);
+
+    // Kernel image plus the multiboot info, memory map and modules behind it
+    pmm_mark_used_region(kernel_start, pmm_early_start - kernel_start);
+    pmm_mark_used_region((uint32_t)mboot_info, sizeof(multiboot_info_t));
+    if (mboot_info->flags & MULTIBOOT_INFO_MEM_MAP)
+        pmm_mark_used_region(mboot_info->mmap_addr, mboot_info->mmap_length);
+
+    if ((mboot_info->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO) && mboot_info->framebuffer_addr < pmm_memory_size)
+    {
+        pmm_mark_used_region((uint32_t)mboot_info->framebuffer_addr,
+                             mboot_info->framebuffer_pitch * mboot_info->framebuffer_height);
+    }
+
+    if (!pmm_zones_init())
+        return;
+
+    serial_printf("PMM: Initialized with %d blocks (%d MB top of RAM)\n",
+                  pmm_max_blocks, pmm_memory_size / (1024 * 1024));
+    serial_printf("PMM: Used blocks: %d\n", pmm_used_blocks);
+    serial_printf("PMM: Bitmap at 0x%x, boot allocations 0x%x-0x%x\n",
+                  (uint32_t)pmm_memory_map, pmm_early_start, pmm_early_next);
+    serial_printf("PMM: Page descriptors at 0x%x (%d bytes)\n",
+                  (uint32_t)pmm_pages, pmm_max_blocks * sizeof(page_t));
+    serial_printf("PMM: Free blocks: %d\n", pmm_max_blocks - pmm_used_blocks);
+
+    pmm_initialized = true;
+}
+
+uint32_t pmm_get_total_memory()
+{
+    return pmm_memory_size;
+}
+
+uint32_t pmm_get_max_blocks()
+{
+    return pmm_max_blocks;
+}
+
+void pmm_mark_used_region(uint32_t base, uint32_t size)
+{
+    uint32_t start_block = base / PMM_BLOCK_SIZE;
+    uint32_t num_blocks = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+
+    if (start_block >= pmm_max_blocks)
+        return;
+
+    if (pmm_mark_run_used(start_block, num_blocks) && pmm_initialized)
+        pmm_zones_reserve_range(start_block, num_blocks);
+
+    uint32_t end = (num_blocks > pmm_max_blocks - start_block) ? pmm_max_blocks : start_block + num_blocks;
+    for (uint32_t i = start_block; i < end; i++)
+    {
+        pmm_pages[i].flags |= PG_RESERVED;
+        pmm_pages[i].owner = PAGE_OWNER_BOOT;
+    }
+}
+
+void pmm_mark_unused_region(uint32_t base, uint32_t size)
+{
+    uint32_t start_block = base / PMM_BLOCK_SIZE;
+    uint32_t num_blocks = (size + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+
+    if (start_block < pmm_max_blocks)
+        pmm_release_run(start_block, num_blocks);
 }
 
-static void mark_block_used(uint32_t block)
+void *pmm_alloc_block()
 {
-    uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-    uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
-    
-    pmm_memory_map[byte_idx] |= (1 << bit_idx);
-    pmm_used_blocks++;
+    uint32_t block = PMM_NO_BLOCK;
+    if (pmm_used_blocks < pmm_max_blocks)
+        block = pmm_take_run(1, 0, pmm_max_blocks, true);
+
+    if (block == PMM_NO_BLOCK)
+    {
+        // Pages sitting in the zero pool are still free memory to everyone else
+        void *page = pmm_zero_pool_take();
+        if (!page)
+            page = cma_lend_block();
+        if (page)
+            return page;
+
+        serial_printf("PMM: Out of memory!\n");
+        return NULL;
+    }
+
+    return (void *)(block * PMM_BLOCK_SIZE);
 }
 
 void *pmm_alloc_contiguous(uint32_t num_blocks)
@@ -163,17 +819,13 @@ void *pmm_alloc_contiguous(uint32_t num_blocks)
         PMM_ERROR("Invalid block count: %d", num_blocks);
         return NULL;
     }
-    
-    int start_block = find_contiguous_free_blocks(num_blocks);
-    if (start_block < 0) {
+
+    uint32_t start_block = pmm_take_run(num_blocks, 0, pmm_max_blocks, true);
+    if (start_block == PMM_NO_BLOCK) {
         PMM_ERROR("No %d contiguous blocks available", num_blocks);
         return NULL;
     }
-    
-    for (uint32_t i = 0; i < num_blocks; i++) {
-        mark_block_used(start_block + i);
-    }
-    
+
     PMM_LOG("Allocated %d contiguous blocks starting at %d", num_blocks, start_block);
     return (void *)(start_block * PMM_BLOCK_SIZE);
 }
@@ -184,28 +836,22 @@ void pmm_free_contiguous(void *ptr, uint32_t num_blocks)
         PMM_ERROR("Invalid parameters to pmm_free_contiguous");
         return;
     }
-    
+
     uint32_t block = (uint32_t)ptr / PMM_BLOCK_SIZE;
     if (block + num_blocks > pmm_max_blocks) {
         PMM_ERROR("Block range out of bounds");
         return;
     }
-    
+
     for (uint32_t i = 0; i < num_blocks; i++) {
         if (pmm_is_block_free(block + i)) {
             PMM_ERROR("Double-free of block %d", block + i);
             return;
         }
     }
-    
-    for (uint32_t i = 0; i < num_blocks; i++) {
-        uint32_t byte_idx = (block + i) / PMM_BLOCKS_PER_BYTE;
-        uint32_t bit_idx = (block + i) % PMM_BLOCKS_PER_BYTE;
-        
-        pmm_memory_map[byte_idx] &= ~(1 << bit_idx);
-        pmm_used_blocks--;
-    }
-    
+
+    pmm_put_run(block, num_blocks);
+
     PMM_LOG("Freed %d contiguous blocks starting at %d", num_blocks, block);
 }
 
@@ -231,49 +877,25 @@ void *pmm_alloc_blocks(uint32_t num_blocks)
         return NULL;
     }
 
-    uint32_t consecutive = 0;
-    uint32_t start_block = 0;
-
-    uint32_t start = pmm_last_alloc;
-    uint32_t tries = 0;
-    const uint32_t max_tries = 2;
-
-    while (tries < max_tries) {
-        for (uint32_t block = start; block < pmm_max_blocks; block++) {
-            uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-            uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
-
-            if (!(pmm_memory_map[byte_idx] & (1 << bit_idx))) {
-                if (consecutive == 0)
-                    start_block = block;
-                consecutive++;
-                if (consecutive == num_blocks) {
-                    for (uint32_t i = start_block; i < start_block + num_blocks; i++) {
-                        uint32_t b_idx = i / PMM_BLOCKS_PER_BYTE;
-                        uint32_t bit = i % PMM_BLOCKS_PER_BYTE;
-                        pmm_memory_map[b_idx] |= (1 << bit);
-                        pmm_used_blocks++;
-                    }
-                    pmm_last_alloc = (start_block + num_blocks) % pmm_max_blocks;
-                    return (void *)(start_block * PMM_BLOCK_SIZE);
-                }
-            } else {
-                consecutive = 0;
-            }
-        }
-        start = 0;
-        tries++;
+    if (num_blocks == 1)
+        return pmm_alloc_block();
+
+    uint32_t start_block = pmm_take_run(num_blocks, 0, pmm_max_blocks, true);
+    if (start_block == PMM_NO_BLOCK) {
+        PMM_ERROR("Failed to find %d contiguous blocks", num_blocks);
+        return NULL;
     }
 
-    PMM_ERROR("Failed to find %d contiguous blocks", num_blocks);
-    return NULL;
+    return (void *)(start_block * PMM_BLOCK_SIZE);
 }
 
 void pmm_free_block(void *p)
 {
     if (p == NULL)
+    {
         serial_printf("PMM: Invalid free address (NULL)\n");
         return;
+    }
 
     uint32_t addr = (uint32_t)p;
     if (addr % PMM_BLOCK_SIZE != 0)
@@ -290,14 +912,16 @@ void pmm_free_block(void *p)
         return;
     }
 
-    uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-    uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
-
-    if (pmm_memory_map[byte_idx] & (1 << bit_idx))
+    if (pmm_test_block(block))
     {
-        pmm_memory_map[byte_idx] &= ~(1 << bit_idx);
-        pmm_used_blocks--;
-        serial_printf("PMM: Freed block at physical address 0x%x\n", addr);
+        if (pmm_pages[block].refcount > 1)
+        {
+            pmm_pages[block].refcount--;
+            return;
+        }
+        pmm_page_reset(&pmm_pages[block]);
+        pmm_clear_block(block);
+        pmm_zones_free_range(block, 1);
     }
     else
     {
@@ -319,10 +943,9 @@ void pmm_free_blocks(void *p, int num_blocks)
         return;
     }
 
-    for (int i = 0; i < num_blocks; i++)
-    {
-        pmm_free_block((char *)p + i * PMM_BLOCK_SIZE);
-    }
+    uint32_t in_use = pmm_put_run(start_block, num_blocks);
+    if (in_use != (uint32_t)num_blocks)
+        serial_printf("PMM: Double-free of %d blocks in range at 0x%x\n", num_blocks - in_use, addr);
 }
 
 bool pmm_is_block_free(uint32_t block)
@@ -331,9 +954,7 @@ bool pmm_is_block_free(uint32_t block)
     {
         return false;
     }
-    uint32_t byte_idx = block / PMM_BLOCKS_PER_BYTE;
-    uint32_t bit_idx = block % PMM_BLOCKS_PER_BYTE;
-    return !(pmm_memory_map[byte_idx] & (1 << bit_idx));
+    return !pmm_test_block(block);
 }
 
 void *pmm_alloc_blocks_in_range(uint32_t num_blocks, uint32_t start_addr, uint32_t end_addr)
@@ -351,41 +972,131 @@ void *pmm_alloc_blocks_in_range(uint32_t num_blocks, uint32_t start_addr, uint32
     uint32_t start_block = start_addr / PMM_BLOCK_SIZE;
     uint32_t end_block = end_addr / PMM_BLOCK_SIZE;
 
-    // Debug output
-    serial_printf("PMM: Searching for %d blocks between blocks %d-%d\n", 
-                 num_blocks, start_block, end_block);
+    uint32_t first_block = pmm_take_run(num_blocks, start_block, end_block, false);
+    if (first_block == PMM_NO_BLOCK)
+    {
+        serial_printf("PMM: No %d contiguous blocks available in range 0x%x - 0x%x\n",
+                     num_blocks, start_addr, end_addr);
+        return NULL;
+    }
 
-    uint32_t consecutive = 0;
-    uint32_t first_block = 0;
+    return (void *)(first_block * PMM_BLOCK_SIZE);
+}
 
-    for (uint32_t block = start_block; block < end_block; block++)
+void *pmm_alloc_zone_blocks(pmm_zone_id_t zone_id, uint32_t num_blocks)
+{
+    if (zone_id >= PMM_ZONE_COUNT || !validate_allocation_request(num_blocks))
+        return NULL;
+
+    pmm_zone_t *zone = &pmm_zones[zone_id];
+    uint32_t block = pmm_zone_take(zone, num_blocks, zone->start_block, zone->end_block);
+    if (block == PMM_NO_BLOCK)
     {
-        if (pmm_is_block_free(block))
-        {
-            if (consecutive == 0)
-                first_block = block;
-            consecutive++;
-            if (consecutive == num_blocks)
-            {
-                // Mark the blocks as used
-                for (uint32_t i = 0; i < num_blocks; i++)
-                {
-                    uint32_t curr_block = first_block + i;
-                    uint32_t byte_idx = curr_block / PMM_BLOCKS_PER_BYTE;
-                    uint32_t bit_idx = curr_block % PMM_BLOCKS_PER_BYTE;
-                    pmm_memory_map[byte_idx] |= (1 << bit_idx);
-                }
-                pmm_used_blocks += num_blocks;
-                return (void *)(first_block * PMM_BLOCK_SIZE);
-            }
-        }
-        else
-        {
-            consecutive = 0;
-        }
+        PMM_ERROR("No %d contiguous blocks in zone %s", num_blocks, zone->name);
+        return NULL;
+    }
+
+    pmm_zone_commit(zone, block, num_blocks);
+    return (void *)(block * PMM_BLOCK_SIZE);
+}
+
+const pmm_zone_t *pmm_get_zone(pmm_zone_id_t zone_id)
+{
+    if (zone_id >= PMM_ZONE_COUNT)
+        return NULL;
+    return &pmm_zones[zone_id];
+}
+
+uint32_t pmm_get_boot_end()
+{
+    return pmm_early_next;
+}
+
+page_t *pmm_pfn_to_page(uint32_t pfn)
+{
+    if (!pmm_pages || pfn >= pmm_max_blocks)
+        return NULL;
+    return &pmm_pages[pfn];
+}
+
+page_t *pmm_phys_to_page(uint32_t phys_addr)
+{
+    return pmm_pfn_to_page(phys_addr / PMM_BLOCK_SIZE);
+}
+
+uint32_t pmm_page_to_pfn(const page_t *page)
+{
+    return page - pmm_pages;
+}
+
+uint32_t pmm_page_to_phys(const page_t *page)
+{
+    return pmm_page_to_pfn(page) * PMM_BLOCK_SIZE;
+}
+
+void pmm_page_get(page_t *page)
+{
+    if (!page || page->refcount == 0)
+    {
+        PMM_ERROR("Reference taken on free page %d", page ? pmm_page_to_pfn(page) : 0);
+        return;
+    }
+    if (page->refcount == UINT16_MAX)
+    {
+        PMM_ERROR("Refcount overflow on page %d", pmm_page_to_pfn(page));
+        return;
+    }
+    page->refcount++;
+}
+
+void pmm_page_put(page_t *page)
+{
+    if (!page || page->refcount == 0)
+    {
+        PMM_ERROR("Reference dropped on free page %d", page ? pmm_page_to_pfn(page) : 0);
+        return;
     }
+    pmm_put_run(pmm_page_to_pfn(page), 1);
+}
 
-    serial_printf("PMM: No %d contiguous blocks available in range 0x%x - 0x%x\n",
-                 num_blocks, start_addr, end_addr);
-    return NULL;
+void pmm_set_owner(void *p, uint32_t num_blocks, page_owner_t owner)
+{
+    uint32_t block = (uint32_t)p / PMM_BLOCK_SIZE;
+    if (!pmm_pages || block >= pmm_max_blocks)
+        return;
+    if (num_blocks > pmm_max_blocks - block)
+        num_blocks = pmm_max_blocks - block;
+
+    for (uint32_t i = 0; i < num_blocks; i++)
+        pmm_pages[block + i].owner = owner;
+}
+
+const char *pmm_owner_name(page_owner_t owner)
+{
+    static const char *names[PAGE_OWNER_COUNT] = {
+        [PAGE_OWNER_NONE] = "none",
+        [PAGE_OWNER_BOOT] = "boot",
+        [PAGE_OWNER_KERNEL] = "kernel",
+        [PAGE_OWNER_PAGE_TABLE] = "pagetable",
+        [PAGE_OWNER_HEAP] = "heap",
+        [PAGE_OWNER_DMA] = "dma",
+        [PAGE_OWNER_FRAMEBUFFER] = "framebuffer",
+        [PAGE_OWNER_FAT] = "fat",
+        [PAGE_OWNER_NET] = "net",
+        [PAGE_OWNER_ZERO_POOL] = "zeropool",
+        [PAGE_OWNER_CMA] = "cma",
+        [PAGE_OWNER_SLAB] = "slab",
+    };
+    return owner < PAGE_OWNER_COUNT ? names[owner] : "?";
+}
+
+// Number of used blocks per owner
+void pmm_count_owners(uint32_t counts[PAGE_OWNER_COUNT])
+{
+    memset(counts, 0, PAGE_OWNER_COUNT * sizeof(uint32_t));
+    for (uint32_t i = 0; pmm_pages && i < pmm_max_blocks; i++)
+    {
+        if (pmm_pages[i].refcount && pmm_pages[i].owner < PAGE_OWNER_COUNT)
+            counts[pmm_pages[i].owner]++;
+    }
 }
@@ -0,0 +1,187 @@
+#include "pmm.h"
+#include "paging.h"
+#include "vmm.h"
+#include "cma.h"
+#include "io.h"
+#include "string.h"
+#include "serial.h"
+
+/*
+ * Pool of physical pages zeroed ahead of time. The idle loop tops it up
+ * through the physmap (or a fixmap slot for frames above it), so pmm_alloc_zeroed() on a hot path
+ * (demand-zero faults, buffer growth) only pops a frame. Interrupt handlers
+ * may allocate too, so pool and allocator calls run with interrupts off;
+ * the zeroing itself does not.
+ */
+pmm_zero_stats_t pmm_zero_stats;
+
+static uint32_t pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static bool pmm_zero_ready = false;
+
+static void pmm_zero_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    pmm_zero_stats.nt_stores = (edx & (1 << 26)) != 0;
+
+    pmm_zero_ready = true;
+    serial_printf("PMM: zero pool of %d pages, %s stores\n", PMM_ZERO_POOL_SIZE,
+                  pmm_zero_stats.nt_stores ? "non-temporal" : "cached");
+}
+
+// movnti keeps pages that will not be touched for a while out of the cache
+static void pmm_zero_nt(uint32_t *page)
+{
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i += 4)
+    {
+        __asm__ volatile("movnti %1, 0(%0)\n"
+                         "movnti %1, 4(%0)\n"
+                         "movnti %1, 8(%0)\n"
+                         "movnti %1, 12(%0)" :: "r"(page + i), "r"(0) : "memory");
+    }
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+static bool pmm_zero_frame(uint32_t frame, fixmap_slot_t slot, bool nt)
+{
+    // Before paging every frame is reachable at its physical address
+    if (!paging_active)
+    {
+        memset((void *)frame, 0, PAGE_SIZE);
+        return true;
+    }
+
+    bool fixmapped = !physmap_covers(frame, PAGE_SIZE);
+    uint32_t *page = fixmapped ? fixmap_set(slot, frame, PAGE_PRESENT | PAGE_WRITABLE)
+                               : (uint32_t *)phys_to_virt(frame);
+    if (!page)
+        return false;
+
+    if (nt)
+        pmm_zero_nt(page);
+    else
+        memset(page, 0, PAGE_SIZE);
+
+    if (fixmapped)
+        fixmap_clear(slot);
+    return true;
+}
+
+void *pmm_zero_pool_take()
+{
+    uint32_t flags = irq_save();
+    void *page = NULL;
+    if (pmm_zero_stats.pages)
+        page = (void *)pmm_zero_pool[--pmm_zero_stats.pages];
+    irq_restore(flags);
+
+    if (page)
+        pmm_set_owner(page, 1, PAGE_OWNER_NONE);
+    return page;
+}
+
+bool pmm_zero_pool_reclaim(void *page)
+{
+    bool found = false;
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < pmm_zero_stats.pages; i++)
+    {
+        if (pmm_zero_pool[i] == (uint32_t)page)
+        {
+            pmm_zero_pool[i] = pmm_zero_pool[--pmm_zero_stats.pages];
+            found = true;
+            break;
+        }
+    }
+    irq_restore(flags);
+    return found;
+}
+
+void *pmm_alloc_zeroed()
+{
+    if (!pmm_zero_ready && paging_active)
+        pmm_zero_init();
+
+    void *page = pmm_zero_pool_take();
+    if (page)
+    {
+        pmm_zero_stats.hits++;
+        return page;
+    }
+
+    pmm_zero_stats.misses++;
+    page = pmm_alloc_block();
+    if (!page)
+        return NULL;
+
+    // The caller is about to use it, so zero through the cache
+    uint32_t flags = irq_save();
+    bool zeroed = pmm_zero_frame((uint32_t)page, FIX_ZERO_SYNC, false);
+    irq_restore(flags);
+
+    if (!zeroed)
+    {
+        pmm_free_block(page);
+        return NULL;
+    }
+    return page;
+}
+
+// Only take pages for the pool while the zone has plenty left
+static bool pmm_zero_can_grow(pmm_zone_id_t *zone_id)
+{
+    const pmm_zone_t *zone = pmm_get_zone(PMM_ZONE_NORMAL);
+    *zone_id = PMM_ZONE_NORMAL;
+    if (zone->end_block == zone->start_block)
+    {
+        zone = pmm_get_zone(PMM_ZONE_DMA);
+        *zone_id = PMM_ZONE_DMA;
+    }
+    return zone->area.free_blocks > zone->watermark_high + PMM_ZERO_POOL_SIZE;
+}
+
+uint32_t pmm_zero_pool_refill(uint32_t max_pages)
+{
+    if (!paging_active)
+        return 0;
+    if (!pmm_zero_ready)
+        pmm_zero_init();
+
+    uint32_t added = 0;
+    while (added < max_pages && pmm_zero_stats.pages < PMM_ZERO_POOL_SIZE)
+    {
+        pmm_zone_id_t zone_id;
+        uint32_t flags = irq_save();
+        // Idle CMA blocks first: they can be taken back while they sit here
+        void *page = cma_lend_block();
+        if (!page && pmm_zero_can_grow(&zone_id))
+            page = pmm_alloc_zone_blocks(zone_id, 1);
+        irq_restore(flags);
+        if (!page)
+            break;
+
+        if (!pmm_zero_frame((uint32_t)page, FIX_ZERO_IDLE, pmm_zero_stats.nt_stores))
+        {
+            pmm_free_block(page);
+            break;
+        }
+
+        pmm_set_owner(page, 1, PAGE_OWNER_ZERO_POOL);
+        flags = irq_save();
+        if (pmm_zero_stats.pages < PMM_ZERO_POOL_SIZE)
+        {
+            pmm_zero_pool[pmm_zero_stats.pages++] = (uint32_t)page;
+            page = NULL;
+        }
+        irq_restore(flags);
+
+        if (page)
+        {
+            pmm_free_block(page);
+            break;
+        }
+        pmm_zero_stats.refilled++;
+        added++;
+    }
+    return added;
+}
@@ -0,0 +1,147 @@
+#include "sizeclass.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "paging.h"
+#include "io.h"
+#include "serial.h"
+
+sizeclass_stats_t sizeclass_stats;
+
+#define SIZECLASS(bytes) {.size = bytes}
+
+static sizeclass_t sizeclasses[SIZECLASS_COUNT] = {
+    SIZECLASS(16), SIZECLASS(32), SIZECLASS(48), SIZECLASS(64),
+    SIZECLASS(80), SIZECLASS(96), SIZECLASS(112), SIZECLASS(128),
+    SIZECLASS(144), SIZECLASS(160), SIZECLASS(176), SIZECLASS(192),
+    SIZECLASS(208), SIZECLASS(224), SIZECLASS(240), SIZECLASS(256),
+    SIZECLASS(384), SIZECLASS(512), SIZECLASS(768), SIZECLASS(1024),
+    SIZECLASS(1536), SIZECLASS(2048),
+};
+
+// Class of every window page, valid below sizeclass_stats.pages_used
+static uint8_t sizeclass_page_class[SIZECLASS_WINDOW_PAGES];
+
+static inline uint32_t sizeclass_page(const void *ptr)
+{
+    return ((uint32_t)ptr - sizeclass_stats.window) / PAGE_SIZE;
+}
+
+bool sizeclass_owns(const void *ptr)
+{
+    return sizeclass_stats.window && sizeclass_page(ptr) < sizeclass_stats.pages_used;
+}
+
+uint32_t sizeclass_size(const void *ptr)
+{
+    return sizeclasses[sizeclass_page_class[sizeclass_page(ptr)]].size;
+}
+
+// Map the next pages of the window and thread them onto the class free list
+static bool sizeclass_refill(int index)
+{
+    sizeclass_t *class = &sizeclasses[index];
+
+    if (!sizeclass_stats.window)
+    {
+        sizeclass_stats.window = vmm_reserve_virtual(SIZECLASS_WINDOW_PAGES);
+        if (!sizeclass_stats.window)
+        {
+            serial_printf("SIZECLASS: Cannot reserve a %d page window\n", SIZECLASS_WINDOW_PAGES);
+            return false;
+        }
+    }
+
+    uint32_t objects = PAGE_SIZE / class->size;
+    if (objects < SIZECLASS_REFILL_MIN)
+        objects = SIZECLASS_REFILL_MIN;
+    uint32_t pages = (objects * class->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (sizeclass_stats.pages_used + pages > SIZECLASS_WINDOW_PAGES)
+        return false;
+
+    uint32_t virt = sizeclass_stats.window + sizeclass_stats.pages_used * PAGE_SIZE;
+    paging_batch_begin();
+    uint32_t mapped = 0;
+    for (; mapped < pages; mapped++)
+    {
+        void *frame = pmm_alloc_block();
+        if (!frame)
+            break;
+        if (!paging_map_page((uint32_t)frame, virt + mapped * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE))
+        {
+            pmm_free_block(frame);
+            break;
+        }
+        pmm_set_owner(frame, 1, PAGE_OWNER_HEAP);
+    }
+    paging_batch_end();
+
+    if (mapped < pages)
+    {
+        for (uint32_t i = 0; i < mapped; i++)
+        {
+            uint32_t frame = virt_to_phys((void *)(virt + i * PAGE_SIZE));
+            paging_unmap_page(virt + i * PAGE_SIZE);
+            pmm_free_block((void *)frame);
+        }
+        return false;
+    }
+
+    for (uint32_t i = 0; i < pages; i++)
+        sizeclass_page_class[sizeclass_stats.pages_used + i] = index;
+    sizeclass_stats.pages_used += pages;
+
+    // Push in reverse so the list hands objects out in address order
+    objects = pages * PAGE_SIZE / class->size;
+    for (uint32_t i = objects; i-- > 0;)
+    {
+        void **object = (void **)(virt + i * class->size);
+        *object = class->free_list;
+        class->free_list = object;
+    }
+    class->free += objects;
+    class->pages += pages;
+    class->refills++;
+    return true;
+}
+
+void *sizeclass_alloc(size_t size)
+{
+    int index = sizeclass_index(size);
+    sizeclass_t *class = &sizeclasses[index];
+
+    uint32_t flags = irq_save();
+    if (!class->free_list && !sizeclass_refill(index))
+    {
+        sizeclass_stats.fallbacks++;
+        irq_restore(flags);
+        return NULL;
+    }
+
+    void **object = class->free_list;
+    class->free_list = *object;
+    class->free--;
+    class->in_use++;
+    class->allocs++;
+    irq_restore(flags);
+    return object;
+}
+
+void sizeclass_free(void *ptr)
+{
+    sizeclass_t *class = &sizeclasses[sizeclass_page_class[sizeclass_page(ptr)]];
+
+    uint32_t flags = irq_save();
+    *(void **)ptr = class->free_list;
+    class->free_list = ptr;
+    class->free++;
+    class->in_use--;
+    class->frees++;
+    irq_restore(flags);
+}
+
+const sizeclass_t *sizeclass_get(int index)
+{
+    if (index < 0 || index >= SIZECLASS_COUNT)
+        return NULL;
+    return &sizeclasses[index];
+}
@@ -0,0 +1,324 @@
+#include "slab.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "paging.h"
+#include "io.h"
+#include "string.h"
+#include "serial.h"
+
+static kmem_cache_t kmem_caches[SLAB_MAX_CACHES];
+
+static inline uint32_t slab_bytes(const kmem_cache_t *cache)
+{
+    return PAGE_SIZE << cache->order;
+}
+
+static inline void **slab_free_ptr(const kmem_cache_t *cache, void *object)
+{
+    return (void **)((uint8_t *)object + cache->free_offset);
+}
+
+static inline uint32_t slab_header_size(uint32_t align)
+{
+    return (sizeof(slab_t) + align - 1) & ~(align - 1);
+}
+
+// Pick the smallest slab that wastes at most 1/8 of itself and holds SLAB_MIN_OBJECTS
+static void slab_choose_order(kmem_cache_t *cache)
+{
+    uint32_t header = slab_header_size(cache->align);
+
+    for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++)
+    {
+        uint32_t bytes = PAGE_SIZE << order;
+        if (bytes < header + cache->size)
+            continue;
+
+        uint32_t objects = (bytes - header) / cache->size;
+        uint32_t waste = bytes - header - objects * cache->size;
+        cache->order = order;
+        cache->objects_per_slab = objects;
+        if (waste * 8 <= bytes && objects >= SLAB_MIN_OBJECTS)
+            break;
+    }
+
+    uint32_t leftover = slab_bytes(cache) - header - cache->objects_per_slab * cache->size;
+    uint32_t step = cache->align > SLAB_CACHE_LINE ? cache->align : SLAB_CACHE_LINE;
+    cache->colour_max = leftover / step;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, uint32_t flags, kmem_ctor_t ctor)
+{
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if ((flags & SLAB_HWCACHE_ALIGN) && align < SLAB_CACHE_LINE)
+        align = SLAB_CACHE_LINE;
+
+    // Objects with a constructor keep their contents while free, so the link goes after them
+    uint32_t free_offset = ctor ? (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1) : 0;
+    uint32_t stride = ((ctor ? free_offset + sizeof(void *) : size) + align - 1) & ~(align - 1);
+    if (slab_header_size(align) + stride > (PAGE_SIZE << SLAB_MAX_ORDER))
+    {
+        serial_printf("SLAB: %s objects of %d bytes are too large\n", name, size);
+        return NULL;
+    }
+
+    uint32_t flags_irq = irq_save();
+    kmem_cache_t *cache = NULL;
+    for (int i = 0; i < SLAB_MAX_CACHES; i++)
+    {
+        if (!kmem_caches[i].active)
+        {
+            cache = &kmem_caches[i];
+            memset(cache, 0, sizeof(kmem_cache_t));
+            cache->active = true;
+            break;
+        }
+    }
+    irq_restore(flags_irq);
+
+    if (!cache)
+    {
+        serial_printf("SLAB: Out of caches for %s\n", name);
+        return NULL;
+    }
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->size = stride;
+    cache->align = align;
+    cache->free_offset = free_offset;
+    cache->ctor = ctor;
+    slab_choose_order(cache);
+    return cache;
+}
+
+static void slab_list_add(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_del(slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static slab_t *slab_grow(kmem_cache_t *cache)
+{
+    uint32_t pages = 1u << cache->order;
+    uint32_t virt = vmm_reserve_virtual_aligned(pages, slab_bytes(cache));
+    if (!virt)
+        return NULL;
+
+    paging_batch_begin();
+    uint32_t mapped = 0;
+    for (; mapped < pages; mapped++)
+    {
+        void *frame = pmm_alloc_block();
+        if (!frame)
+            break;
+        if (!paging_map_page((uint32_t)frame, virt + mapped * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE))
+        {
+            pmm_free_block(frame);
+            break;
+        }
+        pmm_set_owner(frame, 1, PAGE_OWNER_SLAB);
+    }
+    paging_batch_end();
+
+    if (mapped < pages)
+    {
+        for (uint32_t i = 0; i < mapped; i++)
+        {
+            uint32_t frame = virt_to_phys((void *)(virt + i * PAGE_SIZE));
+            paging_unmap_page(virt + i * PAGE_SIZE);
+            pmm_free_block((void *)frame);
+        }
+        vmm_release_virtual(virt, pages);
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t *)virt;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+    slab->colour = slab_header_size(cache->align) + cache->colour_next * (cache->align > SLAB_CACHE_LINE ? cache->align : SLAB_CACHE_LINE);
+    cache->colour_next = cache->colour_next >= cache->colour_max ? 0 : cache->colour_next + 1;
+
+    // Thread the free list in address order so fresh allocations walk the slab forwards
+    uint8_t *objects = (uint8_t *)virt + slab->colour;
+    for (uint32_t i = cache->objects_per_slab; i-- > 0;)
+    {
+        void *object = objects + i * cache->size;
+        if (cache->ctor)
+            cache->ctor(object);
+        *slab_free_ptr(cache, object) = slab->free_list;
+        slab->free_list = object;
+    }
+
+    cache->slabs++;
+    cache->grows++;
+    return slab;
+}
+
+static void slab_release(kmem_cache_t *cache, slab_t *slab)
+{
+    uint32_t virt = (uint32_t)slab;
+    uint32_t pages = 1u << cache->order;
+
+    paging_batch_begin();
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        uint32_t frame = virt_to_phys((void *)(virt + i * PAGE_SIZE));
+        paging_unmap_page(virt + i * PAGE_SIZE);
+        pmm_free_block((void *)frame);
+    }
+    paging_batch_end();
+
+    vmm_release_virtual(virt, pages);
+    cache->slabs--;
+    cache->shrinks++;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    if (!cache || !cache->active)
+        return NULL;
+
+    uint32_t flags = irq_save();
+    slab_t *slab = cache->slabs_partial;
+    if (!slab && cache->slabs_empty)
+    {
+        slab = cache->slabs_empty;
+        slab_list_del(&cache->slabs_empty, slab);
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+    if (!slab)
+    {
+        slab = slab_grow(cache);
+        if (!slab)
+        {
+            cache->failures++;
+            irq_restore(flags);
+            serial_printf("SLAB: Cannot grow %s\n", cache->name);
+            return NULL;
+        }
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *slab_free_ptr(cache, object);
+    if (++slab->in_use == cache->objects_per_slab)
+    {
+        slab_list_del(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_full, slab);
+    }
+
+    cache->active_objects++;
+    cache->allocs++;
+    irq_restore(flags);
+    return object;
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cache)
+{
+    void *object = kmem_cache_alloc(cache);
+    if (object)
+        memset(object, 0, cache->object_size);
+    return object;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+    if (!cache || !object)
+        return;
+
+    slab_t *slab = (slab_t *)((uint32_t)object & ~(slab_bytes(cache) - 1));
+    if (slab->cache != cache)
+    {
+        serial_printf("SLAB: 0x%x does not belong to %s\n", (uint32_t)object, cache->name);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    if (slab->in_use == cache->objects_per_slab)
+    {
+        slab_list_del(&cache->slabs_full, slab);
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+
+    *slab_free_ptr(cache, object) = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->active_objects--;
+    cache->frees++;
+
+    if (slab->in_use == 0)
+    {
+        slab_list_del(&cache->slabs_partial, slab);
+        // Keep one empty slab around so a cache that hovers at a slab boundary does not thrash
+        if (cache->slabs_empty)
+            slab_release(cache, slab);
+        else
+            slab_list_add(&cache->slabs_empty, slab);
+    }
+    irq_restore(flags);
+}
+
+uint32_t kmem_cache_shrink(kmem_cache_t *cache)
+{
+    if (!cache)
+        return 0;
+
+    uint32_t freed = 0;
+    uint32_t flags = irq_save();
+    while (cache->slabs_empty)
+    {
+        slab_t *slab = cache->slabs_empty;
+        slab_list_del(&cache->slabs_empty, slab);
+        slab_release(cache, slab);
+        freed += 1u << cache->order;
+    }
+    irq_restore(flags);
+    return freed;
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (!cache || !cache->active)
+        return;
+    if (cache->active_objects)
+        serial_printf("SLAB: Destroying %s with %d objects in use\n", cache->name, cache->active_objects);
+
+    uint32_t flags = irq_save();
+    slab_t **lists[3] = {&cache->slabs_full, &cache->slabs_partial, &cache->slabs_empty};
+    for (int i = 0; i < 3; i++)
+    {
+        while (*lists[i])
+        {
+            slab_t *slab = *lists[i];
+            slab_list_del(lists[i], slab);
+            slab_release(cache, slab);
+        }
+    }
+    cache->active = false;
+    irq_restore(flags);
+}
+
+const kmem_cache_t *kmem_get_cache(int index)
+{
+    if (index < 0 || index >= SLAB_MAX_CACHES || !kmem_caches[index].active)
+        return NULL;
+    return &kmem_caches[index];
+}
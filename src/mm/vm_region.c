@@ -0,0 +1,349 @@
+#include "vm_region.h"
+#include "vmm.h"
+#include "paging.h"
+#include "pmm.h"
+#include "string.h"
+#include "serial.h"
+
+vm_fault_stats_t vm_fault_stats;
+
+static vm_region_t vm_region_pool[VM_MAX_REGIONS];
+static vm_region_t *vm_region_free_list = NULL;
+static bool vm_region_pool_ready = false;
+static rb_tree_t vm_regions = {NULL, NULL};
+
+// Read faults on anonymous memory map this frame read-only; the first write replaces it
+static uint32_t vm_zero_frame = 0;
+
+static vm_region_t *vm_region_get()
+{
+    if (!vm_region_pool_ready)
+    {
+        for (int i = 0; i < VM_MAX_REGIONS; i++)
+        {
+            vm_region_pool[i].next_free = vm_region_free_list;
+            vm_region_free_list = &vm_region_pool[i];
+        }
+        vm_region_pool_ready = true;
+    }
+
+    vm_region_t *region = vm_region_free_list;
+    if (region)
+    {
+        vm_region_free_list = region->next_free;
+        memset(region, 0, sizeof(vm_region_t));
+    }
+    return region;
+}
+
+static void vm_region_put(vm_region_t *region)
+{
+    region->next_free = vm_region_free_list;
+    vm_region_free_list = region;
+}
+
+static vm_region_t *vm_region_create(const char *name, vm_region_type_t type, size_t size, uint32_t flags)
+{
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 0)
+        return NULL;
+
+    vm_region_t *region = vm_region_get();
+    if (!region)
+    {
+        serial_printf("VMM: Out of region descriptors for %s\n", name);
+        return NULL;
+    }
+
+    uint32_t start = vmm_reserve_virtual(pages);
+    if (!start)
+    {
+        serial_printf("VMM: No %d virtual pages for region %s\n", pages, name);
+        vm_region_put(region);
+        return NULL;
+    }
+
+    region->name = name;
+    region->type = type;
+    region->start = start;
+    region->end = start + pages * PAGE_SIZE;
+    region->flags = flags | PAGE_PRESENT;
+    region->owner = PAGE_OWNER_KERNEL;
+
+    rb_node_t **link = &vm_regions.root;
+    rb_node_t *parent = NULL;
+    while (*link)
+    {
+        parent = *link;
+        link = (start < rb_entry(parent, vm_region_t, node)->start) ? &parent->left : &parent->right;
+    }
+    rb_insert(&vm_regions, &region->node, parent, link);
+    return region;
+}
+
+void *vm_region_create_anon(const char *name, size_t size, uint32_t flags, page_owner_t owner)
+{
+    vm_region_t *region = vm_region_create(name, VM_REGION_ANON, size, flags);
+    if (!region)
+        return NULL;
+
+    region->owner = owner;
+    return (void *)region->start;
+}
+
+void *vm_region_create_mmio(const char *name, uint32_t phys, size_t size, uint32_t flags)
+{
+    // Keep the page offset so the returned pointer lands on `phys`
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    vm_region_t *region = vm_region_create(name, VM_REGION_MMIO, size + offset, flags);
+    if (!region)
+        return NULL;
+
+    region->phys = phys - offset;
+    return (void *)(region->start + offset);
+}
+
+void *vm_region_create_file(const char *name, size_t size, uint32_t data_size, uint32_t flags,
+                            vm_region_fill_t fill, const void *priv, size_t priv_size)
+{
+    if (!fill || priv_size > VM_REGION_PRIV || data_size > size)
+        return NULL;
+
+    vm_region_t *region = vm_region_create(name, VM_REGION_FILE, size, flags);
+    if (!region)
+        return NULL;
+
+    region->size = data_size;
+    region->fill = fill;
+    if (priv)
+        memcpy(region->priv, priv, priv_size);
+    return (void *)region->start;
+}
+
+vm_region_t *vm_region_find(uint32_t addr)
+{
+    rb_node_t *node = vm_regions.root;
+    vm_region_t *found = NULL;
+
+    while (node)
+    {
+        vm_region_t *region = rb_entry(node, vm_region_t, node);
+        if (region->start <= addr)
+        {
+            found = region;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+    return (found && addr < found->end) ? found : NULL;
+}
+
+void vm_region_destroy(void *addr)
+{
+    vm_region_t *region = vm_region_find((uint32_t)addr);
+    if (!region)
+    {
+        serial_printf("VMM: No region at 0x%x\n", (uint32_t)addr);
+        return;
+    }
+
+    paging_batch_begin();
+    if (region->type != VM_REGION_MMIO)
+    {
+        for (uint32_t page = region->start; page < region->end; page += PAGE_SIZE)
+        {
+            uint32_t entry = paging_get_entry(page);
+            if (!(entry & PAGE_PRESENT))
+                continue;
+
+            uint32_t frame = entry & ~(PAGE_SIZE - 1);
+            paging_unmap_page(page);
+            if (frame != vm_zero_frame)
+                pmm_free_block((void *)frame);
+        }
+    }
+    paging_unmap_range(region->start, region->end - region->start);
+    paging_batch_end();
+
+    rb_erase(&vm_regions, &region->node);
+    vmm_release_virtual(region->start, (region->end - region->start) / PAGE_SIZE);
+    vm_region_put(region);
+}
+
+// A fresh frame mapped writable at `page`, or 0
+static uint32_t vm_region_new_frame(vm_region_t *region, uint32_t page, bool zeroed)
+{
+    void *frame = zeroed ? pmm_alloc_zeroed() : pmm_alloc_block();
+    if (!frame)
+    {
+        serial_printf("VMM: Out of memory resolving fault in %s at 0x%x\n", region->name, page);
+        return 0;
+    }
+
+    if (!paging_map_page((uint32_t)frame, page, region->flags | PAGE_WRITABLE))
+    {
+        pmm_free_block(frame);
+        return 0;
+    }
+
+    pmm_set_owner(frame, 1, region->owner);
+    region->resident++;
+    return (uint32_t)frame;
+}
+
+static bool vm_region_map_zero(vm_region_t *region, uint32_t page)
+{
+    if (!vm_zero_frame)
+    {
+        uint32_t frame = vm_region_new_frame(region, page, true);
+        if (!frame)
+            return false;
+
+        pmm_set_owner((void *)frame, 1, PAGE_OWNER_KERNEL);
+        pmm_page_get(pmm_phys_to_page(frame)); // never freed
+        region->resident--;
+        vm_zero_frame = frame;
+    }
+
+    // Neighbouring untouched pages are likely to be read next (e.g. a full copy of a buffer)
+    uint32_t around = page & ~(VM_FAULT_AROUND * PAGE_SIZE - 1);
+    uint32_t flags = region->flags & ~PAGE_WRITABLE;
+
+    paging_batch_begin();
+    for (uint32_t addr = around; addr < around + VM_FAULT_AROUND * PAGE_SIZE; addr += PAGE_SIZE)
+    {
+        if (addr < region->start || addr >= region->end)
+            continue;
+        if (addr != page && (paging_get_entry(addr) & PAGE_PRESENT))
+            continue;
+        if (!paging_map_page(vm_zero_frame, addr, flags))
+            break;
+        vm_fault_stats.zero_maps++;
+    }
+    paging_batch_end();
+    return (paging_get_entry(page) & PAGE_PRESENT) != 0;
+}
+
+static bool vm_region_fault_anon(vm_region_t *region, uint32_t page, uint32_t err_code)
+{
+    if (!(err_code & PF_WRITE))
+    {
+        // Reading a page that is already mapped cannot fault
+        return !(err_code & PF_PRESENT) && vm_region_map_zero(region, page);
+    }
+
+    if (!(region->flags & PAGE_WRITABLE))
+        return false;
+
+    // A write to a missing page, or to the zero page standing in for it
+    if ((err_code & PF_PRESENT) && (paging_get_entry(page) & ~(PAGE_SIZE - 1)) != vm_zero_frame)
+        return false;
+
+    if (!vm_region_new_frame(region, page, true))
+        return false;
+
+    vm_fault_stats.zero_fills++;
+    return true;
+}
+
+static bool vm_region_fault_mmio(vm_region_t *region, uint32_t page, uint32_t err_code)
+{
+    if (err_code & PF_PRESENT)
+        return false;
+
+    // Map the whole 4MB slot around the fault, clipped to the region
+    uint32_t start = page & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t end = start + LARGE_PAGE_SIZE;
+    if (start < region->start)
+        start = region->start;
+    if (end > region->end || end < start)
+        end = region->end;
+
+    if (!paging_map_range(region->phys + (start - region->start), start, end - start, region->flags))
+        return false;
+
+    vm_fault_stats.mmio_maps++;
+    return true;
+}
+
+static bool vm_region_fault_file(vm_region_t *region, uint32_t page, uint32_t err_code)
+{
+    if (err_code & PF_PRESENT)
+        return false;
+
+    uint32_t frame = vm_region_new_frame(region, page, false);
+    if (!frame)
+        return false;
+
+    uint32_t offset = page - region->start;
+    uint32_t want = (offset < region->size) ? region->size - offset : 0;
+    if (want > PAGE_SIZE)
+        want = PAGE_SIZE;
+
+    uint32_t filled = want ? region->fill(region, offset, (void *)page, want) : 0;
+    if (filled > want)
+        filled = want;
+    memset((uint8_t *)page + filled, 0, PAGE_SIZE - filled);
+
+    // Drop write access now that the contents are in place, unless the region has it
+    if (!(region->flags & PAGE_WRITABLE))
+        paging_map_page(frame, page, region->flags);
+
+    vm_fault_stats.file_fills++;
+    return true;
+}
+
+bool vm_region_handle_fault(uint32_t addr, uint32_t err_code)
+{
+    vm_region_t *region = vm_region_find(addr);
+    if (!region || (err_code & PF_USER))
+    {
+        vm_fault_stats.unresolved++;
+        return false;
+    }
+
+    uint32_t page = addr & ~(PAGE_SIZE - 1);
+    bool resolved = false;
+
+    switch (region->type)
+    {
+    case VM_REGION_ANON:
+        resolved = vm_region_fault_anon(region, page, err_code);
+        break;
+    case VM_REGION_MMIO:
+        resolved = vm_region_fault_mmio(region, page, err_code);
+        break;
+    case VM_REGION_FILE:
+        resolved = vm_region_fault_file(region, page, err_code);
+        break;
+    }
+
+    if (!resolved)
+    {
+        serial_printf("VMM: Unresolved fault in %s at 0x%x (err 0x%x)\n", region->name, addr, err_code);
+        vm_fault_stats.unresolved++;
+        return false;
+    }
+
+    region->faults++;
+    vm_fault_stats.faults++;
+    return true;
+}
+
+void vm_region_print_stats()
+{
+    serial_printf("VMM: %d faults (%d zero maps, %d zero fills, %d mmio, %d file, %d unresolved)\n",
+                  vm_fault_stats.faults, vm_fault_stats.zero_maps, vm_fault_stats.zero_fills,
+                  vm_fault_stats.mmio_maps, vm_fault_stats.file_fills, vm_fault_stats.unresolved);
+
+    for (rb_node_t *node = rb_first(&vm_regions); node; node = rb_next(node))
+    {
+        vm_region_t *region = rb_entry(node, vm_region_t, node);
+        serial_printf("VMM: region %s 0x%x-0x%x, %d of %d pages resident, %d faults\n", region->name,
+                      region->start, region->end, region->resident, (region->end - region->start) / PAGE_SIZE,
+                      region->faults);
+    }
+}
@@ -3,111 +3,25 @@
 #include "pmm.h"
 #include "string.h"
 #include "serial.h"
+#include "kva.h"
+#include "vm_region.h"
 #include <stdbool.h>
 
-extern uint32_t __kernel_vmem_start;
-
-uint8_t *vmm_bitmap = NULL;
 uint32_t vmm_max_pages = 0;
+static kva_space_t vmm_kernel_space;
+static kva_space_t vmm_mmio_space;
 
-static bool is_page_free(uint32_t page)
-{
-    uint32_t byte_idx = page / 8;
-    uint32_t bit_idx = page % 8;
-    return !(vmm_bitmap[byte_idx] & (1 << bit_idx));
-}
-
-static void vmm_bitmap_init()
-{
-    uint32_t total_phys_mem = pmm_get_total_memory();
-    if (total_phys_mem == 0)
-    {
-        serial_printf("VMM: Total physical memory is zero!\n");
-        return;
-    }
-
-    vmm_max_pages = total_phys_mem / PAGE_SIZE;
-    uint32_t bitmap_size = (vmm_max_pages + 7) / 8;
-    uint32_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    void *bitmap_phys = pmm_alloc_blocks(bitmap_pages);
-    if (!bitmap_phys)
-    {
-        serial_printf("VMM: Failed to allocate bitmap physical memory\n");
-        return;
-    }
-
-    vmm_bitmap = vmm_map_mmio((uintptr_t)bitmap_phys, bitmap_pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE);
-    if (!vmm_bitmap)
-    {
-        serial_printf("VMM: Failed to map bitmap to virtual memory\n");
-        pmm_free_blocks(bitmap_phys, bitmap_pages);
-        return;
-    }
-
-    memset(vmm_bitmap, 0, bitmap_size);
-    serial_printf("VMM: Bitmap initialized with %u pages\n", vmm_max_pages);
-}
-
-static int find_free_page()
-{
-    for (uint32_t i = 0; i < vmm_max_pages; i++)
-    {
-        uint32_t byte_idx = i / 8;
-        uint32_t bit_idx = i % 8;
-        if (!(vmm_bitmap[byte_idx] & (1 << bit_idx)))
-        {
-            return i;
-        }
-    }
-    return -1;
-}
-
-static int find_contiguous_free_pages(uint32_t pages_needed)
-{
-    for (uint32_t i = 0; i < vmm_max_pages; i++)
-    {
-        if (is_page_free(i))
-        {
-            uint32_t j;
-            for (j = 0; j < pages_needed; j++)
-            {
-                if (i + j >= vmm_max_pages || !is_page_free(i + j))
-                    break;
-            }
-            if (j == pages_needed)
-                return i;
-        }
-    }
-    return -1;
-}
-
-static void mark_page(uint32_t page, bool used)
+static void vmm_space_init()
 {
-    uint32_t byte_idx = page / 8;
-    uint32_t bit_idx = page % 8;
-    if (used)
-        vmm_bitmap[byte_idx] |= (1 << bit_idx);
-    else
-        vmm_bitmap[byte_idx] &= ~(1 << bit_idx);
-}
-
-void list_available_pages(void)
-{
-    serial_printf("VMM: Available pages:\n");
-    for (uint32_t i = 0; i < vmm_max_pages; i++)
-    {
-        if (vmm_bitmap[i] == 0)
-        {
-            serial_printf("Page %d is free\n", i);
-        }
-    }
+    vmm_max_pages = (VMALLOC_END - VMALLOC_START) / PAGE_SIZE;
+    kva_init(&vmm_kernel_space, "vmalloc", VMALLOC_START, VMALLOC_END);
+    kva_init(&vmm_mmio_space, "mmio", MMIO_START, MMIO_END);
 }
 
 void vmm_init()
 {
     paging_init();
-    vmm_bitmap_init();
+    vmm_space_init();
 
     uint32_t *pd = get_page_directory();
     if (!pd)
@@ -116,18 +30,8 @@ void vmm_init()
         return;
     }
 
-    extern uint32_t __kernel_physical_start;
-    extern uint32_t __kernel_physical_end;
-    uint32_t kernel_size = (uint32_t)&__kernel_physical_end - (uint32_t)&__kernel_physical_start;
-    uint32_t num_pages = (kernel_size + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    for (uint32_t i = 0; i < num_pages; i++)
-    {
-        uint32_t phys_addr = (uint32_t)&__kernel_physical_start + (i * PAGE_SIZE);
-        uint32_t virt_addr = KERNEL_VMEM_START + (i * PAGE_SIZE);
-        paging_map_page(phys_addr, phys_addr, PAGE_PRESENT | PAGE_WRITABLE);
-        paging_map_page(phys_addr, virt_addr, PAGE_PRESENT | PAGE_WRITABLE);
-    }
+    // The kernel image is covered by the low memory identity map paging_init
+    // built, and reachable through phys_to_virt() in the physmap
 
     paging_enable((uint32_t)pd);
 
@@ -142,62 +46,58 @@ void vmm_init()
         "1:\n");
 }
 
-uint32_t virt_to_phys(void *virt_addr)
+uint32_t vmm_walk_phys(uint32_t virt_addr)
 {
-    uint32_t *pd = get_page_directory();
-    uint32_t pd_index = (uint32_t)virt_addr >> 22;
-    uint32_t pt_index = ((uint32_t)virt_addr >> 12) & 0x3FF;
-    
-    if (!(pd[pd_index] & PAGE_PRESENT))
-        return UINT32_MAX;
-        
-    uint32_t pt_phys = pd[pd_index] & ~0xFFF;
-    
-    uint32_t *pt;
-    if (paging_active) {
-        pt = (uint32_t *)(0xC0000000 + pt_phys);
-    } else {
-        pt = (uint32_t *)pt_phys;
-    }
-    
-    if (!(pt[pt_index] & PAGE_PRESENT))
+    // Before paging every address is physical
+    if (!paging_active)
+        return virt_addr;
+
+    uint32_t pte = paging_get_entry(virt_addr);
+    if (!(pte & PAGE_PRESENT))
         return UINT32_MAX;
-        
-    uint32_t page_phys = pt[pt_index] & ~0xFFF;
-    return page_phys | ((uint32_t)virt_addr & 0xFFF);
+    return (pte & ~0xFFF) | (virt_addr & 0xFFF);
+}
+
+void *fixmap_set(fixmap_slot_t slot, uint32_t phys_addr, uint32_t flags)
+{
+    if (slot >= FIX_COUNT || !paging_map_page(phys_addr, fix_to_virt(slot), flags | PAGE_PRESENT))
+        return NULL;
+    return (void *)fix_to_virt(slot);
 }
 
-uint32_t phys_to_virt(uint32_t phys_addr)
+void fixmap_clear(fixmap_slot_t slot)
 {
-    return phys_addr + KERNEL_VMEM_START;
+    if (slot < FIX_COUNT)
+        paging_unmap_page(fix_to_virt(slot));
 }
 
 void *vmm_alloc_page()
 {
-    int page_index = find_free_page();
-    if (page_index < 0)
+    void *phys_ptr = pmm_alloc_block();
+    if (!phys_ptr)
     {
-        serial_printf("VMM: No free virtual pages available\n");
+        serial_printf("VMM: Failed to allocate physical page\n");
         return NULL;
     }
+    uint32_t phys_addr = (uint32_t)phys_ptr;
+    pmm_set_owner(phys_ptr, 1, PAGE_OWNER_HEAP);
 
-    mark_page(page_index, true);
-    uint32_t virt_addr = KERNEL_VMEM_START + page_index * PAGE_SIZE;
+    if (physmap_covers(phys_addr, PAGE_SIZE))
+        return (void *)phys_to_virt(phys_addr);
 
-    void *phys_ptr = pmm_alloc_block();
-    if (!phys_ptr)
+    uint32_t virt_addr = kva_alloc(&vmm_kernel_space, 1, KVA_NEXT_FIT);
+    if (!virt_addr)
     {
-        serial_printf("VMM: Failed to allocate physical page\n");
-        mark_page(page_index, false);
+        serial_printf("VMM: No free virtual pages available\n");
+        pmm_free_block(phys_ptr);
         return NULL;
     }
-    uint32_t phys_addr = (uint32_t)phys_ptr;
 
     if (!paging_map_page(phys_addr, virt_addr, PAGE_PRESENT | PAGE_WRITABLE))
     {
         serial_printf("VMM: Failed to map physical page to virtual address\n");
         pmm_free_block(phys_ptr);
-        mark_page(page_index, false);
+        kva_release(&vmm_kernel_space, virt_addr, 1);
         return NULL;
     }
 
@@ -220,17 +120,15 @@ void vmm_free_page(void *addr)
         return;
     }
 
-    if (virt_addr < KERNEL_VMEM_START)
+    if (is_physmap_addr(addr))
     {
-        serial_printf("VMM: Invalid virtual address 0x%x\n", virt_addr);
+        pmm_free_block((void *)virt_to_phys(addr));
         return;
     }
 
-    uint32_t page_index = (virt_addr - KERNEL_VMEM_START) / PAGE_SIZE;
-
-    if (page_index >= vmm_max_pages)
+    if (!kva_contains(&vmm_kernel_space, virt_addr))
     {
-        serial_printf("VMM: Page index %u out of bounds\n", page_index);
+        serial_printf("VMM: Invalid virtual address 0x%x\n", virt_addr);
         return;
     }
 
@@ -241,9 +139,9 @@ void vmm_free_page(void *addr)
         return;
     }
 
-    pmm_free_block((void *)phys_addr);
     paging_unmap_page(virt_addr);
-    mark_page(page_index, false);
+    pmm_free_block((void *)phys_addr);
+    kva_release(&vmm_kernel_space, virt_addr, 1);
     serial_printf("VMM: Freed page at V:0x%x P:0x%x\n", virt_addr, phys_addr);
 }
 
@@ -252,45 +150,25 @@ void *vmm_map_mmio(uintptr_t phys_addr, size_t size, uint32_t flags)
     size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     uint32_t pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    int start_index = -1;
-    for (uint32_t i = 0; i < vmm_max_pages; i++)
-    {
-        if (is_page_free(i))
-        {
-            uint32_t j;
-            for (j = 0; j < pages_needed; j++)
-            {
-                if (i + j >= vmm_max_pages || !is_page_free(i + j))
-                    break;
-            }
-            if (j == pages_needed)
-            {
-                start_index = i;
-                break;
-            }
-        }
-    }
-
-    if (start_index < 0)
+    // Give big regions a virtual address congruent to the physical one mod 4MB
+    // so paging_map_range can use large pages for them
+    uint32_t virt_start = 0;
+    if (paging_pse && size >= LARGE_PAGE_SIZE)
+        virt_start = kva_alloc_aligned(&vmm_mmio_space, pages_needed, LARGE_PAGE_SIZE, phys_addr & (LARGE_PAGE_SIZE - 1));
+    if (!virt_start)
+        virt_start = kva_alloc(&vmm_mmio_space, pages_needed, KVA_BEST_FIT);
+    if (!virt_start)
     {
         serial_printf("VMM: Not enough contiguous virtual space for MMIO\n");
         return NULL;
     }
 
-    for (uint32_t i = start_index; i < start_index + pages_needed; i++)
+    if (!paging_map_range(phys_addr, virt_start, size, flags | PAGE_PRESENT | PAGE_WRITABLE))
     {
-        mark_page(i, true);
-    }
-
-    uint32_t virt_start = KERNEL_VMEM_START + start_index * PAGE_SIZE;
-    for (uint32_t i = 0; i < pages_needed; i++) {
-        uintptr_t curr_phys = phys_addr + (i * PAGE_SIZE);
-        uintptr_t curr_virt = virt_start + (i * PAGE_SIZE);
-        
-        if (!paging_map_page(curr_phys, curr_virt, flags | PAGE_PRESENT | PAGE_WRITABLE)) {
-            serial_printf("VMM: Failed to map MMIO page at V:0x%x P:0x%x\n", curr_virt, curr_phys);
-            return NULL;
-        }
+        serial_printf("VMM: Failed to map MMIO range at V:0x%x P:0x%x\n", virt_start, phys_addr);
+        paging_unmap_range(virt_start, size);
+        kva_release(&vmm_mmio_space, virt_start, pages_needed);
+        return NULL;
     }
 
     return (void *)virt_start;
@@ -303,45 +181,35 @@ void *vmm_alloc_contiguous(size_t pages)
         serial_printf("VMM: Invalid page count %d\n", pages);
         return NULL;
     }
-    
-    int start_index = find_contiguous_free_pages(pages);
-    if (start_index == -1)
-    {
-        serial_printf("VMM: No %d contiguous virtual pages available\n", pages);
-        return NULL;
-    }
-    
-    for (uint32_t i = start_index; i < (uint32_t)(start_index + pages); i++)
-    {
-        mark_page(i, true);
-    }
-    
+
     void *phys_ptr = pmm_alloc_contiguous(pages);
     if (!phys_ptr)
     {
-        for (uint32_t i = start_index; i < (uint32_t)(start_index + pages); i++)
-        {
-            mark_page(i, false);
-        }
         serial_printf("VMM: Failed to allocate contiguous physical memory\n");
         return NULL;
     }
-    
+
     uintptr_t phys_start = (uintptr_t)phys_ptr;
-    
-    uintptr_t virt_start = KERNEL_VMEM_START + start_index * PAGE_SIZE;
-    for (uint32_t i = 0; i < pages; i++)
+    if (physmap_covers(phys_start, pages * PAGE_SIZE))
+        return (void *)phys_to_virt(phys_start);
+
+    uint32_t virt_start = kva_alloc(&vmm_kernel_space, pages, KVA_BEST_FIT);
+    if (!virt_start)
+    {
+        pmm_free_contiguous(phys_ptr, pages);
+        serial_printf("VMM: No %d contiguous virtual pages available\n", pages);
+        return NULL;
+    }
+
+    if (!paging_map_range(phys_start, virt_start, pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE))
     {
-        uintptr_t phys_addr = phys_start + (i * PAGE_SIZE);
-        uintptr_t virt_addr = virt_start + (i * PAGE_SIZE);
-        if (!paging_map_page(phys_addr, virt_addr, PAGE_PRESENT | PAGE_WRITABLE))
-        {
-            serial_printf("VMM: Failed to map page %d\n", i);
-            vmm_free_contiguous((void *)virt_start, i);
-            return NULL;
-        }
+        serial_printf("VMM: Failed to map %d pages at V:0x%x\n", pages, virt_start);
+        paging_unmap_range(virt_start, pages * PAGE_SIZE);
+        pmm_free_contiguous(phys_ptr, pages);
+        kva_release(&vmm_kernel_space, virt_start, pages);
+        return NULL;
     }
-    
+
     serial_printf("VMM: Allocated %d contiguous pages V:0x%x P:0x%x\n", pages, virt_start, phys_start);
     return (void *)virt_start;
 }
@@ -361,67 +229,42 @@ void vmm_free_contiguous(void *virt_addr, size_t pages)
         return;
     }
 
-    serial_printf("VMM: Freeing %d pages at V:0x%x P:0x%x\n", pages, (uintptr_t)virt_addr, phys_start);
-    pmm_free_blocks((void *)phys_start, pages);
-
-    uintptr_t virt_start = (uintptr_t)virt_addr;
-    int start_index = (virt_start - KERNEL_VMEM_START) / PAGE_SIZE;
-
-    for (size_t i = 0; i < pages; i++)
+    if (is_physmap_addr(virt_addr))
     {
-        paging_unmap_page(virt_start + (i * PAGE_SIZE));
-        pmm_mark_unused_region(phys_start + (i * PAGE_SIZE), PAGE_SIZE);
-        mark_page(start_index + i, false);
+        pmm_free_blocks((void *)phys_start, pages);
+        return;
     }
+
+    serial_printf("VMM: Freeing %d pages at V:0x%x P:0x%x\n", pages, (uintptr_t)virt_addr, phys_start);
+    uintptr_t virt_start = (uintptr_t)virt_addr;
+    paging_unmap_range(virt_start, pages * PAGE_SIZE);
+    pmm_free_blocks((void *)phys_start, pages);
+    kva_release(&vmm_kernel_space, virt_start, pages);
 }
 
-void *dma_alloc(size_t size)
+uint32_t vmm_reserve_virtual(size_t pages)
 {
-    uintptr_t dma_zone_start = 0x100000;
-    uintptr_t dma_zone_end = 0x1000000;
-    uintptr_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    void *phys = pmm_alloc_blocks_in_range(pages, dma_zone_start, dma_zone_end);
-    if (!phys)
-        return NULL;
-
-    void *virt = vmm_alloc_contiguous(pages);
-    for (uint32_t i = 0; i < pages; i++)
-    {
-        paging_map_page(
-            (uintptr_t)phys + i * PAGE_SIZE,
-            (uintptr_t)virt + i * PAGE_SIZE,
-            PAGE_PRESENT | PAGE_WRITABLE | PAGE_UNCACHED
-        );
-    }
-    return virt;
+    return kva_alloc(&vmm_kernel_space, pages, KVA_BEST_FIT);
 }
 
-void dma_free(void *addr, size_t size)
+uint32_t vmm_reserve_virtual_aligned(size_t pages, uint32_t align)
 {
-    if (!addr || size == 0)
-    {
-        serial_printf("DMA: Invalid address or size\n");
-        return;
-    }
-
-    if (((uintptr_t)addr & (PAGE_SIZE - 1)) != 0)
-    {
-        serial_printf("DMA: Address not page aligned\n");
-        return;
-    }
-
-    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    return kva_alloc_aligned(&vmm_kernel_space, pages, align, 0);
+}
 
-    if (pages > vmm_max_pages)
-    {
-        serial_printf("DMA: Size too large\n");
-        return;
-    }
+void vmm_release_virtual(uint32_t virt_addr, size_t pages)
+{
+    kva_release(&vmm_kernel_space, virt_addr, pages);
+}
 
-    serial_printf("DMA: Freeing %d pages at 0x%x\n", pages, (uintptr_t)addr);
+void *vmm_alloc_region(size_t size, uint32_t flags)
+{
+    return vm_region_create_anon("anon", size, flags, PAGE_OWNER_HEAP);
+}
 
-    vmm_free_contiguous(addr, pages);
+void vmm_free_region(void *addr)
+{
+    vm_region_destroy(addr);
 }
 
 bool vmm_map_userspace(uintptr_t virt_addr, uintptr_t phys_addr, uint32_t flags) {
@@ -441,18 +284,36 @@ void* vmm_alloc_userspace_pages(size_t pages) {
     void* phys = pmm_alloc_blocks(pages);
     if(!phys) return NULL;
 
-    for(uint32_t i = 0; i < pages; i++) {
-        if (!paging_map_page(
-            (uint32_t)phys + i * PAGE_SIZE,
-            virt_addr + i * PAGE_SIZE,
-            PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER
-        )) {
-            for (uint32_t j = 0; j < i; j++) {
-                paging_unmap_page(virt_addr + j * PAGE_SIZE);
-            }
-            pmm_free_blocks(phys, pages);
-            return NULL;
-        }
+    if (!paging_map_range((uint32_t)phys, virt_addr, pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)) {
+        paging_unmap_range(virt_addr, pages * PAGE_SIZE);
+        pmm_free_blocks(phys, pages);
+        return NULL;
     }
     return (void*)virt_addr;
 }
+
+void vmm_print_stats()
+{
+    const kva_space_t *spaces[] = {&vmm_kernel_space, &vmm_mmio_space};
+    serial_printf("VMM: physmap 0x%x-0x%x, identity map 0x0-0x%x\n", PHYSMAP_BASE, PHYSMAP_BASE + physmap_end,
+                  identity_end);
+    for (int i = 0; i < 2; i++)
+        serial_printf("VMM: %s window 0x%x-0x%x, %d of %d pages free in %d extents, largest %d\n", spaces[i]->name,
+                      spaces[i]->start, spaces[i]->end, spaces[i]->free_pages,
+                      (spaces[i]->end - spaces[i]->start) / PAGE_SIZE, spaces[i]->extents,
+                      kva_largest_free(spaces[i]));
+    serial_printf("VMM: TLB %d invlpg, %d CR3 reloads, %d batches; %d pages mapped, %d unmapped\n",
+                  paging_stats.invlpg, paging_stats.cr3_reloads, paging_stats.batches,
+                  paging_stats.pages_mapped, paging_stats.pages_unmapped);
+    vm_region_print_stats();
+}
+
+const kva_space_t *vmm_get_kernel_space()
+{
+    return &vmm_kernel_space;
+}
+
+const kva_space_t *vmm_get_mmio_space()
+{
+    return &vmm_mmio_space;
+}
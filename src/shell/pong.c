@@ -3,6 +3,8 @@
 #include "keyboard.h"
 #include "vesa.h"
 #include "timer.h"
+#include "ktimer.h"
+#include "io.h"
 #include "liballoc.h"
 #include "string.h"
 #include "math.h"
@@ -14,7 +16,7 @@ extern uint32_t g_height;
 #define PADDLE_HEIGHT 40
 #define BALL_SIZE 5
 #define PADDLE_SPEED 10
-#define FRAME_DELAY 15
+#define FRAME_MS 15 // frame period
 #define BORDER_SIZE 2
 
 typedef struct
@@ -27,6 +29,8 @@ static Point ball;
 static int ball_vel_x, ball_vel_y;
 static int player_score = 0;
 static int ai_score = 0;
+static ktimer_t frame_timer;
+static volatile bool frame_due;
 static int ball_base_speed = 5;
 static float ball_speed_multiplier = 1.0;
 
@@ -65,6 +69,27 @@ static void draw_game()
     vesa_swap_buffers();
 }
 
+// Frames start on a fixed schedule, so drawing time does not slow the game
+static void pong_frame_tick(ktimer_t *timer)
+{
+    frame_due = true;
+    ktimer_mod(timer, timer->expires + FRAME_MS);
+}
+
+static bool pong_frame_started(void *arg)
+{
+    (void)arg;
+    if (!frame_due)
+        return false;
+    frame_due = false;
+    return true;
+}
+
+static void pong_wait_frame()
+{
+    halt_until(pong_frame_started, NULL);
+}
+
 void pong_game()
 {
     left_paddle_y = (g_height - PADDLE_HEIGHT) / 2;
@@ -75,6 +100,9 @@ void pong_game()
     ball_vel_y = ball_base_speed;
 
     int running = 1;
+    frame_due = false;
+    ktimer_setup(&frame_timer, pong_frame_tick, NULL);
+    ktimer_start(&frame_timer, FRAME_MS);
     while (running)
     {
         if (kbhit())
@@ -93,6 +121,7 @@ void pong_game()
             }
             else if (c == 'q')
             {
+                ktimer_cancel(&frame_timer);
                 console_clear();
                 console_printf("Exiting Pong game...\n");
                 console_printf("Press any key to continue...\n");
@@ -164,6 +193,6 @@ void pong_game()
         }
 
         draw_game();
-        usleep(FRAME_DELAY);
+        pong_wait_frame();
     }
 }
\ No newline at end of file
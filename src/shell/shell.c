@@ -7,11 +7,22 @@
 #include <kernel.h>
 #include "io.h"
 #include "timer.h"
+#include "ktime.h"
+#include "clockevent.h"
+#include "ktimer.h"
 #include "snake.h"
 #include "vesa.h"
 #include "keyboard.h"
 #include "liballoc.h"
 #include "pmm.h"
+#include "vm_region.h"
+#include "dma.h"
+#include "cma.h"
+#include "slab.h"
+#include "arena.h"
+#include "memops.h"
+#include "sizeclass.h"
+#include "heapprof.h"
 #include "pci.h"
 #include "ide.h"
 #include "fat.h"
@@ -33,6 +44,9 @@ KERNEL_MEMORY_MAP g_kmap;
 
 extern uint32_t g_width;
 extern uint32_t g_height;
+extern uint32_t g_pitch;
+extern uint32_t *g_vbe_buffer;
+extern uint32_t *g_back_buffer;
 
 extern IDE_DEVICE g_ide_devices[MAXIMUM_IDE_DEVICES];
 
@@ -49,13 +63,6 @@ typedef struct
     int lifetime;
 } Particle;
 
-void __cpuid(uint32_t type, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
-{
-    __asm__ volatile("cpuid"
-                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
-                     : "0"(type));
-}
-
 int cpuid_info(int print)
 {
     char brand[49];
@@ -63,16 +70,16 @@ int cpuid_info(int print)
     uint32_t type;
 
     memset(brand, 0, sizeof(brand));
-    __cpuid(0x80000002, (uint32_t *)brand + 0x0, (uint32_t *)brand + 0x1, (uint32_t *)brand + 0x2, (uint32_t *)brand + 0x3);
-    __cpuid(0x80000003, (uint32_t *)brand + 0x4, (uint32_t *)brand + 0x5, (uint32_t *)brand + 0x6, (uint32_t *)brand + 0x7);
-    __cpuid(0x80000004, (uint32_t *)brand + 0x8, (uint32_t *)brand + 0x9, (uint32_t *)brand + 0xa, (uint32_t *)brand + 0xb);
+    cpuid(0x80000002, (uint32_t *)brand + 0x0, (uint32_t *)brand + 0x1, (uint32_t *)brand + 0x2, (uint32_t *)brand + 0x3);
+    cpuid(0x80000003, (uint32_t *)brand + 0x4, (uint32_t *)brand + 0x5, (uint32_t *)brand + 0x6, (uint32_t *)brand + 0x7);
+    cpuid(0x80000004, (uint32_t *)brand + 0x8, (uint32_t *)brand + 0x9, (uint32_t *)brand + 0xa, (uint32_t *)brand + 0xb);
 
     if (print)
     {
         console_printf("Brand: %s\n", brand);
         for (type = 0; type < 4; type++)
         {
-            __cpuid(type, &eax, &ebx, &ecx, &edx);
+            cpuid(type, &eax, &ebx, &ecx, &edx);
             console_printf("type:0x%x, eax:0x%x, ebx:0x%x, ecx:0x%x, edx:0x%x\n", type, eax, ebx, ecx, edx);
         }
     }
@@ -107,8 +114,18 @@ void shutdown()
 
 void timer()
 {
+    const clockevent_device_t *dev = clockevent_get_device();
+    uint32_t events = clockevent_stats.events;
+
     uptime();
     sleep(1);
+    console_printf("clockevent: %s, %s, resolution %d ns\n", dev->name, clockevent_tickless() ? "tickless" : "periodic",
+                   clockevent_resolution_ns());
+    console_printf("interrupts during sleep(1): %d\n", clockevent_stats.events - events);
+    console_printf("events: %d, empty: %d, hrtimers expired: %d, programmed: %d\n", clockevent_stats.events,
+                   clockevent_stats.empty, clockevent_stats.expired, clockevent_stats.programs);
+    console_printf("timer wheel: %d pending, %d expired, %d cascaded, %d wakeups\n", ktimer_stats.pending,
+                   ktimer_stats.expired, ktimer_stats.cascaded, ktimer_stats.wakeups);
 }
 
 void memory()
@@ -118,6 +135,622 @@ void memory()
     console_printf("kernel: %d MB, %d Bytes\n", g_kmap.kernel.k_len / 1024, g_kmap.kernel.k_len);
     console_printf("Used: %d MB, %d Bytes\n", pmm_used_blocks * PMM_BLOCK_SIZE / 1024 / 1024, pmm_used_blocks * PMM_BLOCK_SIZE);
     console_printf("Free: %d MB, %d Bytes\n", (g_kmap.available.size - pmm_used_blocks * PMM_BLOCK_SIZE) / 1024 / 1024, g_kmap.available.size - pmm_used_blocks * PMM_BLOCK_SIZE);
+    for (int i = 0; i < PMM_ZONE_COUNT; i++)
+    {
+        const pmm_zone_t *zone = pmm_get_zone(i);
+        console_printf("Zone %s: %d/%d blocks free (min %d, low %d, high %d)\n", zone->name,
+                       zone->area.free_blocks, zone->end_block - zone->start_block,
+                       zone->watermark_min, zone->watermark_low, zone->watermark_high);
+    }
+
+    console_printf("Physmap: %d MB at 0x%x, identity map %d MB\n", physmap_end / 1024 / 1024, PHYSMAP_BASE,
+                   identity_end / 1024 / 1024);
+    const kva_space_t *kva = vmm_get_kernel_space();
+    console_printf("vmalloc: %d/%d pages free in %d extents, largest %d\n",
+                   kva->free_pages, (kva->end - kva->start) / PAGE_SIZE, kva->extents, kva_largest_free(kva));
+    kva = vmm_get_mmio_space();
+    console_printf("MMIO: %d/%d pages free in %d extents, largest %d\n",
+                   kva->free_pages, (kva->end - kva->start) / PAGE_SIZE, kva->extents, kva_largest_free(kva));
+
+    console_printf("TLB: %d invlpg, %d CR3 reloads, %d batches (%d pages mapped, %d unmapped)\n",
+                   paging_stats.invlpg, paging_stats.cr3_reloads, paging_stats.batches,
+                   paging_stats.pages_mapped, paging_stats.pages_unmapped);
+
+    console_printf("Faults: %d (%d zero maps, %d zero fills, %d mmio, %d file, %d unresolved)\n",
+                   vm_fault_stats.faults, vm_fault_stats.zero_maps, vm_fault_stats.zero_fills,
+                   vm_fault_stats.mmio_maps, vm_fault_stats.file_fills, vm_fault_stats.unresolved);
+
+    console_printf("Zero pool: %d/%d pages, %d hits, %d misses, %d zeroed while idle (%s)\n",
+                   pmm_zero_stats.pages, PMM_ZERO_POOL_SIZE, pmm_zero_stats.hits, pmm_zero_stats.misses,
+                   pmm_zero_stats.refilled, pmm_zero_stats.nt_stores ? "movnti" : "memset");
+    console_printf("CMA: %d/%d blocks claimed, %d lent, %d taken back, %d failed claims\n", cma_stats.claimed,
+                   cma_stats.blocks, cma_stats.lent, cma_stats.reclaimed, cma_stats.failures);
+
+    for (int i = 0; i < DMA_MAX_POOLS; i++)
+    {
+        const dma_pool_t *pool = dma_get_pool(i);
+        if (pool)
+            console_printf("DMA pool %s: %d/%d blocks of %d bytes in use\n", pool->name, pool->in_use,
+                           pool->total, pool->size);
+    }
+
+    for (int i = 0; i < SLAB_MAX_CACHES; i++)
+    {
+        const kmem_cache_t *cache = kmem_get_cache(i);
+        if (cache)
+            console_printf("Slab %s: %d objects of %d bytes, %d slabs of %d pages, %d allocs, %d frees\n",
+                           cache->name, cache->active_objects, cache->size, cache->slabs, 1 << cache->order,
+                           cache->allocs, cache->frees);
+    }
+
+    for (int i = 0; i < ARENA_MAX; i++)
+    {
+        const arena_t *arena = arena_get(i);
+        if (arena)
+            console_printf("Arena %s: %d bytes in use (peak %d), %d allocs, %d resets, %d chunks allocated\n",
+                           arena->name, arena->bytes, arena->peak, arena->allocs, arena->resets,
+                           arena->chunk_allocs);
+    }
+
+    console_printf("Heap: %d/%d window pages mapped, %d grows (%d contiguous), %d pages given back\n",
+                   heap_stats.pages, HEAP_WINDOW_PAGES, heap_stats.grows, heap_stats.contiguous_grows,
+                   heap_stats.released_pages);
+    console_printf("Size classes: %d/%d window pages, %d fallbacks\n", sizeclass_stats.pages_used,
+                   SIZECLASS_WINDOW_PAGES, sizeclass_stats.fallbacks);
+    for (int i = 0; i < SIZECLASS_COUNT; i++)
+    {
+        const sizeclass_t *class = sizeclass_get(i);
+        if (class->pages)
+            console_printf("  %d bytes: %d in use, %d free, %d pages, %d refills\n", class->size, class->in_use,
+                           class->free, class->pages, class->refills);
+    }
+
+    uint32_t owners[PAGE_OWNER_COUNT];
+    pmm_count_owners(owners);
+    console_printf("Pages by owner:");
+    for (int i = 0; i < PAGE_OWNER_COUNT; i++)
+    {
+        if (owners[i])
+            console_printf(" %s %d", pmm_owner_name(i), owners[i]);
+    }
+    console_printf("\n");
+}
+
+#define PMM_BENCH_BLOCKS 4096
+#define PMM_BENCH_RUN 16
+
+// Cycles per pmm operation, run under different -m sizes to compare allocators
+void pmm_bench()
+{
+    void **blocks = malloc(PMM_BENCH_BLOCKS * sizeof(void *));
+    if (!blocks)
+    {
+        console_printf("pmmbench: allocation failed\n");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < PMM_BENCH_BLOCKS; i++)
+        blocks[i] = pmm_alloc_block();
+    uint32_t fill = (uint32_t)(rdtsc() - start) / PMM_BENCH_BLOCKS;
+
+    // punch holes so the next round has to search past used words
+    for (int i = 0; i < PMM_BENCH_BLOCKS; i += 2)
+        if (blocks[i])
+            pmm_free_block(blocks[i]);
+
+    start = rdtsc();
+    for (int i = 0; i < PMM_BENCH_BLOCKS; i += 2)
+        blocks[i] = pmm_alloc_block();
+    uint32_t holes = (uint32_t)(rdtsc() - start) / (PMM_BENCH_BLOCKS / 2);
+
+    start = rdtsc();
+    for (int i = 0; i < PMM_BENCH_BLOCKS; i++)
+        if (blocks[i])
+            pmm_free_block(blocks[i]);
+    uint32_t release = (uint32_t)(rdtsc() - start) / PMM_BENCH_BLOCKS;
+
+    int runs = PMM_BENCH_BLOCKS / PMM_BENCH_RUN;
+    start = rdtsc();
+    for (int i = 0; i < runs; i++)
+        blocks[i] = pmm_alloc_blocks(PMM_BENCH_RUN);
+    uint32_t run = (uint32_t)(rdtsc() - start) / runs;
+
+    for (int i = 0; i < runs; i++)
+        if (blocks[i])
+            pmm_free_blocks(blocks[i], PMM_BENCH_RUN);
+
+    free(blocks);
+
+    console_printf("pmm: %d blocks, %d used\n", pmm_get_max_blocks(), pmm_used_blocks);
+    console_printf("  alloc_block (fill):  %d cycles\n", fill);
+    console_printf("  alloc_block (holes): %d cycles\n", holes);
+    console_printf("  free_block:          %d cycles\n", release);
+    console_printf("  alloc_blocks(%d):    %d cycles\n", PMM_BENCH_RUN, run);
+}
+
+#define FB_BENCH_FRAMES 4
+
+static void fb_bench_run(uint32_t *swap, uint32_t *pixels)
+{
+    uint64_t start = rdtsc();
+    for (int i = 0; i < FB_BENCH_FRAMES; i++)
+        vesa_swap_buffers();
+    *swap = (uint32_t)(rdtsc() - start) / FB_BENCH_FRAMES;
+
+    // What console drawing does: read and write every pixel of the back buffer
+    start = rdtsc();
+    for (uint32_t y = 0; y < g_height; y++)
+        for (uint32_t x = 0; x < g_width; x++)
+            vbe_putpixel(x, y, vbe_getpixel(x, y));
+    *pixels = (uint32_t)(rdtsc() - start);
+}
+
+// Cycles per frame with both buffers uncached (the old mappings) and with WC/WB
+void fb_bench()
+{
+    uint32_t size = g_height * g_pitch;
+    uint32_t swap_uc, pixels_uc, swap, pixels;
+
+    vesa_enable_vsync(false);
+
+    // First pass faults the back buffer in so neither measurement pays for it
+    fb_bench_run(&swap, &pixels);
+
+    paging_set_cache((uint32_t)g_vbe_buffer, size, PAGE_UNCACHED);
+    paging_set_cache((uint32_t)g_back_buffer, size, PAGE_UNCACHED);
+    fb_bench_run(&swap_uc, &pixels_uc);
+
+    paging_set_cache((uint32_t)g_vbe_buffer, size, PAGE_WC);
+    paging_set_cache((uint32_t)g_back_buffer, size, PAGE_WB);
+    fb_bench_run(&swap, &pixels);
+
+    vesa_enable_vsync(true);
+
+    console_printf("fbbench: %dx%d, %d KB per frame, PAT %s\n", g_width, g_height, size / 1024,
+                   paging_pat ? "on" : "off (WC is write-through)");
+    console_printf("  swap   UC->UC: %d cycles, WB->WC: %d cycles (%dx)\n", swap_uc, swap,
+                   swap ? swap_uc / swap : 0);
+    console_printf("  pixels UC:     %d cycles, WB:     %d cycles (%dx)\n", pixels_uc, pixels,
+                   pixels ? pixels_uc / pixels : 0);
+}
+
+#define MALLOC_BENCH_SLOTS 1024
+#define MALLOC_BENCH_CHURN 16384
+
+typedef struct
+{
+    uint32_t fill;
+    uint32_t churn;
+    uint32_t release;
+} malloc_bench_result_t;
+
+// Mostly small objects with a tail up to 2KB, roughly what the network and FAT code ask for
+static uint32_t malloc_bench_size(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    uint32_t r = *seed >> 16;
+    if ((r & 7) < 6)
+        return 8 + (r >> 3) % 120;
+    return 128 + (r >> 3) % 1920;
+}
+
+static void malloc_bench_run(void *(*alloc)(size_t), void (*release)(void *), void **slots,
+                             malloc_bench_result_t *result)
+{
+    uint32_t seed = 1;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < MALLOC_BENCH_SLOTS; i++)
+    {
+        slots[i] = alloc(malloc_bench_size(&seed));
+        if (slots[i])
+            *(uint8_t *)slots[i] = i;
+    }
+    result->fill = (uint32_t)(rdtsc() - start) / MALLOC_BENCH_SLOTS;
+
+    // Free a random slot and put an object of a different size in its place
+    start = rdtsc();
+    for (int i = 0; i < MALLOC_BENCH_CHURN; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 16) % MALLOC_BENCH_SLOTS;
+        release(slots[slot]);
+        slots[slot] = alloc(malloc_bench_size(&seed));
+        if (slots[slot])
+            *(uint8_t *)slots[slot] = i;
+    }
+    result->churn = (uint32_t)(rdtsc() - start) / MALLOC_BENCH_CHURN;
+
+    start = rdtsc();
+    for (int i = 0; i < MALLOC_BENCH_SLOTS; i++)
+        release(slots[i]);
+    result->release = (uint32_t)(rdtsc() - start) / MALLOC_BENCH_SLOTS;
+}
+
+// Cycles per operation with and without the size classes in front of the boundary tag allocator.
+// Neither side goes through the heap profiler hooks of malloc/free, so only the allocators differ.
+void malloc_bench()
+{
+    void **slots = malloc(MALLOC_BENCH_SLOTS * sizeof(void *));
+    if (!slots)
+    {
+        console_printf("mallocbench: allocation failed\n");
+        return;
+    }
+
+    malloc_bench_result_t tagged, classes;
+    malloc_bench_run(liballoc_malloc_tagged, liballoc_free_tagged, slots, &tagged);
+    malloc_bench_run(liballoc_malloc_classes, liballoc_free_classes, slots, &classes);
+
+    free(slots);
+
+    console_printf("mallocbench: %d objects, %d alloc/free pairs, both sides without heap profiling\n",
+                   MALLOC_BENCH_SLOTS, MALLOC_BENCH_CHURN);
+    console_printf("  fill:    liballoc %d cycles, size classes %d cycles\n", tagged.fill, classes.fill);
+    console_printf("  churn:   liballoc %d cycles, size classes %d cycles (%dx)\n", tagged.churn, classes.churn,
+                   classes.churn ? tagged.churn / classes.churn : 0);
+    console_printf("  release: liballoc %d cycles, size classes %d cycles\n", tagged.release, classes.release);
+}
+
+#define MEM_BENCH_BUFFER (4 * 1024 * 1024)
+#define MEM_BENCH_BYTES  (16 * 1024 * 1024) // moved per measurement
+
+static const uint32_t mem_bench_sizes[] = {4096, 65536, 1024 * 1024, MEM_BENCH_BUFFER};
+
+// Bytes per 100 cycles, printed as bytes per cycle with two decimals
+static void mem_bench_print(const char *label, uint32_t size, uint64_t cycles)
+{
+    // Past 2^32 cycles the rate is below 0.01 and prints as 0 anyway
+    uint32_t rate = cycles && cycles <= UINT32_MAX ? div_u64((uint64_t)MEM_BENCH_BYTES * 100, cycles) : 0;
+    console_printf("  %s %d KB: %d.%02d bytes/cycle\n", label, size / 1024, rate / 100, rate % 100);
+}
+
+// memcpy/memset bandwidth of every implementation the CPU supports, at sizes from L1 to well past L2
+void mem_bench()
+{
+    uint8_t *src = malloc(MEM_BENCH_BUFFER);
+    uint8_t *dst = malloc(MEM_BENCH_BUFFER);
+    if (!src || !dst)
+    {
+        console_printf("membench: allocation failed\n");
+        free(src);
+        free(dst);
+        return;
+    }
+    memset(src, 0x5A, MEM_BENCH_BUFFER);
+    memset(dst, 0, MEM_BENCH_BUFFER);
+
+    console_printf("membench: ERMS %s, SSE2 %s; memcpy uses %s, then %s from %d KB\n", memops.erms ? "yes" : "no",
+                   memops.sse2 ? "yes" : "no", memops_impl_name(memops.medium), memops_impl_name(memops.large),
+                   MEMOPS_NT_THRESHOLD / 1024);
+
+    for (int impl = 0; impl < MEMOPS_IMPL_COUNT; impl++)
+    {
+        if (!memops_available(impl))
+            continue;
+        const char *name = memops_impl_name(impl);
+
+        for (uint32_t i = 0; i < sizeof(mem_bench_sizes) / sizeof(mem_bench_sizes[0]); i++)
+        {
+            uint32_t size = mem_bench_sizes[i];
+            uint32_t rounds = MEM_BENCH_BYTES / size;
+
+            uint64_t start = rdtsc();
+            for (uint32_t r = 0; r < rounds; r++)
+                memcpy_impl(impl, dst, src, size);
+            uint64_t copy = rdtsc() - start;
+
+            start = rdtsc();
+            for (uint32_t r = 0; r < rounds; r++)
+                memset_impl(impl, dst, r, size);
+            uint64_t fill = rdtsc() - start;
+
+            console_printf("%s", name);
+            mem_bench_print(" memcpy", size, copy);
+            console_printf("%s", name);
+            mem_bench_print(" memset", size, fill);
+        }
+    }
+
+    free(src);
+    free(dst);
+}
+
+// Byte-at-a-time references for strbench, the way string.c used to do it
+static size_t ref_strlen(const char *s)
+{
+    size_t len = 0;
+    while (s[len])
+        len++;
+    return len;
+}
+
+static int ref_strcmp(const char *s1, const char *s2)
+{
+    while (*s1 && *s1 == *s2)
+    {
+        s1++;
+        s2++;
+    }
+    return (uint8_t)*s1 - (uint8_t)*s2;
+}
+
+static int ref_memcmp(const void *s1, const void *s2, size_t n)
+{
+    const uint8_t *p1 = s1, *p2 = s2;
+    for (size_t i = 0; i < n; i++)
+        if (p1[i] != p2[i])
+            return p1[i] - p2[i];
+    return 0;
+}
+
+static char *ref_strchr(const char *s, int c)
+{
+    for (;; s++)
+    {
+        if (*s == (char)c)
+            return (char *)s;
+        if (!*s)
+            return NULL;
+    }
+}
+
+static char *ref_strstr(const char *h, const char *n)
+{
+    size_t len = ref_strlen(n);
+    for (;; h++)
+    {
+        size_t i = 0;
+        while (i < len && h[i] == n[i])
+            i++;
+        if (i == len)
+            return (char *)h;
+        if (!*h)
+            return NULL;
+    }
+}
+
+static inline int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+#define STR_BENCH_CHECKS 4000
+#define STR_BENCH_CALLS  200
+
+static uint32_t str_bench_seed;
+
+static uint32_t str_bench_rand()
+{
+    str_bench_seed = str_bench_seed * 1103515245 + 12345;
+    return str_bench_seed >> 8;
+}
+
+// Small alphabets so comparisons and searches see long partial matches
+static void str_bench_fill(char *s, size_t len, int alphabet)
+{
+    for (size_t i = 0; i < len; i++)
+        s[i] = 'a' + str_bench_rand() % alphabet;
+    s[len] = '\0';
+}
+
+// Random strings at random alignments; returns how many results differ from the references
+static int str_bench_check(char *a, char *b, char *needle)
+{
+    int failures = 0;
+    for (int i = 0; i < STR_BENCH_CHECKS; i++)
+    {
+        int alphabet = 1 + str_bench_rand() % 4;
+        size_t len = str_bench_rand() % (i % 64 == 0 ? 2000 : 160);
+        char *s1 = a + str_bench_rand() % 16;
+        char *s2 = b + str_bench_rand() % 16;
+        str_bench_fill(s1, len, alphabet);
+        memcpy(s2, s1, len + 1);
+        if (len && (str_bench_rand() & 1))
+            s2[str_bench_rand() % len] = (str_bench_rand() & 1) ? 'a' + str_bench_rand() % 5 : '\0';
+        size_t len2 = ref_strlen(s2);
+
+        int c = (str_bench_rand() % 8) ? 'a' + str_bench_rand() % 5 : '\0';
+        size_t nlen = str_bench_rand() % (i % 8 == 0 ? 40 : 6);
+        if (nlen && len > nlen && (str_bench_rand() & 1))
+            memcpy(needle, s1 + str_bench_rand() % (len - nlen), nlen), needle[nlen] = '\0';
+        else
+            str_bench_fill(needle, nlen, alphabet);
+
+        size_t common = len < len2 ? len : len2;
+        failures += strlen(s1) != len || strlen(s2) != len2;
+        failures += sign(strcmp(s1, s2)) != sign(ref_strcmp(s1, s2));
+        failures += sign(memcmp(s1, s2, common)) != sign(ref_memcmp(s1, s2, common));
+        failures += strchr(s1, c) != ref_strchr(s1, c);
+        failures += strstr(s1, needle) != ref_strstr(s1, needle);
+    }
+    return failures;
+}
+
+#define STR_BENCH_TIME(call)                                 \
+    ({                                                       \
+        uint64_t start = rdtsc();                            \
+        for (int r = 0; r < STR_BENCH_CALLS; r++)            \
+            call;                                            \
+        (uint32_t)(rdtsc() - start) / STR_BENCH_CALLS;       \
+    })
+
+// Property checks against the byte loops, then cycles per call for both
+void str_bench()
+{
+    static const uint32_t lengths[] = {8, 64, 1024};
+    char *a = malloc(4096);
+    char *b = malloc(4096);
+    char *needle = malloc(64);
+    if (!a || !b || !needle)
+    {
+        console_printf("strbench: allocation failed\n");
+        free(a);
+        free(b);
+        free(needle);
+        return;
+    }
+
+    str_bench_seed = get_ticks();
+    int failures = str_bench_check(a, b, needle);
+    console_printf("strbench: %d random cases, %d mismatches against the byte loops\n", STR_BENCH_CHECKS, failures);
+
+    for (uint32_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        uint32_t len = lengths[i];
+        str_bench_fill(a, len, 4);
+        memcpy(b, a, len + 1);
+        // The needle is the last 8 bytes with one changed, so the search runs to the end
+        memcpy(needle, a + len - 8, 8);
+        needle[8] = '\0';
+        needle[0] = 'z';
+        volatile uintptr_t sink = 0;
+
+        console_printf("  %d bytes (cycles, byte loop -> new):", len);
+        console_printf(" strlen %d->%d", STR_BENCH_TIME(sink += ref_strlen(a)), STR_BENCH_TIME(sink += strlen(a)));
+        console_printf(" strcmp %d->%d", STR_BENCH_TIME(sink += ref_strcmp(a, b)), STR_BENCH_TIME(sink += strcmp(a, b)));
+        console_printf(" memcmp %d->%d", STR_BENCH_TIME(sink += ref_memcmp(a, b, len)),
+                       STR_BENCH_TIME(sink += memcmp(a, b, len)));
+        console_printf(" strchr %d->%d", STR_BENCH_TIME(sink += (uintptr_t)ref_strchr(a, 'z')),
+                       STR_BENCH_TIME(sink += (uintptr_t)strchr(a, 'z')));
+        console_printf(" strstr %d->%d\n", STR_BENCH_TIME(sink += (uintptr_t)ref_strstr(a, needle)),
+                       STR_BENCH_TIME(sink += (uintptr_t)strstr(a, needle)));
+    }
+
+    free(a);
+    free(b);
+    free(needle);
+}
+
+#define CTX_BENCH_PAGES  64 // kernel pages touched on each side, 4KB mappings so each is its own TLB entry
+#define CTX_BENCH_ROUNDS 1000
+
+static void ctx_bench_touch(volatile uint32_t *pages)
+{
+    for (int i = 0; i < CTX_BENCH_PAGES; i++)
+        (void)pages[i * (PAGE_SIZE / sizeof(uint32_t))];
+}
+
+// Cycles per round trip to `other` and back, optionally touching the pages on both sides
+static uint32_t ctx_bench_run(uint32_t other, volatile uint32_t *pages, bool touch)
+{
+    uint32_t kernel = paging_kernel_directory();
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (int r = 0; r < CTX_BENCH_ROUNDS; r++)
+    {
+        paging_switch_directory(other);
+        if (touch)
+            ctx_bench_touch(pages);
+        paging_switch_directory(kernel);
+        if (touch)
+            ctx_bench_touch(pages);
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start) / CTX_BENCH_ROUNDS;
+    irq_restore(flags);
+    return cycles;
+}
+
+// What global kernel mappings save on an address-space switch: the TLB refills of kernel pages
+void ctx_bench()
+{
+    uint32_t other = paging_create_directory();
+    volatile uint32_t *pages = vm_region_create_anon("ctxbench", CTX_BENCH_PAGES * PAGE_SIZE,
+                                                     PAGE_PRESENT | PAGE_WRITABLE, PAGE_OWNER_HEAP);
+    if (!other || !pages)
+    {
+        console_printf("ctxbench: allocation failed\n");
+        if (other)
+            paging_destroy_directory(other);
+        if (pages)
+            vm_region_destroy((void *)pages);
+        return;
+    }
+    for (int i = 0; i < CTX_BENCH_PAGES; i++)
+        pages[i * (PAGE_SIZE / sizeof(uint32_t))] = i;
+
+    bool was = paging_set_global(false);
+    uint32_t switch_local = ctx_bench_run(other, pages, false);
+    uint32_t touch_local = ctx_bench_run(other, pages, true);
+    paging_set_global(true);
+    bool pge = paging_pge;
+    uint32_t switch_global = ctx_bench_run(other, pages, false);
+    uint32_t touch_global = ctx_bench_run(other, pages, true);
+    paging_set_global(was);
+
+    vm_region_destroy((void *)pages);
+    paging_destroy_directory(other);
+
+    console_printf("ctxbench: %d round trips between two address spaces, %d kernel pages touched per side\n",
+                   CTX_BENCH_ROUNDS, CTX_BENCH_PAGES);
+    console_printf("  no global pages: %d cycles switching, %d with touches\n", switch_local, touch_local);
+    if (!pge)
+    {
+        console_printf("  CPU has no PGE\n");
+        return;
+    }
+    console_printf("  global pages:    %d cycles switching, %d with touches\n", switch_global, touch_global);
+    if (touch_local > touch_global)
+        console_printf("  saved %d cycles per round trip, %d per page refill\n", touch_local - touch_global,
+                       (touch_local - touch_global) / (2 * CTX_BENCH_PAGES));
+}
+
+#define HEAPSTAT_TOP 10
+
+// Live heap by call site and by subsystem, with alloc rates since the previous heapstat
+void heap_stat()
+{
+    uint32_t elapsed = get_ticks() - heapprof_stats.mark_ticks;
+    uint32_t tag_bytes[HEAP_TAG_COUNT];
+    uint32_t tag_count[HEAP_TAG_COUNT];
+    uint32_t tag_allocs[HEAP_TAG_COUNT];
+    memset(tag_bytes, 0, sizeof(tag_bytes));
+    memset(tag_count, 0, sizeof(tag_count));
+    memset(tag_allocs, 0, sizeof(tag_allocs));
+
+    console_printf("heap: %d bytes in %d objects (peak %d), %d allocs, %d frees, %d untracked\n",
+                   heapprof_stats.live_bytes, heapprof_stats.live_count, heapprof_stats.peak_bytes,
+                   heapprof_stats.allocs, heapprof_stats.frees, heapprof_stats.untracked);
+
+    // Selection of the largest sites, each round takes the biggest one below the previous pick
+    const heapprof_site_t *prev = NULL;
+    for (int n = 0; n < HEAPSTAT_TOP; n++)
+    {
+        const heapprof_site_t *best = NULL;
+        for (int i = 0; i < HEAPPROF_SITE_SLOTS; i++)
+        {
+            const heapprof_site_t *site = heapprof_get_site(i);
+            if (!site)
+                continue;
+            if (prev && (site->live_bytes > prev->live_bytes || (site->live_bytes == prev->live_bytes && site >= prev)))
+                continue;
+            if (!best || site->live_bytes > best->live_bytes || (site->live_bytes == best->live_bytes && site > best))
+                best = site;
+        }
+        if (!best)
+            break;
+
+        uint32_t rate = elapsed ? (best->allocs - best->allocs_at_mark) * g_freq_hz / elapsed : 0;
+        console_printf("  0x%08x %s: %d bytes in %d objects, %d allocs/s\n", best->caller,
+                       heapprof_tag_name(best->tag), best->live_bytes, best->live_count, rate);
+        prev = best;
+    }
+
+    for (int i = 0; i < HEAPPROF_SITE_SLOTS; i++)
+    {
+        const heapprof_site_t *site = heapprof_get_site(i);
+        if (!site)
+            continue;
+        tag_bytes[site->tag] += site->live_bytes;
+        tag_count[site->tag] += site->live_count;
+        tag_allocs[site->tag] += site->allocs - site->allocs_at_mark;
+    }
+    for (int i = 0; i < HEAP_TAG_COUNT; i++)
+        console_printf("  tag %s: %d bytes in %d objects, %d allocs/s\n", heapprof_tag_name(i), tag_bytes[i],
+                       tag_count[i], elapsed ? tag_allocs[i] * g_freq_hz / elapsed : 0);
+
+    heapprof_mark();
 }
 
 void ftoa(char *buf, float f)
@@ -515,7 +1148,7 @@ void show_arp_cache()
     console_printf("IP Address        MAC Address               Age\n");
     console_printf("-----------------------------------------------\n");
 
-    uint32_t current_time = get_ticks();
+    uint32_t current_time = ktime_get_ms();
 
     for (int i = 0; i < ARP_CACHE_SIZE; i++)
     {
@@ -535,7 +1168,7 @@ void show_arp_cache()
                            arp_cache[i].mac[4], arp_cache[i].mac[5]);
 
             // Calculate age in seconds
-            uint32_t age = (current_time - arp_cache[i].timestamp) / 100; // Since timer runs at 100Hz
+            uint32_t age = (current_time - arp_cache[i].timestamp) / MSEC_PER_SEC;
             console_printf("     %ds\n", age);
         }
     }
@@ -614,6 +1247,30 @@ static int telnet_filter(uint8_t *data, int len, char *out, int outsz) {
     return o;
 }
 
+typedef struct
+{
+    tcp_connection_t *conn;
+    volatile bool timed_out;
+} telnet_wait_t;
+
+static void telnet_timed_out(ktimer_t *timer)
+{
+    ((telnet_wait_t *)timer->data)->timed_out = true;
+}
+
+static bool telnet_connect_done(void *arg)
+{
+    telnet_wait_t *wait = arg;
+    return wait->conn->state == TCP_ESTABLISHED || wait->timed_out;
+}
+
+// Keyboard and NIC interrupts bring the next thing to do
+static bool telnet_has_work(void *arg)
+{
+    tcp_connection_t *conn = arg;
+    return conn->state != TCP_ESTABLISHED || conn->recv_buffer_len > 0 || kbhit();
+}
+
 void telnet_command(char *args) {
     char *ip_str = strtok(args, " ");
     char *port_str = strtok(NULL, " ");
@@ -631,10 +1288,13 @@ void telnet_command(char *args) {
         return;
     }
 
-    uint32_t start = get_ticks();
-    while (conn->state != TCP_ESTABLISHED && get_ticks() - start < 500) {
-        check_tcp_timers();
-    }
+    // Retransmissions run from the timer interrupt; just sleep until the handshake or the deadline
+    ktimer_t timeout;
+    telnet_wait_t wait = {.conn = conn, .timed_out = false};
+    ktimer_setup(&timeout, telnet_timed_out, &wait);
+    ktimer_start(&timeout, 5000);
+    halt_until(telnet_connect_done, &wait);
+    ktimer_cancel(&timeout);
 
     if (conn->state != TCP_ESTABLISHED) {
         console_printf("Connection timed out\n");
@@ -648,17 +1308,18 @@ void telnet_command(char *args) {
     tcp_send_segment(conn, TCP_PSH | TCP_ACK, will_sga, 3);
 
     while (conn->state == TCP_ESTABLISHED) {
-        check_tcp_timers();
-
         if (conn->recv_buffer_len > 0) {
             char filtered[sizeof(conn->recv_buffer) + 1];
+            // The NIC interrupt appends to recv_buffer, take it in one piece
+            uint32_t irq = irq_save();
             int outlen = telnet_filter((uint8_t*)conn->recv_buffer, conn->recv_buffer_len, filtered, sizeof(filtered));
+            conn->recv_buffer_len = 0;
+            irq_restore(irq);
             if (outlen > 0) {
                 for (int i = 0; i < outlen; ++i)
                     console_putchar(filtered[i]);
                 console_flush();
             }
-            conn->recv_buffer_len = 0;
         }
 
         if (kbhit()) {
@@ -682,6 +1343,7 @@ void telnet_command(char *args) {
 
         if (conn->state == TCP_CLOSE_WAIT || conn->state == TCP_LAST_ACK || conn->state == TCP_CLOSED)
             break;
+        halt_until(telnet_has_work, conn);
     }
 
     console_printf("\nConnection closed\n");
@@ -704,6 +1366,7 @@ void shell()
 
     fat32_find_file(&fat_volume, "/", &fat_root);
 
+    heapprof_set_tag(HEAP_TAG_SHELL);
     while (1)
     {
         console_printf(shell);
@@ -731,23 +1394,30 @@ void shell()
             console_printf("|   * cd <path> - Change directory            |\n");
             console_printf("|   * clear - Clear the console screen        |\n");
             console_printf("|   * cpuid - Display CPU information         |\n");
+            console_printf("|   * ctxbench - Benchmark address-space swap |\n");
             console_printf("|   * echo - Echo a message to the console    |\n");
+            console_printf("|   * fbbench - Benchmark framebuffer access  |\n");
             // console_printf("|   * elf - Execute ELF file EXPERIMENTAL     |\n");
             console_printf("|   * fireworks - Fireworks effect            |\n");
             console_printf("|   * haiku - Display a haiku                 |\n");
+            console_printf("|   * heapstat [dump] - Heap usage by caller  |\n");
             console_printf("|   * help - Display this help message        |\n");
             console_printf("|   * hwinfo - Display hardware information   |\n");
             console_printf("|   * ip - Display network interface info     |\n");
             console_printf("|   * ls - List files in current directory    |\n");
             console_printf("|   * lspci - Display PCI information         |\n");
             console_printf("|   * malloc - Test memory allocation         |\n");
+            console_printf("|   * mallocbench - Benchmark malloc/free     |\n");
+            console_printf("|   * membench - Benchmark memcpy/memset      |\n");
             console_printf("|   * memory - Display system memory          |\n");
             console_printf("|   * ping - Send ICMP echo request           |\n");
+            console_printf("|   * pmmbench - Benchmark page allocator     |\n");
             console_printf("|   * pong - Play a game of Pong              |\n");
             console_printf("|   * pwd - Print current directory           |\n");
             console_printf("|   * reboot - Reboot the system              |\n");
             console_printf("|   * shutdown - Shut down the system         |\n");
             console_printf("|   * snake - Play a game of Snake            |\n");
+            console_printf("|   * strbench - Check and time string funcs  |\n");
             console_printf("|   * timer - Display system timer            |\n");
             console_printf("|   * vesa - Display VESA graphics            |\n");
             console_printf("|   * version - Display Hal OS version        |\n");
@@ -755,7 +1425,7 @@ void shell()
         }
         else if (strcmp(buffer, "help /f") == 0)
         {
-            console_printf("arp, cd, clear, cpuid, echo, fireworks, haiku, help, hwinfo, ls, lspci, malloc, memory, ping, pong, pwd, reboot, shutdown, snake, timer, vesa, version\n");
+            console_printf("arp, cd, clear, cpuid, ctxbench, echo, fbbench, fireworks, haiku, heapstat, help, hwinfo, ls, lspci, malloc, mallocbench, membench, memory, ping, pmmbench, pong, pwd, reboot, shutdown, snake, strbench, timer, vesa, version\n");
         }
         else if(strncmp(buffer, "telnet", 6) == 0)
         {
@@ -771,17 +1441,15 @@ void shell()
             FAT32_File file;
             if (fat32_find_file(&fat_volume, filename, &file))
             {
-                char *file_buffer = malloc(file.size + 1);
+                char *file_buffer = fat32_map_file(&fat_volume, &file);
                 if (file_buffer)
                 {
-                    fat32_read_file(&fat_volume, &file, 0, file_buffer, file.size);
-                    file_buffer[file.size] = '\0';
                     console_printf("%s\n", file_buffer);
-                    free(file_buffer);
+                    fat32_unmap_file(file_buffer);
                 }
                 else
                 {
-                    console_printf("Error: Memory allocation failed\n");
+                    console_printf("Error: Failed to map file\n");
                 }
             }
             else
@@ -853,6 +1521,39 @@ void shell()
         {
             memory();
         }
+        else if (strcmp(buffer, "heapstat") == 0)
+        {
+            heap_stat();
+        }
+        else if (strcmp(buffer, "heapstat dump") == 0)
+        {
+            heapprof_dump_serial();
+            console_printf("heapstat: dumped to serial\n");
+        }
+        else if (strcmp(buffer, "ctxbench") == 0)
+        {
+            ctx_bench();
+        }
+        else if (strcmp(buffer, "membench") == 0)
+        {
+            mem_bench();
+        }
+        else if (strcmp(buffer, "strbench") == 0)
+        {
+            str_bench();
+        }
+        else if (strcmp(buffer, "mallocbench") == 0)
+        {
+            malloc_bench();
+        }
+        else if (strcmp(buffer, "pmmbench") == 0)
+        {
+            pmm_bench();
+        }
+        else if (strcmp(buffer, "fbbench") == 0)
+        {
+            fb_bench();
+        }
         else if (strcmp(buffer, "lspci") == 0)
         {
             pci_print_devices();
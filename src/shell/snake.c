@@ -1,5 +1,7 @@
 #include "console.h"
 #include "timer.h"
+#include "ktimer.h"
+#include "io.h"
 #include "keyboard.h"
 #include "vesa.h"
 #include "kernel.h"
@@ -17,6 +19,7 @@ extern uint32_t g_height;
 #define BOARD_WIDTH (g_width / CELL_SIZE - 4)
 #define BOARD_HEIGHT (g_height / CELL_SIZE - 4)
 #define SNAKE_MAX_LENGTH 100
+#define STEP_MS 10 // input poll and redraw period, the snake moves every update_threshold steps
 
 // Colors
 #define COLOR_BORDER 0x00FFFFFF
@@ -41,6 +44,8 @@ static Snake snake;
 static Point food;
 static int game_over;
 static int score;
+static ktimer_t step_timer;
+static volatile bool step_due;
 
 // Function declarations
 static void init_graphics(void);
@@ -222,6 +227,26 @@ static void init_graphics(void)
     console_clear();
 }
 
+static void snake_step_tick(ktimer_t *timer)
+{
+    step_due = true;
+    ktimer_mod(timer, timer->expires + STEP_MS);
+}
+
+static bool snake_step_started(void *arg)
+{
+    (void)arg;
+    if (!step_due)
+        return false;
+    step_due = false;
+    return true;
+}
+
+static void snake_wait_step()
+{
+    halt_until(snake_step_started, NULL);
+}
+
 void snake_game()
 {
     console_clear();
@@ -232,7 +257,9 @@ void snake_game()
     int update_counter = 0;
     int update_threshold = 25;
     int length_threshold = 5;
-    const int sleep_time = 10000;
+    step_due = false;
+    ktimer_setup(&step_timer, snake_step_tick, NULL);
+    ktimer_start(&step_timer, STEP_MS);
 
     while (!game_over)
     {
@@ -253,9 +280,10 @@ void snake_game()
             length_threshold += 5;
         }
         update_counter++;
-        usleep(sleep_time);
+        snake_wait_step();
         vesa_swap_buffers();
     }
+    ktimer_cancel(&step_timer);
 
     // Clear screen again
     console_clear();